@@ -7,7 +7,8 @@
       #define CAMERA_IMPLEMENTATION
    before you include this file in *one* C or C++ file to create the implementation.
 
-   Currently only a single global camera device can be handled at a time.
+   Every camera_xxx function works on a default camera, use the camera_xxx_ex
+   versions with a Cam_Camera handle to work with multiple devices at once.
 */
 package camera
 
@@ -26,6 +27,20 @@ LogLevel :: enum u32 {
 IoMethod :: enum u32 {
 	MMAP = 0,
 	READ = 1,
+	// mmap buffers that are also exported as dmabuf fds (Buffer.dmabuf_fd)
+	DMABUF_EXPORT = 2,
+	// capture into externally allocated dmabufs, see set_dmabufs
+	DMABUF = 3,
+	// capture straight into user memory, see set_userptr
+	USERPTR = 4,
+	// replay a recording, used whenever open is given a regular file
+	FILE = 5,
+}
+
+// A framerate of num / den frames per second, 0 / 0 means unknown
+Rate :: struct {
+	num: c.uint,
+	den: c.uint,
 }
 
 // Mostly just a wrapper for v4l2_pix_format data so that all format info
@@ -36,6 +51,92 @@ Format :: struct {
 	stride:      c.size_t,
 	sizeimage:   c.size_t,
 	pixelformat: Pixel_Format,
+	// Framerate to ask for, 0 keeps the current one. Set to what the driver granted.
+	fps:         Rate,
+
+	// Number of capture buffers to request, 0 means CAM_DEFAULT_BUFFER_COUNT.
+	// This is set to the count the driver granted.
+	buffer_count: c.uint,
+}
+
+// A format the camera can capture in, fps is the fastest rate at that size
+Mode :: struct {
+	pixelformat: Pixel_Format,
+	width:       c.size_t,
+	height:      c.size_t,
+	fps:         Rate,
+	compressed:  bool,
+}
+
+// A control of the camera (VIDIOC_QUERY_EXT_CTRL), id and type are the
+// V4L2_CID_xxx and V4L2_CTRL_TYPE_xxx values
+Control :: struct {
+	id:            u32,
+	type:          u32,
+	name:          [32]c.char,
+	minimum:       i64,
+	maximum:       i64,
+	step:          u64,
+	default_value: i64,
+	flags:         u32,
+}
+
+// One value for set_controls and get_controls
+Control_Value :: struct {
+	id:    u32,
+	value: i64,
+}
+
+// What select_mode optimizes for once the requirements are met
+Mode_Preference :: enum u32 {
+	CPU       = 0,
+	BANDWIDTH = 1,
+}
+
+// A rectangle in pixels
+Rect :: struct {
+	x:      c.size_t,
+	y:      c.size_t,
+	width:  c.size_t,
+	height: c.size_t,
+}
+
+// How set_output_size scales
+Scale_Filter :: enum u32 {
+	BOX      = 0,
+	BILINEAR = 1,
+}
+
+// How set_output_buffers maps frame buffers
+Buffer_Flag :: enum u32 {
+	// mlock them, needs a large enough RLIMIT_MEMLOCK
+	LOCKED     = 0,
+	// back them with huge pages (reserved or transparent ones)
+	HUGE_PAGES = 1,
+}
+Buffer_Flags :: bit_set[Buffer_Flag; u32]
+
+// The clock FrameInfo.timestamp_ns comes from
+Clock :: enum u32 {
+	UNKNOWN   = 0,
+	// CLOCK_MONOTONIC, comparable with now_ns
+	MONOTONIC = 1,
+	// copied from somewhere else by the driver (e.g. mem2mem devices)
+	COPY      = 2,
+}
+
+// Per frame information from the driver (v4l2_buffer)
+FrameInfo :: struct {
+	timestamp_ns: u64,
+	// increases by one for every captured frame, a gap means frames were dropped
+	sequence:     c.uint,
+	// size of the actual frame data
+	bytesused:    c.size_t,
+	// V4L2_BUF_FLAG_XXX
+	flags:        c.uint,
+	clock:        Clock,
+	// the timestamp was taken at the start of exposure rather than at the end of the frame
+	start_of_exposure: bool,
 }
 
 Surface :: struct {
@@ -43,15 +144,75 @@ Surface :: struct {
 	width:  c.size_t,
 	height: c.size_t,
 
-	// This will either be CAM_PIX_FMT_RGB24 or one of the V4L2_PIX_FMT_XXX
+	// This will either be the output format (.RGB24 by default)
+	// or one of the V4L2_PIX_FMT_XXX
 	pixelformat: Pixel_Format,
+	// bytes per row
+	stride:      c.size_t,
+	info:        FrameInfo,
 }
 
 Buffer :: struct {
 	ptr:    rawptr,
 	length: c.size_t,
+	// -1 unless using .DMABUF_EXPORT or .DMABUF
+	dmabuf_fd: c.int,
+	// only set for buffers returned by the camera
+	info:      FrameInfo,
+}
+
+// A frame obtained with acquire_frame. The buffer belongs to the
+// caller until it is given back with release_frame, the driver will
+// not write to it in the meantime.
+Frame :: struct {
+	buffer: Buffer,
+	index:  c.uint,
+	camera: ^Camera,
+}
+
+// Opaque camera handle
+Camera :: struct {}
+
+// The steps of getting a frame, timed by the latency stats and traced
+Stage :: enum u32 {
+	// waiting for the device to have a frame
+	WAIT     = 0,
+	// VIDIOC_DQBUF or read
+	DEQUEUE  = 1,
+	// converting (or copying on the capture thread) a frame
+	CONVERT  = 2,
+}
+
+STATS_BUCKETS :: 32
+
+// buckets[0] counts durations under 1us, buckets[i] the ones in [2^(i-1), 2^i) us
+Histogram :: struct {
+	count:    u64,
+	total_ns: u64,
+	max_ns:   u64,
+	buckets:  [STATS_BUCKETS]u64,
 }
 
+Stats :: struct {
+	frames:        u64,
+	// frames the driver dropped, from gaps in the sequence numbers
+	sequence_gaps: u64,
+	eagain:        u64,
+	timeouts:      u64,
+	// frames the capture thread dropped because all slots were full
+	ring_dropped:  u64,
+	queued:        c.uint,
+	min_queued:    c.uint,
+	held:          c.uint,
+	ring_waiting:  c.uint,
+	// only filled in while set_latency_stats is enabled
+	latency:       [Stage]Histogram,
+}
+
+Stage_Hook :: #type proc "c" (cam: ^Camera, stage: Stage, user: rawptr)
+
+Frame_Callback :: #type proc "c" (frame: ^Frame, user: rawptr)
+
 @(default_calling_convention="c", link_prefix="camera_")
 foreign lib {
 	// Initialize the camera device.
@@ -76,11 +237,173 @@ foreign lib {
 	// This can be disabled with #define CAM_NO_COVERT_TO_RGB
 	get_frame     :: proc(surf: ^Surface, timeout: ^timeval) -> bool ---
 	get_frame_raw :: proc(buf: ^Buffer, timeout: ^timeval) -> bool ---
+
+	// Dequeue the next frame and hold on to it, the buffer is not handed back
+	// to the driver until release_frame is called.
+	// Held frames become invalid after end.
+	acquire_frame :: proc(frame: ^Frame, timeout: ^timeval) -> bool ---
+	// gives the frame back to the camera it was acquired from (frame.camera)
+	release_frame :: proc(frame: ^Frame) -> bool ---
 	end           :: proc() -> bool ---
 	close         :: proc() -> bool ---
+	// This applies to every camera
 	set_log_level :: proc(level: LogLevel) ---
+
+	// Handle based versions of the procedures above.
+	//
+	// open_ex returns nil on failure and close_ex frees the handle.
+	// Passing nil as cam to any other procedure uses the default camera.
+	open_ex           :: proc(device: cstring, cam_fmt: ^Format, io: IoMethod) -> ^Camera ---
+	begin_ex          :: proc(cam: ^Camera) -> bool ---
+	get_frame_ex      :: proc(cam: ^Camera, surf: ^Surface, timeout: ^timeval) -> bool ---
+	get_frame_raw_ex  :: proc(cam: ^Camera, buf: ^Buffer, timeout: ^timeval) -> bool ---
+	acquire_frame_ex  :: proc(cam: ^Camera, frame: ^Frame, timeout: ^timeval) -> bool ---
+	end_ex            :: proc(cam: ^Camera) -> bool ---
+	close_ex          :: proc(cam: ^Camera) -> bool ---
+
+	// When enabled, getting a frame only returns the newest one that is ready
+	set_latest_only :: proc(cam: ^Camera, enable: bool) ---
+
+	// Set what get_frame converts into, one of .RGB24 (the default), .BGR24,
+	// .RGBA32, .ABGR32 (bytes in B, G, R, A order) or .GREY (luma only).
+	// stride is the size of a destination row in bytes, 0 means tightly packed.
+	set_output_format :: proc(cam: ^Camera, pixelformat: Pixel_Format, stride: c.size_t) -> bool ---
+
+	// Change the format of an open (even running) camera, zeros keep the
+	// current value. fmt is set to the format that was granted.
+	set_format :: proc(cam: ^Camera, fmt: ^Format) -> bool ---
+
+	// Change the framerate while not running, rate is set to what was granted
+	set_fps  :: proc(cam: ^Camera, rate: ^Rate) -> bool ---
+	// Framerates supported for a format and size, returns how many there are
+	enum_fps :: proc(cam: ^Camera, pixelformat: Pixel_Format, width, height: c.size_t, rates: [^]Rate, max: c.size_t) -> c.size_t ---
+
+	// Modes the camera supports, returns how many there are
+	enum_modes  :: proc(cam: ^Camera, modes: [^]Mode, max: c.size_t) -> c.size_t ---
+	// Best mode that is at least width x height at fps (0 for don't care)
+	select_mode :: proc(modes: [^]Mode, n_modes: c.size_t, width, height: c.size_t, fps: Rate, prefer: Mode_Preference, out: ^Mode) -> bool ---
+
+	// Up to max of the controls, returns how many there are
+	enum_controls :: proc(cam: ^Camera, controls: [^]Control, max: c.size_t) -> c.size_t ---
+	// Set or get count controls in one ioctl, none are set if one is rejected
+	set_controls  :: proc(cam: ^Camera, values: [^]Control_Value, count: c.size_t) -> bool ---
+	get_controls  :: proc(cam: ^Camera, values: [^]Control_Value, count: c.size_t) -> bool ---
+	// Manual exposure of at most one frame period so the fps does not drop
+	set_performance_preset :: proc(cam: ^Camera) -> bool ---
+
+	// Decode MJPEG at 1/denom (1, 2, 4 or 8) of its size, needs CAM_USE_TURBOJPEG
+	set_jpeg_scale :: proc(cam: ^Camera, denom: c.uint) -> bool ---
+
+	// Scale YUYV and UYVY frames while converting them, 0 x 0 turns it off
+	set_output_size :: proc(cam: ^Camera, width, height: c.size_t, filter: Scale_Filter) -> bool ---
+
+	// Capture only roi (nil for the full frame), cropped by the sensor if it can
+	set_roi :: proc(cam: ^Camera, roi: ^Rect) -> bool ---
+
+	// Convert row bands of each frame on threads threads, pinned to cpus if given
+	set_conversion_threads :: proc(cam: ^Camera, threads: c.uint, cpus: [^]c.int, n_cpus: c.size_t) -> bool ---
+
+	// Dequeue and convert on a thread started by begin, get_frame then pops
+	// the oldest of slots frames. Has to be called before begin.
+	set_capture_thread :: proc(cam: ^Camera, slots: c.uint, convert: bool) -> bool ---
+
+	// get_frame_ex with a zero timeout, for event loops watching get_fd
+	try_get_frame :: proc(cam: ^Camera, surf: ^Surface) -> bool ---
+
+	// Hand every frame to on_frame on the capture thread instead of the slots,
+	// the frame is only lent until it returns. Has to be called before begin.
+	set_frame_callback :: proc(cam: ^Camera, on_frame: Frame_Callback, user: rawptr) -> bool ---
+	// Convert buf into dst like get_frame_into, e.g. from inside on_frame
+	convert :: proc(cam: ^Camera, buf: ^Buffer, surf: ^Surface, dst: rawptr, dst_stride: c.size_t) -> bool ---
+
+	// Share frames with several consumers without copying. broadcast_frame
+	// dequeues and offers a frame to every subscriber, subscriber_acquire
+	// takes the newest one and release_frame gives it back.
+	subscribe          :: proc(cam: ^Camera) -> ^Subscriber ---
+	unsubscribe        :: proc(sub: ^Subscriber) ---
+	broadcast_frame    :: proc(cam: ^Camera, timeout: ^timeval) -> bool ---
+	subscriber_acquire :: proc(sub: ^Subscriber, frame: ^Frame, timeout: ^timeval) -> bool ---
+	subscriber_fd      :: proc(sub: ^Subscriber) -> c.int ---
+
+	// Same as get_frame but the frame is converted straight into dst, which has
+	// to fit format.height rows of dst_stride bytes (0 means tightly packed).
+	// If the format can not be converted dst is not touched, check surf.pixelformat.
+	get_frame_into :: proc(cam: ^Camera, surf: ^Surface, dst: rawptr, dst_stride: c.size_t, timeout: ^timeval) -> bool ---
+
+	// Keep count pre-faulted, page aligned buffers for converted frames that
+	// acquire_output_buffer hands out (nil when all are) and
+	// release_output_buffer takes back. flags also apply to get_frame's buffer.
+	set_output_buffers     :: proc(cam: ^Camera, count: c.uint, flags: Buffer_Flags) -> bool ---
+	acquire_output_buffer  :: proc(cam: ^Camera, stride: ^c.size_t) -> rawptr ---
+	release_output_buffer  :: proc(cam: ^Camera, buffer: rawptr) -> bool ---
+
+	// Give the dmabufs to capture into when using .DMABUF, between open and
+	// begin with exactly format.buffer_count fds. The fds stay owned by the caller.
+	set_dmabufs :: proc(cam: ^Camera, fds: [^]c.int, count: c.uint) -> bool ---
+
+	// Give the memory to capture into when using .USERPTR, between open and
+	// begin. The arena must be page aligned and at least userptr_size bytes,
+	// it stays owned by the caller. If not called begin allocates one itself.
+	set_userptr  :: proc(cam: ^Camera, arena: rawptr, size: c.size_t) -> bool ---
+	userptr_size :: proc(cam: ^Camera) -> c.size_t ---
+
+	// The device fd, it is readable when a frame can be dequeued
+	get_fd :: proc(cam: ^Camera) -> c.int ---
+
+	// Current CLOCK_MONOTONIC time, frames with .MONOTONIC can be
+	// compared against this to get their latency
+	now_ns :: proc() -> u64 ---
+
+	// Counters and per stage latency histograms, readable from any thread.
+	// The histograms stay empty until set_latency_stats is enabled.
+	get_stats            :: proc(cam: ^Camera, stats: ^Stats) -> bool ---
+	reset_stats          :: proc(cam: ^Camera) -> bool ---
+	set_latency_stats    :: proc(cam: ^Camera, enable: bool) -> bool ---
+	histogram_percentile :: proc(hist: ^Histogram, fraction: f64) -> u64 ---
+	// Called around every stage, nil for both removes them. Not while the capture thread runs.
+	set_trace_hooks      :: proc(cam: ^Camera, begin, end: Stage_Hook, user: rawptr) -> bool ---
+
+	// Wait for frames on many cameras at once using a single epoll instance.
+	// poller_wait fills ready with up to max cameras that have a frame and
+	// returns how many there are (0 on timeout, -1 on error).
+	poller_create  :: proc() -> ^Poller ---
+	poller_add     :: proc(poller: ^Poller, cam: ^Camera) -> bool ---
+	poller_remove  :: proc(poller: ^Poller, cam: ^Camera) -> bool ---
+	poller_wait    :: proc(poller: ^Poller, ready: [^]^Camera, max: c.int, timeout: ^timeval) -> c.int ---
+	poller_fd      :: proc(poller: ^Poller) -> c.int ---
+	poller_destroy :: proc(poller: ^Poller) ---
+
+	// Pair frames of several running cameras whose timestamps are within
+	// tolerance_ns, frameset_wait fills frames with one per camera. Frames
+	// without a match go back to the driver and count as dropped.
+	frameset_create  :: proc(cameras: [^]^Camera, count: c.size_t, tolerance_ns: u64) -> ^Frameset ---
+	frameset_wait    :: proc(set: ^Frameset, frames: [^]Frame, timeout: ^timeval) -> bool ---
+	frameset_release :: proc(set: ^Frameset, frames: [^]Frame) ---
+	frameset_dropped :: proc(set: ^Frameset) -> u64 ---
+	frameset_destroy :: proc(set: ^Frameset) ---
+
+	// Record raw frames to path with large (O_DIRECT if direct) writes, open
+	// the file to replay it through the usual frame procedures
+	recorder_create  :: proc(path: cstring, fmt: ^Format, direct: bool) -> ^Recorder ---
+	recorder_write   :: proc(rec: ^Recorder, buf: ^Buffer) -> bool ---
+	// flushes the frames, writes the index and frees rec
+	recorder_destroy :: proc(rec: ^Recorder) -> bool ---
+	// frames in the recording cam replays, 0 for a camera
+	replay_length    :: proc(cam: ^Camera) -> c.size_t ---
 }
 
+// Opaque epoll based poller
+Poller :: struct {}
+
+// Opaque, see camera_frameset_create
+Frameset :: struct {}
+
+// Opaque, see camera_subscribe
+Subscriber :: struct {}
+
+// Opaque, see camera_recorder_create
+Recorder :: struct {}
+
 import "core:sys/posix"
 
 timeval :: posix.timeval
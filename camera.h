@@ -7,7 +7,8 @@
       #define CAMERA_IMPLEMENTATION
    before you include this file in *one* C or C++ file to create the implementation.
 
-   Currently only a single global camera device can be handled at a time.
+   Every camera_xxx function works on a default camera, use the camera_xxx_ex
+   versions with a Cam_Camera handle to work with multiple devices at once.
 */
 
 #ifndef CAMERA_H
@@ -18,6 +19,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <assert.h>
 
 #include <fcntl.h>
@@ -26,8 +28,10 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
 
 #include <linux/videodev2.h>
 
@@ -45,12 +49,37 @@ typedef enum {
 typedef enum {
     IO_METHOD_MMAP,
     IO_METHOD_READ,
+    // mmap buffers that are also exported as dmabuf fds (Cam_Buffer.dmabuf_fd)
+    // so they can be imported by a GPU/encoder without copying
+    IO_METHOD_DMABUF_EXPORT,
+    // capture into externally allocated dmabufs, see camera_set_dmabufs
+    IO_METHOD_DMABUF,
+    // capture straight into user memory, see camera_set_userptr
+    IO_METHOD_USERPTR,
+    // replay a file written by a Cam_Recorder, this is used whenever
+    // camera_open is given a regular file
+    IO_METHOD_FILE,
 } Cam_IoMethod;
 
 #define CAM_PIX_FMT_RGB24 V4L2_PIX_FMT_RGB24 
+#define CAM_PIX_FMT_BGR24 V4L2_PIX_FMT_BGR24
+// bytes in R, G, B, A order
+#define CAM_PIX_FMT_RGBA32 V4L2_PIX_FMT_RGBA32
+// bytes in B, G, R, A order (v4l2 calls this ABGR32)
+#define CAM_PIX_FMT_BGRA32 V4L2_PIX_FMT_ABGR32
+// luma only, 1 byte per pixel. The Y plane of YUV formats is passed through
+// without any math.
+#define CAM_PIX_FMT_GREY V4L2_PIX_FMT_GREY
 // This is just a typedef when working with V4L2_PIX_FMT_*
 typedef unsigned int Cam_PixelFormat;
 
+// A framerate of num / den frames per second, e.g. 30000 / 1001 for NTSC
+// rates. 0 / 0 means unknown or the driver default.
+typedef struct {
+    unsigned int num;
+    unsigned int den;
+} Cam_Rate;
+
 // Mostly just a wrapper for v4l2_pix_format data so that all format info
 // can be put into a single struct
 typedef struct {
@@ -59,22 +88,74 @@ typedef struct {
     size_t stride;
     size_t sizeimage;
     Cam_PixelFormat pixelformat;
-    // TODO: unsigned int fps;
+    // Framerate to ask for, 0 keeps the current one. This is set to the rate
+    // the driver granted (0 if it does not say).
+    Cam_Rate fps;
+
+    // Number of capture buffers to request, 0 means CAM_DEFAULT_BUFFER_COUNT.
+    // Fewer buffers keep the latency down, more of them avoid dropped frames
+    // when the consumer is late. This is set to the count the driver granted.
+    unsigned int buffer_count;
 } Cam_Format;
 
+// The clock Cam_FrameInfo.timestamp_ns comes from
+typedef enum {
+    CAM_CLOCK_UNKNOWN,
+    // CLOCK_MONOTONIC, comparable with camera_now_ns
+    CAM_CLOCK_MONOTONIC,
+    // copied from somewhere else by the driver (e.g. mem2mem devices)
+    CAM_CLOCK_COPY,
+} Cam_Clock;
+
+// Per frame information from the driver (v4l2_buffer)
+typedef struct {
+    uint64_t timestamp_ns;
+    // increases by one for every captured frame, a gap means frames were
+    // dropped
+    unsigned int sequence;
+    // size of the actual frame data, for compressed formats this is usually
+    // far less than the buffer length
+    size_t bytesused;
+    // V4L2_BUF_FLAG_XXX
+    unsigned int flags;
+    Cam_Clock clock;
+    // the timestamp was taken at the start of exposure rather than at the
+    // end of the frame
+    bool start_of_exposure;
+} Cam_FrameInfo;
+
 typedef struct {
     void *data;
     size_t width;
     size_t height;
-    // This will either be CAM_PIX_FMT_RGB24 or one of the V4L2_PIX_FMT_XXX
+    // This will either be the output format (CAM_PIX_FMT_RGB24 by default)
+    // or one of the V4L2_PIX_FMT_XXX
     Cam_PixelFormat pixelformat;
+    // bytes per row
+    size_t stride;
+    Cam_FrameInfo info;
 } Cam_Surface;
 
 typedef struct {
     void *ptr;
     size_t length;
+    // -1 unless using IO_METHOD_DMABUF_EXPORT or IO_METHOD_DMABUF
+    int dmabuf_fd;
+    // only set for buffers returned by the camera
+    Cam_FrameInfo info;
 } Cam_Buffer;
 
+typedef struct Cam_Camera Cam_Camera;
+
+// A frame obtained with camera_acquire_frame. The buffer belongs to the
+// caller until it is given back with camera_release_frame, the driver will
+// not write to it in the meantime.
+typedef struct {
+    Cam_Buffer buffer;
+    unsigned int index;
+    Cam_Camera *camera;
+} Cam_Frame;
+
 // Initialize the camera device.
 //
 // if NULL is provided for device, it opens /dev/video0.
@@ -89,19 +170,526 @@ bool camera_begin();
 // try to load the next frame into surf.
 //
 // this uses select to wait for a read, if timeout is NULL it will wait for
-// CAM_DEFAULT_TIMEOUT_US, this can be defined to any value before including
-// camera.h
+// one frame period of the negotiated framerate (or CAM_DEFAULT_TIMEOUT_US if
+// the driver does not report it). Defining CAM_DEFAULT_TIMEOUT_US before
+// including camera.h always uses that instead.
+// A zero timeout skips the wait and only tries to dequeue a frame.
 //
 // If the obtained format of surf is one that can be automatically converted
-// to rgb then it will be returned as CAM_PIX_FMT_RGB24.
+// to rgb then it will be returned as CAM_PIX_FMT_RGB24 (or the format set
+// with camera_set_output_format).
 // This can be disabled with #define CAM_NO_COVERT_TO_RGB
+//
+// The conversion uses SSSE3/AVX2 or NEON when the cpu supports it,
+// #define CAM_FORCE_SCALAR to always use the plain C version.
 bool camera_get_frame(Cam_Surface *surf, struct timeval *timeout);
+
+// NOTE: the buffer returned by camera_get_frame_raw (and camera_get_frame if
+// the format is not converted) stays valid until the next call to either.
+// buf->length is the size of the whole buffer, the frame itself is only
+// buf->info.bytesused bytes.
 bool camera_get_frame_raw(Cam_Buffer *buf, struct timeval *timeout);
 
+// Dequeue the next frame and hold on to it, this waits the same way as
+// camera_get_frame.
+//
+// Unlike camera_get_frame_raw the buffer is not handed back to the driver
+// until camera_release_frame is called, so it can be used for as long as
+// needed without copying. At most n_buffers - 1 frames should be held at a
+// time, otherwise the driver has nothing left to capture into.
+// Held frames become invalid after camera_end.
+bool camera_acquire_frame(Cam_Frame *frame, struct timeval *timeout);
+// gives the frame back to the camera it was acquired from (frame->camera)
+bool camera_release_frame(Cam_Frame *frame);
+
 bool camera_end();
 bool camera_close();
+// This applies to every camera
 void camera_set_log_level(Cam_LogLevel level);
 
+// Handle based versions of the functions above.
+//
+// camera_open_ex returns NULL on failure and camera_close_ex frees the
+// handle. Passing NULL as cam to any other function uses the default camera
+// (the one used by camera_open, camera_begin, ...).
+Cam_Camera *camera_open_ex(const char *device, Cam_Format *cam_fmt,
+        Cam_IoMethod io);
+bool camera_begin_ex(Cam_Camera *cam);
+bool camera_get_frame_ex(Cam_Camera *cam, Cam_Surface *surf,
+        struct timeval *timeout);
+bool camera_get_frame_raw_ex(Cam_Camera *cam, Cam_Buffer *buf,
+        struct timeval *timeout);
+bool camera_acquire_frame_ex(Cam_Camera *cam, Cam_Frame *frame,
+        struct timeval *timeout);
+bool camera_end_ex(Cam_Camera *cam);
+bool camera_close_ex(Cam_Camera *cam);
+
+// When enabled, getting a frame dequeues everything that is ready and only
+// returns the newest frame, older ones are given straight back to the driver.
+// Useful for previews so frames sitting in the queue do not add latency.
+void camera_set_latest_only(Cam_Camera *cam, bool enable);
+
+// Set what camera_get_frame converts into, one of CAM_PIX_FMT_RGB24 (the
+// default), CAM_PIX_FMT_BGR24, CAM_PIX_FMT_RGBA32, CAM_PIX_FMT_BGRA32 or
+// CAM_PIX_FMT_GREY.
+// YUYV, UYVY, NV12, NV21, YU12 (I420), YV12, GREY and RGB565 are converted
+// natively, MJPEG needs CAM_USE_TURBOJPEG.
+// stride is the size of a destination row in bytes, 0 means tightly packed.
+// The camera has to be open.
+bool camera_set_output_format(Cam_Camera *cam, Cam_PixelFormat pixelformat,
+        size_t stride);
+
+// Same as camera_get_frame but the frame is converted straight into dst,
+// e.g. a slot in a frame pool or a mapped PBO. dst has to fit the converted
+// frame (fmt.height rows, fewer when scaling) of dst_stride bytes (0 means
+// tightly packed).
+//
+// If the format can not be converted surf is set to the raw frame like
+// camera_get_frame does and dst is not touched, check surf->pixelformat.
+bool camera_get_frame_into(Cam_Camera *cam, Cam_Surface *surf, void *dst,
+        size_t dst_stride, struct timeval *timeout);
+
+typedef enum {
+    // mlock the buffers so they are never swapped out, this needs a large
+    // enough RLIMIT_MEMLOCK (a warning is logged otherwise)
+    CAM_BUFFERS_LOCKED = 1 << 0,
+    // back them with huge pages, reserved ones (vm.nr_hugepages) if there
+    // are any, transparent ones otherwise
+    CAM_BUFFERS_HUGE_PAGES = 1 << 1,
+} Cam_BufferFlags;
+
+// Keep count buffers for converted frames (camera_get_frame_into,
+// camera_convert or a frame callback) that are handed out and taken back by
+// camera_acquire_output_buffer and camera_release_output_buffer without
+// allocating. They are sized for the current output (out stride * height,
+// the stride is reported by the acquire) and mapped in one go at page
+// boundaries, pre-faulted so the first frames do not take page faults.
+//
+// flags (Cam_BufferFlags) also apply to the buffer camera_get_frame
+// converts into and the capture thread slots. count may be 0 to only set
+// those. Not available while buffers are handed out or the capture thread
+// runs (the pool itself can be used from any thread).
+bool camera_set_output_buffers(Cam_Camera *cam, unsigned int count,
+        unsigned int flags);
+// NULL when every buffer is handed out
+void *camera_acquire_output_buffer(Cam_Camera *cam, size_t *stride);
+bool camera_release_output_buffer(Cam_Camera *cam, void *buffer);
+
+// MJPEG frames are decoded with libjpeg-turbo when CAM_USE_TURBOJPEG is
+// defined (link with -lturbojpeg). The decoder is created once in
+// camera_open so nothing gets allocated per frame.
+//
+// denom (1, 2, 4 or 8) decodes frames at 1/denom of their size, the scaling
+// is done as part of the IDCT so it is a lot faster than a full decode.
+// Converted surfaces report the scaled width and height.
+bool camera_set_jpeg_scale(Cam_Camera *cam, unsigned int denom);
+
+typedef enum {
+    // averages every source pixel that falls into an output pixel
+    CAM_SCALE_BOX,
+    // interpolates the 4 nearest source pixels, cheaper but aliases when
+    // shrinking more than 2x
+    CAM_SCALE_BILINEAR,
+} Cam_ScaleFilter;
+
+// Scale YUYV and UYVY frames to width x height as part of the conversion,
+// so the source is only read once and the full size frame is never written.
+// Box filtering an exact 1/2 or 1/4 of the capture size takes a faster path.
+// 0 x 0 turns scaling off again. Converted surfaces report the scaled width
+// and height, other formats are converted at their full size.
+bool camera_set_output_size(Cam_Camera *cam, size_t width, size_t height,
+        Cam_ScaleFilter filter);
+
+// A rectangle in pixels
+typedef struct {
+    size_t x;
+    size_t y;
+    size_t width;
+    size_t height;
+} Cam_Rect;
+
+// Only capture the part of the frame inside roi, NULL or a zero size gives
+// the full frame back. The rectangle is in pixels of the frame captured
+// without a roi and is set to the one that is actually used.
+//
+// Sensors that can crop (VIDIOC_S_SELECTION or VIDIOC_S_CROP) do it in
+// hardware, which cuts the bandwidth too. fmt then shrinks to the roi and
+// the buffers are reallocated like camera_set_format does. Otherwise the
+// roi is cut out while converting, x, y and width are rounded down to even
+// values and raw frames stay full size (MJPEG is always decoded whole).
+// Either way converted surfaces are roi sized (before any output scaling).
+// Not available while the capture thread runs.
+bool camera_set_roi(Cam_Camera *cam, Cam_Rect *roi);
+
+// Split the conversion of each frame into row bands converted by threads
+// threads (the calling thread included), 0 or 1 converts on the calling
+// thread only which is the default. This can be called at any time except
+// from inside camera_get_frame, the pool is freed by camera_close.
+//
+// When cpus is not NULL worker i is pinned to cpus[i % n_cpus], the calling
+// thread is left alone.
+//
+// Only the native kernels are split, libjpeg-turbo decodes a frame on a single
+// thread.
+bool camera_set_conversion_threads(Cam_Camera *cam, unsigned int threads,
+        const int *cpus, size_t n_cpus);
+
+// Dequeue frames on a thread of its own, started by camera_begin and stopped
+// by camera_end, so frames keep being captured while the caller is busy.
+// This has to be called before camera_begin, 0 slots turns it off again.
+//
+// The thread converts each frame (copies it when convert is false or the
+// format can not be converted) into one of slots buffers and hands the
+// capture buffer straight back to the driver. camera_get_frame_ex then pops
+// the oldest frame without locking, a zero timeout never blocks. With
+// camera_set_latest_only it skips to the newest one instead. The returned
+// surface stays valid until the next camera_get_frame_ex. When all slots are
+// full new frames are dropped.
+//
+// While the thread runs the output format can not be changed and
+// camera_get_frame_raw, camera_get_frame_into and camera_acquire_frame are
+// not available. camera_get_fd returns an eventfd that is readable when
+// frames are waiting (it can stay readable after the last one was popped).
+bool camera_set_capture_thread(Cam_Camera *cam, unsigned int slots,
+        bool convert);
+
+// Same as camera_get_frame_ex with a zero timeout, it never waits. Meant for
+// event loops (epoll, io_uring, libuv, ...) that watch camera_get_fd and
+// call this until it returns false once the fd is readable.
+bool camera_try_get_frame(Cam_Camera *cam, Cam_Surface *surf);
+
+// Hand every frame to on_frame on the capture thread as soon as it is
+// dequeued instead of putting it into the slots, so there is no wait
+// between the frame arriving and it being processed. A capture thread
+// (without conversion) is set up if there is none. This has to be called
+// before camera_begin, NULL puts frames back into the slots.
+//
+// The frame is only lent to on_frame, it goes back to the driver when
+// on_frame returns. It should return quickly (or copy), frames arriving in
+// the meantime wait in the driver queue. camera_convert can be called from
+// on_frame to convert it.
+typedef void (*Cam_FrameCallback)(Cam_Frame *frame, void *user);
+bool camera_set_frame_callback(Cam_Camera *cam, Cam_FrameCallback on_frame,
+        void *user);
+
+// Convert buf (a frame of cam) into dst with the output format the way
+// camera_get_frame_into does, surf is set to the converted frame. Returns
+// false if the format can not be converted. Conversions of one camera share
+// its conversion threads, so this should run on the thread that gets its
+// frames (the capture thread inside on_frame).
+bool camera_convert(Cam_Camera *cam, const Cam_Buffer *buf, Cam_Surface *surf,
+        void *dst, size_t dst_stride);
+
+// Share every frame with several consumers without copying.
+//
+// One thread calls camera_broadcast_frame in a loop, it dequeues a frame
+// (waiting like camera_get_frame) and offers it to every subscriber. A
+// subscriber takes the newest frame it has not seen with
+// camera_subscriber_acquire and gives it back with camera_release_frame, the
+// buffer is requeued once every subscriber is done with it. Subscribers that
+// fall behind skip frames instead of stalling capture, but each one keeps up
+// to one waiting frame plus the ones it holds so fmt.buffer_count should
+// leave room for that. Frames are shared read-only and are not converted.
+//
+// Subscribers can come and go from any thread, camera_subscriber_fd is
+// readable when a new frame is waiting. While anyone is subscribed or still
+// holds a shared frame camera_acquire_frame, camera_get_frame* and
+// camera_set_capture_thread are not available, they work again once the last
+// subscriber is gone. camera_end takes back every frame and camera_close frees
+// the remaining subscribers.
+// Needs at most 64 buffers and is disabled by CAM_NO_THREADS.
+typedef struct Cam_Subscriber Cam_Subscriber;
+
+Cam_Subscriber *camera_subscribe(Cam_Camera *cam);
+void camera_unsubscribe(Cam_Subscriber *sub);
+bool camera_broadcast_frame(Cam_Camera *cam, struct timeval *timeout);
+bool camera_subscriber_acquire(Cam_Subscriber *sub, Cam_Frame *frame,
+        struct timeval *timeout);
+int camera_subscriber_fd(Cam_Subscriber *sub);
+
+// Change the format of an open camera, zeros in fmt keep the current value.
+// The driver buffers have to be reallocated but the device stays open, a
+// running camera is stopped and started again (held frames become invalid
+// like with camera_end). The conversion buffer is only reallocated when the
+// new frames do not fit. fmt is set to the format that was granted.
+//
+// dmabufs from camera_set_dmabufs and a user arena are put back if they are
+// still large enough, otherwise the camera is left stopped (for dmabufs) or
+// allocates its own arena. If the driver refuses the new format the old one
+// is restored and false is returned.
+bool camera_set_format(Cam_Camera *cam, Cam_Format *fmt);
+
+// Change the framerate of an open camera that is not running, rate is set to
+// what the driver granted. Not every driver supports this (V4L2_CAP_TIMEPERFRAME).
+bool camera_set_fps(Cam_Camera *cam, Cam_Rate *rate);
+
+// Fill rates with up to max framerates supported for the given format and
+// size (VIDIOC_ENUM_FRAMEINTERVALS), in the order the driver lists them. For
+// drivers that only report a range the fastest and slowest rate are
+// returned. Returns the number of rates available, which can be more than max.
+size_t camera_enum_fps(Cam_Camera *cam, Cam_PixelFormat pixelformat,
+        size_t width, size_t height, Cam_Rate *rates, size_t max);
+
+// A format the camera can capture in, fps is the fastest rate it supports
+// at that size (0 / 0 if the driver does not say)
+typedef struct {
+    Cam_PixelFormat pixelformat;
+    size_t width;
+    size_t height;
+    Cam_Rate fps;
+    // MJPEG, H264, ... (V4L2_FMT_FLAG_COMPRESSED)
+    bool compressed;
+} Cam_Mode;
+
+// What camera_select_mode optimizes for once the requirements are met
+typedef enum {
+    // cheapest conversion, e.g. YUYV or NV12 over MJPEG if the bus manages
+    CAM_PREFER_CPU,
+    // least data per second, e.g. MJPEG over YUYV
+    CAM_PREFER_BANDWIDTH,
+} Cam_ModePreference;
+
+// Fill modes with up to max of the modes the camera supports
+// (VIDIOC_ENUM_FMT, VIDIOC_ENUM_FRAMESIZES and VIDIOC_ENUM_FRAMEINTERVALS).
+// Drivers that only report a range of sizes get its smallest and largest
+// size. Returns the number of modes, which can be more than max.
+size_t camera_enum_modes(Cam_Camera *cam, Cam_Mode *modes, size_t max);
+
+// Pick the mode from modes that is at least width x height at fps (any of
+// them can be 0 for don't care), on ties the smaller size wins. Since the
+// driver only lists modes the device can deliver, a raw mode that is listed
+// fits the bus. Returns false if none of them is good enough.
+//
+// The result can be passed to camera_open (or camera_set_format) by copying
+// pixelformat, width, height and fps into a Cam_Format.
+bool camera_select_mode(const Cam_Mode *modes, size_t n_modes, size_t width,
+        size_t height, Cam_Rate fps, Cam_ModePreference prefer, Cam_Mode *out);
+
+// A control of the camera (VIDIOC_QUERY_EXT_CTRL), e.g.
+// V4L2_CID_EXPOSURE_ABSOLUTE or V4L2_CID_FOCUS_AUTO
+typedef struct {
+    uint32_t id;
+    // V4L2_CTRL_TYPE_INTEGER, _BOOLEAN, _MENU, ...
+    uint32_t type;
+    char name[32];
+    int64_t minimum;
+    int64_t maximum;
+    uint64_t step;
+    int64_t default_value;
+    // V4L2_CTRL_FLAG_READ_ONLY, _INACTIVE (e.g. the exposure time while
+    // exposure is automatic), ...
+    uint32_t flags;
+} Cam_Control;
+
+// Fill controls with up to max of the controls the camera has, disabled ones
+// and compound ones (strings, arrays) are left out. Returns the number of
+// controls, which can be more than max.
+size_t camera_enum_controls(Cam_Camera *cam, Cam_Control *controls, size_t max);
+
+typedef struct {
+    uint32_t id;
+    int64_t value;
+} Cam_ControlValue;
+
+// Set (or get) count controls with a single VIDIOC_S_EXT_CTRLS
+// (VIDIOC_G_EXT_CTRLS), so they all change between the same two frames.
+// This works while the camera runs and does not allocate. The driver checks
+// every value first; if one is rejected none of them are set and the error
+// names it. Order matters, e.g. V4L2_CID_EXPOSURE_AUTO has to be manual
+// before V4L2_CID_EXPOSURE_ABSOLUTE can be set.
+bool camera_set_controls(Cam_Camera *cam, const Cam_ControlValue *values,
+        size_t count);
+bool camera_get_controls(Cam_Camera *cam, Cam_ControlValue *values,
+        size_t count);
+
+// Fix the exposure so auto exposure can not stretch the frame time in low
+// light and drop the framerate: manual exposure, no V4L2_CID_EXPOSURE_AUTO_PRIORITY
+// and an exposure time of at most one frame period at the negotiated fps
+// (the current one is kept when it is shorter). Controls the camera does not
+// have are skipped. Gain, white balance and focus are locked the same way
+// with camera_set_controls.
+bool camera_set_performance_preset(Cam_Camera *cam);
+
+// Give the dmabufs to capture into when using IO_METHOD_DMABUF, this has to
+// be called between camera_open and camera_begin with exactly
+// fmt.buffer_count fds that are each at least fmt.sizeimage bytes.
+//
+// The fds stay owned by the caller (they are not closed by camera_close).
+// Cam_Buffer.ptr is a mapping of the dmabuf or NULL if the exporter can not
+// be mapped, in that case frames are not converted to RGB.
+bool camera_set_dmabufs(Cam_Camera *cam, const int *fds, unsigned int count);
+
+// Give the memory to capture into when using IO_METHOD_USERPTR, this has to
+// be called between camera_open and camera_begin. The arena is split into
+// fmt.buffer_count buffers that each start on a page boundary, so it must be
+// at least camera_userptr_size bytes. If the arena itself is aligned to a
+// huge page (e.g. mmap with MAP_HUGETLB) the buffers end up on huge pages.
+//
+// The arena stays owned by the caller and must outlive the camera. If this is
+// never called camera_begin allocates (and pre-faults) an arena itself.
+bool camera_set_userptr(Cam_Camera *cam, void *arena, size_t size);
+size_t camera_userptr_size(Cam_Camera *cam);
+
+// The device fd, it is readable when a frame can be dequeued. With a capture
+// thread this is the eventfd signalling published frames instead.
+int camera_get_fd(Cam_Camera *cam);
+
+// Current CLOCK_MONOTONIC time, frames with CAM_CLOCK_MONOTONIC can be
+// compared against this to get their latency
+uint64_t camera_now_ns(void);
+
+// The steps of getting a frame that are timed by the latency statistics and
+// reported to the trace hooks
+typedef enum {
+    // waiting for the device to have a frame (select, or poll on the capture
+    // thread)
+    CAM_STAGE_WAIT,
+    // VIDIOC_DQBUF or read, including the frames skipped by latest_only
+    CAM_STAGE_DEQUEUE,
+    // converting (or copying on the capture thread) a frame
+    CAM_STAGE_CONVERT,
+    CAM_STAGE_COUNT,
+} Cam_Stage;
+
+#define CAM_STATS_BUCKETS 32
+
+// Power of two latency histogram, buckets[0] counts durations under 1us and
+// buckets[i] the ones in [2^(i-1), 2^i) us, the last bucket takes everything
+// longer.
+typedef struct {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[CAM_STATS_BUCKETS];
+} Cam_Histogram;
+
+typedef struct {
+    // frames dequeued from the driver
+    uint64_t frames;
+    // frames the driver dropped, counted from gaps in the sequence numbers
+    uint64_t sequence_gaps;
+    // dequeues that found nothing (EAGAIN)
+    uint64_t eagain;
+    // waits for a frame that timed out
+    uint64_t timeouts;
+    // frames the capture thread threw away because all slots were full
+    uint64_t ring_dropped;
+    // buffers currently with the driver, the fewest there were right after
+    // a dequeue (when this reaches 0 the driver drops frames) and the ones
+    // held by the user
+    // (all 0 with IO_METHOD_READ)
+    unsigned int queued;
+    unsigned int min_queued;
+    unsigned int held;
+    // converted frames waiting in the capture thread slots
+    unsigned int ring_waiting;
+    // only filled in while camera_set_latency_stats is enabled
+    Cam_Histogram latency[CAM_STAGE_COUNT];
+} Cam_Stats;
+
+// Copy the statistics of cam since it was opened (or camera_reset_stats).
+// Counters are always kept, they are a few increments next to a syscall.
+// The latency histograms need two clock reads per stage and are off until
+// enabled. Both can be read from any thread, also while the capture thread
+// runs.
+bool camera_get_stats(Cam_Camera *cam, Cam_Stats *stats);
+// Not available while the capture thread runs
+bool camera_reset_stats(Cam_Camera *cam);
+bool camera_set_latency_stats(Cam_Camera *cam, bool enable);
+// Upper bound in ns of the duration below which fraction (0 to 1) of the
+// samples fall, 0 if there are none
+uint64_t camera_histogram_percentile(const Cam_Histogram *hist,
+        double fraction);
+
+// Called when a stage starts and ends, on whichever thread runs it (the
+// capture thread if there is one). They should return quickly, e.g. by
+// writing a trace event. NULL for both removes the hooks, without hooks
+// or latency stats a stage costs a single branch. Not available while the
+// capture thread runs.
+typedef void (*Cam_StageHook)(Cam_Camera *cam, Cam_Stage stage, void *user);
+bool camera_set_trace_hooks(Cam_Camera *cam, Cam_StageHook begin,
+        Cam_StageHook end, void *user);
+
+// Wait for frames on many cameras at once using a single epoll instance.
+//
+// camera_poller_wait fills ready with up to max cameras that have a frame
+// available and returns how many there are (0 on timeout, -1 on error).
+// With timeout NULL it waits for CAM_DEFAULT_TIMEOUT_US.
+// The frames can then be read without waiting again by passing a zero
+// timeout to camera_get_frame_ex/camera_acquire_frame_ex.
+//
+// camera_poller_fd returns the epoll fd which becomes readable when any of
+// the cameras is, so the poller can be added to another event loop.
+// Cameras should be removed before they are closed.
+typedef struct Cam_Poller Cam_Poller;
+
+Cam_Poller *camera_poller_create(void);
+bool camera_poller_add(Cam_Poller *poller, Cam_Camera *cam);
+bool camera_poller_remove(Cam_Poller *poller, Cam_Camera *cam);
+int camera_poller_wait(Cam_Poller *poller, Cam_Camera **ready, int max,
+        struct timeval *timeout);
+int camera_poller_fd(Cam_Poller *poller);
+void camera_poller_destroy(Cam_Poller *poller);
+
+// Pair up frames of several cameras by capture time, e.g. for stereo or
+// multi-view rigs.
+//
+// camera_frameset_wait acquires frames (camera_acquire_frame) from every
+// camera as they come in, waiting on them with one poller, and fills frames
+// (one per camera, in the order of cameras) once each camera has a frame
+// within tolerance_ns of the newest of them, taking the nearest one when
+// several are. Returns false on timeout (NULL waits for
+// CAM_DEFAULT_TIMEOUT_US) or errors.
+//
+// Nothing is copied, the frames belong to the caller until they are given
+// back with camera_release_frame (or all at once with camera_frameset_release).
+// A frame that is too old to ever be matched is given back to the driver
+// right away, and so is the oldest one a camera has waiting when the driver
+// would run out of buffers. camera_frameset_dropped counts both. The
+// tolerance should be below half a frame period so only one frame of each
+// camera can match. The timestamps have to be comparable (CAM_CLOCK_MONOTONIC
+// from the same machine) and the cameras running, without a capture thread
+// and with at least 2 buffers each.
+typedef struct Cam_Frameset Cam_Frameset;
+
+Cam_Frameset *camera_frameset_create(Cam_Camera **cameras, size_t count,
+        uint64_t tolerance_ns);
+bool camera_frameset_wait(Cam_Frameset *set, Cam_Frame *frames,
+        struct timeval *timeout);
+void camera_frameset_release(Cam_Frameset *set, Cam_Frame *frames);
+uint64_t camera_frameset_dropped(Cam_Frameset *set);
+// gives back the frames that are still waiting, to be called before the
+// cameras are closed
+void camera_frameset_destroy(Cam_Frameset *set);
+
+// Record raw frames (Cam_Buffer payloads with their Cam_FrameInfo) to path,
+// e.g. straight from camera_get_frame_raw or camera_acquire_frame.
+//
+// Frames are gathered in a CAM_RECORD_BUFFER_SIZE staging buffer that is
+// written out in one go when full, direct writes it with O_DIRECT so the
+// stream does not go through (and push everything else out of) the page
+// cache. With CAM_USE_IO_URING a full buffer is written in the background
+// while the next one fills up. The index of the frames is added by
+// camera_recorder_destroy, a recording that was never finished still
+// replays, it just has to be scanned first.
+//
+// Opening the file with camera_open replays it through the usual frame
+// functions (camera_get_frame, camera_get_frame_raw, camera_acquire_frame)
+// in the recorded format, as fast as they are called. The file is mmapped
+// so frames are handed out without any read syscalls. Format, framerate and
+// crop can not be changed (a roi is cut out while converting), the poller
+// does not work on it and camera_begin starts over from the first frame.
+// The file uses the byte order of the machine that recorded it.
+typedef struct Cam_Recorder Cam_Recorder;
+
+Cam_Recorder *camera_recorder_create(const char *path, const Cam_Format *fmt,
+        bool direct);
+bool camera_recorder_write(Cam_Recorder *rec, const Cam_Buffer *buf);
+// flushes the frames, writes the index and frees rec
+bool camera_recorder_destroy(Cam_Recorder *rec);
+// frames in the recording cam replays, 0 for a camera
+size_t camera_replay_length(Cam_Camera *cam);
+
 #ifdef __cplusplus
 }
 #endif
@@ -111,42 +699,249 @@ void camera_set_log_level(Cam_LogLevel level);
 *************************/
 #ifdef CAMERA_IMPLEMENTATION
 
+// SIMD conversion kernels are picked at runtime, the target attributes let
+// them be compiled without -mavx2 etc. #define CAM_FORCE_SCALAR to only use
+// the scalar path (e.g. for bit-exact comparisons).
+#if !defined(CAM_FORCE_SCALAR) && (defined(__x86_64__) || defined(__i386__)) \
+    && (defined(__GNUC__) || defined(__clang__))
+#define _CAM_SIMD_X86
+#include <immintrin.h>
+#elif !defined(CAM_FORCE_SCALAR) && defined(__ARM_NEON)
+#define _CAM_SIMD_NEON
+#include <arm_neon.h>
+#if defined(__arm__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#ifdef CAM_USE_TURBOJPEG
+#include <turbojpeg.h>
+#ifndef CAM_TURBOJPEG_FLAGS
+#define CAM_TURBOJPEG_FLAGS TJFLAG_FASTDCT
+#endif
+#endif
+
+// io_uring for read i/o and recordings, needs linux 5.11 (falls back to
+// plain read/write when the kernel refuses)
+#ifdef CAM_USE_IO_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+// the conversion pool and the capture thread, #define CAM_NO_THREADS to not
+// need -pthread
+#ifndef CAM_NO_THREADS
+#define _CAM_THREADS
+#include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#ifndef CAM_NO_COVERT_TO_RGB
+#define _CAM_POOL
+#endif
+#endif
+
 #define __CLEAR(x) memset(&(x), 0, sizeof(x))
 
+// Byte layouts the kernels can write, see _cam_output_layout
+typedef enum {
+    _CAM_OUT_RGB24,
+    _CAM_OUT_BGR24,
+    _CAM_OUT_RGBA32,
+    _CAM_OUT_BGRA32,
+    // luma only (CAM_PIX_FMT_GREY)
+    _CAM_OUT_GREY,
+} _Cam_Output;
+
+// converts count units (YUYV macropixels, GREY bytes, ...) from src into dst
+typedef void (*_Cam_PackedKernel)(const unsigned char *src, unsigned char *dst,
+        size_t count, _Cam_Output out);
+// converts a row of count pixel pairs of a 4:2:0 frame
+typedef void (*_Cam_PlanarKernel)(const unsigned char *y,
+        const unsigned char *u, const unsigned char *v, size_t step,
+        unsigned char *dst, size_t count, _Cam_Output out);
+
+// every kernel for one instruction set, see _cam_select_kernels
+typedef struct {
+    const char *name;
+    _Cam_PackedKernel yuyv;
+    _Cam_PackedKernel uyvy;
+    _Cam_PackedKernel grey;
+    _Cam_PackedKernel rgb565;
+    _Cam_PlanarKernel planar;
+    _Cam_PackedKernel yuyv_luma;
+    _Cam_PackedKernel uyvy_luma;
+} _Cam_Kernels;
+
+#ifndef CAM_DEFAULT_BUFFER_COUNT
+#define CAM_DEFAULT_BUFFER_COUNT 4
+#endif
+
+// staging buffer of a Cam_Recorder, a multiple of the page size
+#ifndef CAM_RECORD_BUFFER_SIZE
+#define CAM_RECORD_BUFFER_SIZE (4 << 20)
+#endif
+
+// glibc only declares O_DIRECT with _GNU_SOURCE, without it recordings go
+// through the page cache
+#if !defined(O_DIRECT) && defined(__O_DIRECT)
+#define O_DIRECT __O_DIRECT
+#elif !defined(O_DIRECT)
+#define O_DIRECT 0
+#endif
+
+// without an explicit timeout waits follow the frame period, unless the user
+// picked one
+#ifdef CAM_DEFAULT_TIMEOUT_US
+#define _CAM_FIXED_TIMEOUT
+#else
+#define CAM_DEFAULT_TIMEOUT_US 33333
+#endif
+
 // Internal camera state
-static struct {
+struct Cam_Camera {
     const char *dev_name;
     Cam_IoMethod io;
     int fd;
     bool running;
+    bool latest_only;
+    // used when NULL is passed as timeout
+    long timeout_us;
 
     Cam_Format fmt;
     struct v4l2_capability capability;
 
     Cam_Buffer *buffers;
     unsigned int n_buffers;
+    // IO_METHOD_USERPTR memory, only freed if we allocated it
+    void *arena;
+    size_t arena_size;
+    bool arena_owned;
+    // buffers that are dequeued and owned by the user
+    bool *held;
+    unsigned int n_held;
+    // buffer returned by camera_get_frame_raw, requeued on the next call
+    int pending;
+    // read i/o has no sequence numbers of its own
+    unsigned int read_sequence;
+    // mapped with _cam_map_frames, the size is the mapped one
     unsigned char *rgb_buffer;
     size_t rgb_buffer_size;
+    // Cam_BufferFlags of rgb_buffer, the output buffers and ring slots
+    unsigned int buffer_flags;
+    // see camera_set_output_buffers
+    struct _Cam_OutBuffers *out_buffers;
+    // see camera_enum_controls, queried on first use
+    Cam_Control *controls;
+    size_t n_controls;
+    bool controls_loaded;
+    // room for a batch of every control, camera_set_controls fills it
+    struct v4l2_ext_control *control_batch;
+    Cam_PixelFormat out_format;
+    size_t out_stride;
+    // the user asked for tightly packed rows (stride 0)
+    bool out_packed;
+    // size of converted frames, smaller than fmt when decoding scaled jpegs
+    // or scaling
+    size_t out_width;
+    size_t out_height;
+    unsigned int jpeg_scale;
+    // see camera_set_output_size, 0 when not scaling
+    size_t scale_width;
+    size_t scale_height;
+    Cam_ScaleFilter scale_filter;
+    // see camera_set_roi, in pixels of the full_width x full_height frame
+    Cam_Rect roi;
+    // the sensor crops to roi, fmt is roi sized
+    bool roi_hw;
+    // roi is cut out while converting
+    bool roi_soft;
+    size_t full_width;
+    size_t full_height;
+#ifdef CAM_USE_TURBOJPEG
+    tjhandle jpeg;
+#endif
+    const _Cam_Kernels *kernels;
+    // converts row bands in parallel, NULL converts on the calling thread
+    struct _Cam_Pool *pool;
+    // frames published by the capture thread, see camera_set_capture_thread
+    struct _Cam_Ring *ring;
+    // shared frames, see camera_subscribe
+    struct _Cam_Broadcast *broadcast;
+    // the mapped recording of IO_METHOD_FILE
+    struct _Cam_Replay *replay;
+#ifdef CAM_USE_IO_URING
+    // read i/o through io_uring, NULL when plain read is used
+    struct _Cam_UringRead *uring;
+#endif
 
-    Cam_LogLevel min_log_level;
-} _cam_state = {
-    .dev_name = "/dev/video0",
-    .io = IO_METHOD_MMAP,
-    .fd = -1,
-    .running = false,
-    .min_log_level = CAM_INFO,
+    // see camera_get_stats, only written by the thread dequeuing frames
+    // (timeouts also by the consumer of the capture thread)
+    Cam_Stats stats;
+    // the sequence number of the last dequeued frame, for gaps
+    unsigned int last_sequence;
+    bool have_sequence;
+    // most buffers held right after a dequeue, gives Cam_Stats.min_queued
+    unsigned int max_held;
+    // stages are timed or traced, see _cam_stage_begin
+    bool staged;
+    bool latency_stats;
+    Cam_StageHook stage_begin;
+    Cam_StageHook stage_end;
+    void *stage_user;
 };
 
+#define _CAM_CAMERA_INIT { \
+    .dev_name = "/dev/video0", \
+    .io = IO_METHOD_MMAP, \
+    .fd = -1, \
+    .running = false, \
+    .pending = -1, \
+    .timeout_us = CAM_DEFAULT_TIMEOUT_US, \
+    .out_format = CAM_PIX_FMT_RGB24, \
+    .out_packed = true, \
+    .jpeg_scale = 1, \
+}
+
+// used by the camera_xxx functions and when NULL is passed as a handle
+static Cam_Camera _cam_default = _CAM_CAMERA_INIT;
+#define _CAM_HANDLE(cam) ((cam) ? (cam) : &_cam_default)
+
+static Cam_LogLevel _cam_min_log_level = CAM_INFO;
+
+static bool _cam_replay_next(Cam_Camera *cam, Cam_Frame *frame);
+#ifndef CAM_NO_COVERT_TO_RGB
+static void _cam_select_kernels(Cam_Camera *cam);
+static bool _cam_update_output(Cam_Camera *cam);
+static bool _cam_is_jpeg(Cam_PixelFormat pixelformat);
+static bool _cam_is_yuyv(Cam_PixelFormat pixelformat);
+#endif
+#ifdef _CAM_POOL
+static void _cam_pool_destroy(struct _Cam_Pool *pool);
+#endif
+#ifdef _CAM_THREADS
+static bool _cam_ring_start(Cam_Camera *cam);
+static void _cam_ring_stop(Cam_Camera *cam);
+static void _cam_ring_free(struct _Cam_Ring *ring);
+static void _cam_ring_unmap_slots(struct _Cam_Ring *ring);
+static void _cam_broadcast_free(struct _Cam_Broadcast *broadcast);
+static void _cam_broadcast_reset(Cam_Camera *cam);
+static bool _cam_broadcasting(Cam_Camera *cam);
+#endif
+
 
 void camera_set_log_level(Cam_LogLevel level)
 {
-    _cam_state.min_log_level = level;
+    _cam_min_log_level = level;
 }
 
 
 static void cam_log(Cam_LogLevel level, const char *fmt, va_list args)
 {
-    if (level < _cam_state.min_log_level) return;
+    if (level < _cam_min_log_level) return;
     FILE *stream = stderr;
 
     switch (level) {
@@ -204,16 +999,417 @@ static int _xioctl(int fh, unsigned int request, void *arg)
     return r;
 }
 
-static bool _read_frame(Cam_Buffer *cam_buf)
+static unsigned int _cam_memory(Cam_Camera *cam)
+{
+    switch (cam->io) {
+        case IO_METHOD_DMABUF:
+            return V4L2_MEMORY_DMABUF;
+        case IO_METHOD_USERPTR:
+            return V4L2_MEMORY_USERPTR;
+        default:
+            return V4L2_MEMORY_MMAP;
+    }
+}
+
+// the stats have a single writer, the atomic store only keeps readers on
+// other threads from seeing torn values
+static inline void _cam_count(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static void _cam_histogram_add(Cam_Histogram *hist, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    unsigned int i = us ? 64 - __builtin_clzll(us) : 0;
+    if (i >= CAM_STATS_BUCKETS) i = CAM_STATS_BUCKETS - 1;
+
+    _cam_count(&hist->count, 1);
+    _cam_count(&hist->total_ns, ns);
+    _cam_count(&hist->buckets[i], 1);
+    if (ns > hist->max_ns)
+        __atomic_store_n(&hist->max_ns, ns, __ATOMIC_RELAXED);
+}
+
+// returns the start time for _cam_stage_end, the hooks and the clock are only
+// touched when enabled
+static inline uint64_t _cam_stage_begin(Cam_Camera *cam, Cam_Stage stage)
+{
+    if (!cam->staged) return 0;
+    if (cam->stage_begin) cam->stage_begin(cam, stage, cam->stage_user);
+    return cam->latency_stats ? camera_now_ns() : 0;
+}
+
+static inline void _cam_stage_end(Cam_Camera *cam, Cam_Stage stage,
+        uint64_t start)
+{
+    if (!cam->staged) return;
+    if (cam->latency_stats)
+        _cam_histogram_add(&cam->stats.latency[stage], camera_now_ns() - start);
+    if (cam->stage_end) cam->stage_end(cam, stage, cam->stage_user);
+}
+
+static bool _cam_zero_timeout(const struct timeval *timeout)
+{
+    return timeout && timeout->tv_sec == 0 && timeout->tv_usec == 0;
+}
+
+#ifdef CAM_USE_IO_URING
+// A minimal io_uring built on the raw syscalls so liburing is not needed.
+// Only one thread ever touches a ring.
+typedef struct {
+    int fd;
+    unsigned int features;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+    // sqes queued since the last _cam_uring_enter
+    unsigned int to_submit;
+} _Cam_Uring;
+
+static void _cam_uring_free(_Cam_Uring *ring)
+{
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map && ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_size);
+    if (ring->sq_map) munmap(ring->sq_map, ring->sq_map_size);
+    if (ring->fd >= 0) close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// needs IORING_FEAT_EXT_ARG (linux 5.11) for waits with a timeout
+static bool _cam_uring_init(_Cam_Uring *ring, unsigned int entries)
+{
+    struct io_uring_params params;
+    __CLEAR(params);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = syscall(SYS_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        ring->fd = -1;
+        return false;
+    }
+    ring->features = params.features;
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        errno = ENOSYS;
+        _cam_uring_free(ring);
+        return false;
+    }
+
+    ring->sq_map_size = params.sq_off.array +
+        params.sq_entries * sizeof(unsigned int);
+    ring->cq_map_size = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size)
+            ring->sq_map_size = ring->cq_map_size;
+        ring->cq_map_size = ring->sq_map_size;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        ring->sq_map = NULL;
+        _cam_uring_free(ring);
+        return false;
+    }
+    ring->cq_map = ring->sq_map;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            ring->cq_map = NULL;
+            _cam_uring_free(ring);
+            return false;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        _cam_uring_free(ring);
+        return false;
+    }
+
+    unsigned char *sq = ring->sq_map, *cq = ring->cq_map;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+}
+
+static bool _cam_uring_register(_Cam_Uring *ring, const struct iovec *iov,
+        unsigned int count)
+{
+    return syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+            iov, count) == 0;
+}
+
+// a cleared sqe that is submitted by the next _cam_uring_enter, NULL if the
+// queue is full
+static struct io_uring_sqe *_cam_uring_sqe(_Cam_Uring *ring)
+{
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int tail = *ring->sq_tail;
+    if (tail - head > *ring->sq_mask) return NULL;
+
+    unsigned int index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+// submits the queued sqes and waits until wait completions are there or
+// timeout (NULL waits forever) ran out, false with errno ETIME on timeout
+static bool _cam_uring_enter(_Cam_Uring *ring, unsigned int wait,
+        const struct timeval *timeout)
+{
+    if (!wait && !ring->to_submit) return true;
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    __CLEAR(arg);
+    unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    if (wait && timeout) {
+        ts.tv_sec = timeout->tv_sec;
+        ts.tv_nsec = timeout->tv_usec * 1000ll;
+        arg.ts = (uintptr_t)&ts;
+    }
+    flags |= IORING_ENTER_EXT_ARG;
+
+    int r = syscall(SYS_io_uring_enter, ring->fd, ring->to_submit, wait,
+            flags, &arg, sizeof(arg));
+    if (r >= 0) ring->to_submit -= r;
+    return r >= 0;
+}
+
+// pops the next completion if there is one
+static bool _cam_uring_cqe(_Cam_Uring *ring, struct io_uring_cqe *cqe)
+{
+    unsigned int head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return false;
+
+    *cqe = ring->cqes[head & *ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// IO_METHOD_READ through a ring, a poll linked to a read into the registered
+// buffer. One io_uring_enter waits for the frame and reads it, where select
+// and read take two syscalls. A read that is still in flight when a wait
+// times out is picked up by the next one.
+enum {
+    _CAM_URING_POLL = 1,
+    _CAM_URING_READ,
+    _CAM_URING_CANCEL,
+};
+
+struct _Cam_UringRead {
+    _Cam_Uring ring;
+    // completions still to come
+    unsigned int pending;
+    bool done;
+    int result;
+};
+
+static void _cam_uring_reap(struct _Cam_UringRead *u)
+{
+    struct io_uring_cqe cqe;
+    while (_cam_uring_cqe(&u->ring, &cqe)) {
+        if (cqe.user_data == _CAM_URING_CANCEL) continue;
+        u->pending--;
+        if (cqe.user_data == _CAM_URING_READ) {
+            u->done = true;
+            u->result = cqe.res;
+        }
+    }
+}
+
+// takes back the read in flight, its frame is lost
+static void _cam_uring_cancel(Cam_Camera *cam)
+{
+    struct _Cam_UringRead *u = cam->uring;
+    if (!u) return;
+
+    if (u->pending) {
+        for (__u64 target = _CAM_URING_POLL; target <= _CAM_URING_READ; target++) {
+            struct io_uring_sqe *sqe = _cam_uring_sqe(&u->ring);
+            if (!sqe) break;
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = target;
+            sqe->user_data = _CAM_URING_CANCEL;
+        }
+        _cam_uring_reap(u);
+        while (u->pending && (_cam_uring_enter(&u->ring, 1, NULL) ||
+                    errno == EINTR))
+            _cam_uring_reap(u);
+    }
+    u->done = false;
+}
+
+static void _cam_uring_close(Cam_Camera *cam)
+{
+    if (!cam->uring) return;
+    _cam_uring_cancel(cam);
+    _cam_uring_free(&cam->uring->ring);
+    free(cam->uring);
+    cam->uring = NULL;
+}
+
+// sets up the ring for read i/o, without it plain read is used
+static void _cam_uring_open(Cam_Camera *cam)
+{
+    struct _Cam_UringRead *u = calloc(1, sizeof(*u));
+    if (!u) return;
+    if (!_cam_uring_init(&u->ring, 4)) {
+        cam_info("io_uring is not available (%s), using read", strerror(errno));
+        free(u);
+        return;
+    }
+
+    struct iovec iov = {
+        .iov_base = cam->buffers[0].ptr,
+        .iov_len = cam->buffers[0].length,
+    };
+    if (!_cam_uring_register(&u->ring, &iov, 1)) {
+        cam_info("Could not register the read buffer (%s), using read",
+                strerror(errno));
+        _cam_uring_free(&u->ring);
+        free(u);
+        return;
+    }
+    cam->uring = u;
+}
+
+// _wait_frame for read i/o through the ring, true once a read completed
+static bool _cam_uring_wait(Cam_Camera *cam, struct timeval *timeout)
+{
+    struct _Cam_UringRead *u = cam->uring;
+    if (u->done) return true;
+
+    // a zero timeout is a plain non-blocking read (e.g. the capture thread
+    // already polled), unless a read is still in flight
+    bool zero = _cam_zero_timeout(timeout);
+    if (zero && !u->pending) return true;
+
+    if (!u->pending) {
+        struct io_uring_sqe *poll = _cam_uring_sqe(&u->ring);
+        struct io_uring_sqe *read = _cam_uring_sqe(&u->ring);
+        if (!poll || !read) return false;
+
+        poll->opcode = IORING_OP_POLL_ADD;
+        poll->fd = cam->fd;
+        poll->poll32_events = POLLIN;
+        poll->flags = IOSQE_IO_LINK;
+        poll->user_data = _CAM_URING_POLL;
+
+        read->opcode = IORING_OP_READ_FIXED;
+        read->fd = cam->fd;
+        read->addr = (uintptr_t)cam->buffers[0].ptr;
+        read->len = cam->buffers[0].length;
+        read->off = -1;
+        read->buf_index = 0;
+        read->user_data = _CAM_URING_READ;
+        u->pending = 2;
+    }
+
+    struct timeval tv;
+    if (!timeout) {
+        tv.tv_sec = cam->timeout_us / 1000000;
+        tv.tv_usec = cam->timeout_us % 1000000;
+        timeout = &tv;
+    }
+
+    // the poll completes before the read, wait for both
+    if (!_cam_uring_enter(&u->ring, zero ? 0 : u->pending, timeout) &&
+            errno != ETIME && errno != EINTR) {
+        cam_error("io_uring_enter: %s", strerror(errno));
+        return false;
+    }
+    _cam_uring_reap(u);
+    return zero || u->done;
+}
+
+// the read that _cam_uring_wait waited for or a plain one when it did not
+// start any, like read() it returns -1 and sets errno on errors
+static ssize_t _cam_uring_take(Cam_Camera *cam)
+{
+    struct _Cam_UringRead *u = cam->uring;
+    if (!u->done) {
+        if (!u->pending)
+            return read(cam->fd, cam->buffers[0].ptr, cam->buffers[0].length);
+        errno = EAGAIN;
+        return -1;
+    }
+    u->done = false;
+    if (u->result < 0) {
+        errno = -u->result;
+        return -1;
+    }
+    return u->result;
+}
+#endif
+
+// give a buffer to the driver to capture into
+static bool _queue_buffer(Cam_Camera *cam, unsigned int index)
+{
+    struct v4l2_buffer buf;
+
+    __CLEAR(buf);
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = _cam_memory(cam);
+    buf.index = index;
+    if (cam->io == IO_METHOD_DMABUF) {
+        buf.m.fd = cam->buffers[index].dmabuf_fd;
+        buf.length = cam->buffers[index].length;
+    } else if (cam->io == IO_METHOD_USERPTR) {
+        buf.m.userptr = (unsigned long)cam->buffers[index].ptr;
+        buf.length = cam->buffers[index].length;
+    }
+
+    return _xioctl(cam->fd, VIDIOC_QBUF, &buf) != -1;
+}
+
+// dequeue a filled buffer, it is not given back to the driver until
+// _enqueue_frame is called with its index.
+static bool _dequeue_frame(Cam_Camera *cam, Cam_Frame *frame)
 {
     struct v4l2_buffer buf;
+    ssize_t n;
 
-    switch (_cam_state.io) {
+    switch (cam->io) {
     case IO_METHOD_READ:
-        if (read(_cam_state.fd, _cam_state.buffers[0].ptr, 
-                    _cam_state.buffers[0].length) == -1) {
+#ifdef CAM_USE_IO_URING
+        if (cam->uring)
+            n = _cam_uring_take(cam);
+        else
+#endif
+        n = read(cam->fd, cam->buffers[0].ptr, cam->buffers[0].length);
+        if (n == -1) {
             switch (errno) {
                 case EAGAIN:
+                    _cam_count(&cam->stats.eagain, 1);
                     break;
 
                 case EIO:
@@ -225,18 +1421,33 @@ static bool _read_frame(Cam_Buffer *cam_buf)
             return false;
         }
 
-        *cam_buf = _cam_state.buffers[0];
+        frame->buffer = cam->buffers[0];
+        frame->index = 0;
+        frame->buffer.info = (Cam_FrameInfo){
+            .timestamp_ns = camera_now_ns(),
+            .sequence = cam->read_sequence++,
+            .bytesused = n,
+            .clock = CAM_CLOCK_MONOTONIC,
+        };
+        break;
+
+    case IO_METHOD_FILE:
+        if (!_cam_replay_next(cam, frame)) return false;
         break;
 
     case IO_METHOD_MMAP:
+    case IO_METHOD_DMABUF_EXPORT:
+    case IO_METHOD_DMABUF:
+    case IO_METHOD_USERPTR:
         __CLEAR(buf);
 
         buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
+        buf.memory = _cam_memory(cam);
 
-        if (_xioctl(_cam_state.fd, VIDIOC_DQBUF, &buf) == -1) {
+        if (_xioctl(cam->fd, VIDIOC_DQBUF, &buf) == -1) {
             switch (errno) {
                 case EAGAIN:
+                    _cam_count(&cam->stats.eagain, 1);
                     break;
 
                 case EIO:
@@ -247,11 +1458,66 @@ static bool _read_frame(Cam_Buffer *cam_buf)
             return false;
         }
 
-        assert(buf.index < _cam_state.n_buffers);
+        assert(buf.index < cam->n_buffers);
+
+        frame->buffer = cam->buffers[buf.index];
+        frame->index = buf.index;
+        frame->buffer.info = (Cam_FrameInfo){
+            .timestamp_ns = buf.timestamp.tv_sec * 1000000000ull +
+                buf.timestamp.tv_usec * 1000ull,
+            .sequence = buf.sequence,
+            .bytesused = buf.bytesused,
+            .flags = buf.flags,
+            .start_of_exposure = (buf.flags & V4L2_BUF_FLAG_TSTAMP_SRC_MASK)
+                == V4L2_BUF_FLAG_TSTAMP_SRC_SOE,
+        };
+        switch (buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) {
+            case V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC:
+                frame->buffer.info.clock = CAM_CLOCK_MONOTONIC;
+                break;
+            case V4L2_BUF_FLAG_TIMESTAMP_COPY:
+                frame->buffer.info.clock = CAM_CLOCK_COPY;
+                break;
+            default:
+                frame->buffer.info.clock = CAM_CLOCK_UNKNOWN;
+                break;
+        }
+        break;
+    }
+
+    cam->held[frame->index] = true;
+    cam->n_held++;
+    frame->camera = cam;
+
+    _cam_count(&cam->stats.frames, 1);
+    unsigned int sequence = frame->buffer.info.sequence;
+    if (cam->have_sequence && sequence - cam->last_sequence > 1)
+        _cam_count(&cam->stats.sequence_gaps,
+                sequence - cam->last_sequence - 1);
+    cam->last_sequence = sequence;
+    cam->have_sequence = true;
+    if (cam->n_held > cam->max_held)
+        __atomic_store_n(&cam->max_held, cam->n_held, __ATOMIC_RELAXED);
+    return true;
+}
+
+static bool _enqueue_frame(Cam_Camera *cam, unsigned int index)
+{
+    assert(index < cam->n_buffers && cam->held[index]);
+    cam->held[index] = false;
+    cam->n_held--;
 
-        *cam_buf = _cam_state.buffers[buf.index];
+    switch (cam->io) {
+    case IO_METHOD_READ:
+    case IO_METHOD_FILE:
+        /* Nothing to do. */
+        break;
 
-        if (_xioctl(_cam_state.fd, VIDIOC_QBUF, &buf) == -1) {
+    case IO_METHOD_MMAP:
+    case IO_METHOD_DMABUF_EXPORT:
+    case IO_METHOD_DMABUF:
+    case IO_METHOD_USERPTR:
+        if (!_queue_buffer(cam, index)) {
             cam_error("VIDIOC_QBUF");
             return false;
         }
@@ -261,28 +1527,35 @@ static bool _read_frame(Cam_Buffer *cam_buf)
     return true;
 }
 
-static void _init_io_read(unsigned int buffer_size)
+static void _init_io_read(Cam_Camera *cam, unsigned int buffer_size)
 {
-    _cam_state.buffers = calloc(1, sizeof(*_cam_state.buffers));
-
-    _cam_state.buffers[0].length = buffer_size;
-    _cam_state.buffers[0].ptr = malloc(buffer_size);
+    cam->buffers = calloc(1, sizeof(*cam->buffers));
+    cam->held = calloc(1, sizeof(*cam->held));
+    cam->n_buffers = 1;
+
+    cam->fmt.buffer_count = 1;
+    cam->buffers[0].length = buffer_size;
+    cam->buffers[0].ptr = malloc(buffer_size);
+    cam->buffers[0].dmabuf_fd = -1;
+#ifdef CAM_USE_IO_URING
+    if (cam->buffers[0].ptr) _cam_uring_open(cam);
+#endif
 }
 
-static bool _init_io_mmap(void)
+static bool _init_io_mmap(Cam_Camera *cam)
 {
     struct v4l2_requestbuffers req;
 
     __CLEAR(req);
 
-    req.count = 4;
+    req.count = cam->fmt.buffer_count;
     req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     req.memory = V4L2_MEMORY_MMAP;
 
-    if (_xioctl(_cam_state.fd, VIDIOC_REQBUFS, &req) == -1) {
+    if (_xioctl(cam->fd, VIDIOC_REQBUFS, &req) == -1) {
         if (errno == EINVAL) {
             cam_error("%s does not support memory mapping",
-                    _cam_state.dev_name);
+                    cam->dev_name);
             return false;
         } else {
             cam_error("Could not request buffers");
@@ -291,144 +1564,303 @@ static bool _init_io_mmap(void)
     }
 
     if (req.count < 2) {
-        cam_error("Insufficient buffer memory on %s", _cam_state.dev_name);
+        cam_error("Insufficient buffer memory on %s", cam->dev_name);
         return false;
     }
 
-    _cam_state.buffers = calloc(req.count, sizeof(*_cam_state.buffers));
+    if (req.count != cam->fmt.buffer_count)
+        cam_info("Requested %u buffers, got %u", cam->fmt.buffer_count,
+                req.count);
+    cam->fmt.buffer_count = req.count;
+
+    cam->buffers = calloc(req.count, sizeof(*cam->buffers));
+    cam->held = calloc(req.count, sizeof(*cam->held));
 
-    for (_cam_state.n_buffers = 0; _cam_state.n_buffers < req.count;
-            ++_cam_state.n_buffers) {
+    for (cam->n_buffers = 0; cam->n_buffers < req.count;
+            ++cam->n_buffers) {
         struct v4l2_buffer buf;
 
         __CLEAR(buf);
 
         buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         buf.memory      = V4L2_MEMORY_MMAP;
-        buf.index       = _cam_state.n_buffers;
+        buf.index       = cam->n_buffers;
 
-        if (_xioctl(_cam_state.fd, VIDIOC_QUERYBUF, &buf) == -1) {
+        if (_xioctl(cam->fd, VIDIOC_QUERYBUF, &buf) == -1) {
             cam_error("Could not query buffer");
             return false;
         }
 
-        _cam_state.buffers[_cam_state.n_buffers].length = buf.length;
-        _cam_state.buffers[_cam_state.n_buffers].ptr = mmap(
+        cam->buffers[cam->n_buffers].length = buf.length;
+        cam->buffers[cam->n_buffers].ptr = mmap(
                     NULL, /* start anywhere */
                     buf.length,
                     PROT_READ | PROT_WRITE, /* required */
                     MAP_SHARED,  /* recommended */
-                    _cam_state.fd, 
+                    cam->fd, 
                     buf.m.offset
                 );
 
-        if (_cam_state.buffers[_cam_state.n_buffers].ptr == MAP_FAILED) {
+        cam->buffers[cam->n_buffers].dmabuf_fd = -1;
+
+        if (cam->buffers[cam->n_buffers].ptr == MAP_FAILED) {
             cam_error("mmap");
             return false;
         }
+
+        if (cam->io == IO_METHOD_DMABUF_EXPORT) {
+            struct v4l2_exportbuffer expbuf;
+
+            __CLEAR(expbuf);
+            expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            expbuf.index = cam->n_buffers;
+            expbuf.flags = O_RDWR | O_CLOEXEC;
+
+            if (_xioctl(cam->fd, VIDIOC_EXPBUF, &expbuf) == -1) {
+                cam_error("Could not export buffer %u: %s", cam->n_buffers,
+                        strerror(errno));
+                // still count it so it gets unmapped
+                ++cam->n_buffers;
+                return false;
+            }
+            cam->buffers[cam->n_buffers].dmabuf_fd = expbuf.fd;
+        }
     }
 
     return true;
 }
 
-bool camera_open(const char *device, Cam_Format *cam_fmt, Cam_IoMethod io)
+// only requests the buffers, the memory comes from camera_set_dmabufs or
+// camera_set_userptr
+static bool _init_io_external(Cam_Camera *cam)
 {
-    if (_cam_state.fd > 0) {
-        cam_warn("Camera is already open");
-        return false;
-    }
+    struct v4l2_requestbuffers req;
 
-    struct stat st;
+    __CLEAR(req);
 
-    if (!cam_fmt) {
-        cam_error("cam_fmt cannot be NULL");
+    req.count = cam->fmt.buffer_count;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = _cam_memory(cam);
+
+    if (_xioctl(cam->fd, VIDIOC_REQBUFS, &req) == -1) {
+        if (errno == EINVAL) {
+            cam_error("%s does not support %s", cam->dev_name,
+                    cam->io == IO_METHOD_DMABUF ? "dmabuf import" : "user pointers");
+            return false;
+        } else {
+            cam_error("Could not request buffers");
+            return false;
+        }
+    }
+
+    if (req.count < 2) {
+        cam_error("Insufficient buffer memory on %s", cam->dev_name);
         return false;
     }
 
-    if (device)
-        _cam_state.dev_name = device;
+    if (req.count != cam->fmt.buffer_count)
+        cam_info("Requested %u buffers, got %u", cam->fmt.buffer_count,
+                req.count);
+    cam->fmt.buffer_count = req.count;
 
-    if (stat(_cam_state.dev_name, &st) == -1) {
-        cam_error("Cannot identify '%s':  %s",
-                _cam_state.dev_name, strerror(errno));
+    cam->buffers = calloc(req.count, sizeof(*cam->buffers));
+    cam->held = calloc(req.count, sizeof(*cam->held));
+    cam->n_buffers = req.count;
+    for (unsigned int i = 0; i < req.count; i++)
+        cam->buffers[i].dmabuf_fd = -1;
+
+    return true;
+}
+
+bool camera_set_dmabufs(Cam_Camera *cam, const int *fds, unsigned int count)
+{
+    cam = _CAM_HANDLE(cam);
+
+    if (cam->io != IO_METHOD_DMABUF) {
+        cam_error("camera_set_dmabufs needs IO_METHOD_DMABUF");
         return false;
     }
 
-    if (!S_ISCHR(st.st_mode)) {
-        cam_error("%s is not device", _cam_state.dev_name);
+    if (cam->running) {
+        cam_error("Can not change dmabufs while the camera is running");
         return false;
     }
 
-    _cam_state.fd = open(_cam_state.dev_name,
-            O_RDWR /* required */ | O_NONBLOCK, 0);
-    if (_cam_state.fd == -1) {
-        cam_error("Cannot open '%s': %s", _cam_state.dev_name,
-                strerror(errno));
+    if (!fds || count != cam->n_buffers) {
+        cam_error("Expected %u dmabufs, got %u", cam->n_buffers, count);
         return false;
     }
-    
-    // Camera Initialization
-    struct v4l2_capability cap;
-    struct v4l2_format fmt;
-    struct v4l2_cropcap cropcap;
-    struct v4l2_crop crop;
 
-    _cam_state.io = io;
+    for (unsigned int i = 0; i < count; i++) {
+        Cam_Buffer *b = &cam->buffers[i];
 
-    if (_xioctl(_cam_state.fd, VIDIOC_QUERYCAP, &cap) == -1) {
-        if (errno == EINVAL) {
-            cam_error("%s is not V4L2 device", _cam_state.dev_name);
-            return false;
-        } else {
-            cam_error("Could not query capabilities");
+        // the dmabuf size can be found by seeking to the end
+        off_t size = lseek(fds[i], 0, SEEK_END);
+        if (size < 0 || (size_t)size < cam->fmt.sizeimage) {
+            cam_error("dmabuf %u is too small (%ld < %zu bytes)", i,
+                    (long)size, cam->fmt.sizeimage);
             return false;
         }
+
+        if (b->ptr) munmap(b->ptr, b->length);
+
+        b->dmabuf_fd = fds[i];
+        b->length = size;
+        b->ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, fds[i], 0);
+        if (b->ptr == MAP_FAILED) {
+            cam_warn("dmabuf %u can not be mapped, frames won't be converted",
+                    i);
+            b->ptr = NULL;
+        }
     }
 
-    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-        cam_error("%s is not video capture device", _cam_state.dev_name);
+    return true;
+}
+
+static size_t _cam_userptr_stride(Cam_Camera *cam)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (cam->fmt.sizeimage + page - 1) / page * page;
+}
+
+size_t camera_userptr_size(Cam_Camera *cam)
+{
+    cam = _CAM_HANDLE(cam);
+    return _cam_userptr_stride(cam) * cam->n_buffers;
+}
+
+bool camera_set_userptr(Cam_Camera *cam, void *arena, size_t size)
+{
+    cam = _CAM_HANDLE(cam);
+
+    if (cam->io != IO_METHOD_USERPTR) {
+        cam_error("camera_set_userptr needs IO_METHOD_USERPTR");
         return false;
     }
 
-    _cam_state.capability = cap;
+    if (cam->running) {
+        cam_error("Can not change the arena while the camera is running");
+        return false;
+    }
 
-    switch (_cam_state.io) {
-        case IO_METHOD_READ:
-            if (!(cap.capabilities & V4L2_CAP_READWRITE)) {
-                cam_error("%s does not support read i/o",
-                _cam_state.dev_name);
-                return false;
-            }
-            break;
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (!arena || (uintptr_t)arena % page != 0) {
+        cam_error("The arena has to be page aligned");
+        return false;
+    }
 
-        case IO_METHOD_MMAP:
-            if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
-                cam_error("%s does not support streaming i/o",
-                        _cam_state.dev_name);
-                return false;
+    if (size < camera_userptr_size(cam)) {
+        cam_error("The arena is too small (%zu < %zu bytes)", size,
+                camera_userptr_size(cam));
+        return false;
+    }
+
+    if (cam->arena_owned) munmap(cam->arena, cam->arena_size);
+    cam->arena = arena;
+    cam->arena_size = size;
+    cam->arena_owned = false;
+
+    size_t stride = _cam_userptr_stride(cam);
+    for (unsigned int i = 0; i < cam->n_buffers; i++) {
+        cam->buffers[i].ptr = (unsigned char *)arena + i * stride;
+        cam->buffers[i].length = cam->fmt.sizeimage;
+    }
+
+    return true;
+}
+
+// asks for fmt.fps (if set) and stores what the driver went with, the
+// driver keeps its old rate when this fails
+static bool _cam_negotiate_fps(Cam_Camera *cam)
+{
+    struct v4l2_streamparm parm;
+    __CLEAR(parm);
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    bool ret = true;
+    Cam_Rate want = cam->fmt.fps;
+    cam->fmt.fps = (Cam_Rate){0};
+
+    if (_xioctl(cam->fd, VIDIOC_G_PARM, &parm) == -1) {
+        // not every driver has streaming parameters
+        if (want.num) {
+            cam_warn("Can not set the framerate of '%s'", cam->dev_name);
+            ret = false;
+        }
+        return ret;
+    }
+
+    struct v4l2_fract *tpf = &parm.parm.capture.timeperframe;
+    if (want.num && want.den) {
+        if (!(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+            cam_warn("Can not set the framerate of '%s'", cam->dev_name);
+            ret = false;
+        } else {
+            // a time per frame is the inverse of the rate
+            tpf->numerator = want.den;
+            tpf->denominator = want.num;
+            if (_xioctl(cam->fd, VIDIOC_S_PARM, &parm) == -1) {
+                cam_warn("Could not set framerate: %s", strerror(errno));
+                ret = false;
+                if (_xioctl(cam->fd, VIDIOC_G_PARM, &parm) == -1) return ret;
             }
-            break;
+        }
     }
 
-    /* Select video input, video standard and tune here. */
-    __CLEAR(cropcap);
-    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (tpf->numerator && tpf->denominator) {
+        cam->fmt.fps = (Cam_Rate){ tpf->denominator, tpf->numerator };
+#ifndef _CAM_FIXED_TIMEOUT
+        cam->timeout_us = (long)(1000000ull * tpf->numerator / tpf->denominator);
+#endif
+    }
 
-    if (_xioctl(_cam_state.fd, VIDIOC_CROPCAP, &cropcap) == 0) {
-        crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        crop.c = cropcap.defrect; /* reset to default */
+    return ret;
+}
 
-        if (_xioctl(_cam_state.fd, VIDIOC_S_CROP, &crop) == -1) {
-            switch (errno) {
-                case EINVAL:
-                    /* Cropping not supported. */
-                    break;
-                default:
-                    /* Errors ignored. */
-                    break;
-                }
+// NV12 and friends, a full resolution Y plane followed by the chroma at half
+// the width and height
+static bool _cam_is_420(Cam_PixelFormat pixelformat)
+{
+    switch (pixelformat) {
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_NV21:
+        case V4L2_PIX_FMT_YUV420:
+        case V4L2_PIX_FMT_YVU420:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// sets up the conversion of cam->fmt
+static bool _cam_init_output(Cam_Camera *cam)
+{
+#ifndef CAM_NO_COVERT_TO_RGB
+    _cam_select_kernels(cam);
+
+    // only grows, the old buffer is reused when the new frames fit
+    if (!_cam_update_output(cam)) return false;
+
+#ifdef CAM_USE_TURBOJPEG
+    if (_cam_is_jpeg(cam->fmt.pixelformat) && !cam->jpeg) {
+        cam->jpeg = tjInitDecompress();
+        if (!cam->jpeg) {
+            cam_error("Could not create jpeg decoder: %s", tjGetErrorStr2(NULL));
+            return false;
         }
     }
+#endif
+#else
+    (void)cam;
+#endif
+    return true;
+}
+
+// sets (or gets when width, height and pixelformat are 0) the format and sets
+// up everything that depends on it, the buffers included
+static bool _cam_apply_format(Cam_Camera *cam, const Cam_Format *cam_fmt)
+{
+    struct v4l2_format fmt;
 
     __CLEAR(fmt);
 
@@ -440,300 +1872,5019 @@ bool camera_open(const char *device, Cam_Format *cam_fmt, Cam_IoMethod io)
         fmt.fmt.pix.pixelformat = cam_fmt->pixelformat;
 
         /* NOTE VIDIOC_S_FMT may change width and height. */
-        if (_xioctl(_cam_state.fd, VIDIOC_S_FMT, &fmt) == -1) {
-            cam_error("Could not set format for '%s'", _cam_state.dev_name);
+        if (_xioctl(cam->fd, VIDIOC_S_FMT, &fmt) == -1) {
+            cam_error("Could not set format for '%s'", cam->dev_name);
             return false;
         }
     } else {
         /* Preserve original settings as set by v4l2-ctl for example */
-        if (_xioctl(_cam_state.fd, VIDIOC_G_FMT, &fmt) == -1) {
-            cam_error("Could not get format for '%s'", _cam_state.dev_name);
+        if (_xioctl(cam->fd, VIDIOC_G_FMT, &fmt) == -1) {
+            cam_error("Could not get format for '%s'", cam->dev_name);
             return false;
         }
     }
 
     /* Buggy driver paranoia. */
-    unsigned int min = fmt.fmt.pix.width * 2;
+    bool planar = _cam_is_420(fmt.fmt.pix.pixelformat);
+    unsigned int min = fmt.fmt.pix.width;
+    if (!planar && fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_GREY)
+        min *= 2;
     if (fmt.fmt.pix.bytesperline < min)
         fmt.fmt.pix.bytesperline = min;
     min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
+    // the chroma of 4:2:0 takes another half of the luma
+    if (planar)
+        min += fmt.fmt.pix.bytesperline * ((fmt.fmt.pix.height + 1) / 2);
     if (fmt.fmt.pix.sizeimage < min)
         fmt.fmt.pix.sizeimage = min;
 
 
-    // store the camera's pixel format in global state and set the user's ptr
-    // since VIDIOC_S_FMT might have set different values
-    // TODO: set/get framerate
-    _cam_state.fmt = (Cam_Format){
+    // store the camera's pixel format, VIDIOC_S_FMT might have set different
+    // values
+    cam->fmt = (Cam_Format){
         .width = fmt.fmt.pix.width,
         .height = fmt.fmt.pix.height,
         .sizeimage = fmt.fmt.pix.sizeimage,
         .stride = fmt.fmt.pix.bytesperline, // idk if this is always valid
         .pixelformat = fmt.fmt.pix.pixelformat,
+        .fps = cam_fmt->fps,
+        .buffer_count = cam_fmt->buffer_count ? cam_fmt->buffer_count
+            : CAM_DEFAULT_BUFFER_COUNT,
     };
-    *cam_fmt = _cam_state.fmt;
+    _cam_negotiate_fps(cam);
 
-#ifndef CAM_NO_COVERT_TO_RGB
-    // XXX: this should be reallocated if changing format after input is
-    //      ever implemented
-    _cam_state.rgb_buffer_size = _cam_state.fmt.width *
-        _cam_state.fmt.height * 3;
-    _cam_state.rgb_buffer = malloc(_cam_state.rgb_buffer_size);
-    memset(_cam_state.rgb_buffer, 0, _cam_state.rgb_buffer_size);
-#endif
+    if (!_cam_init_output(cam)) return false;
 
     // Allocate buffers and set initialize IO
-    bool ret = true;
-    switch (_cam_state.io) {
+    switch (cam->io) {
         case IO_METHOD_READ:
-            _init_io_read(_cam_state.fmt.sizeimage);
+            _init_io_read(cam, cam->fmt.sizeimage);
             break;
         case IO_METHOD_MMAP:
-            ret = _init_io_mmap();
+        case IO_METHOD_DMABUF_EXPORT:
+            if (!_init_io_mmap(cam)) return false;
             break;
-    }
-
-
-    cam_info("Device '%s' opened", _cam_state.dev_name);
-    cam_info("Model: %s", cap.card);
-    // extract the 4cc from pixelformat
-    char fmt_name[5];
-    memcpy(fmt_name, &cam_fmt->pixelformat, sizeof(cam_fmt->pixelformat));
-    fmt_name[4] = '\0';
-    cam_info("Format: %dx%d %s", cam_fmt->width, cam_fmt->height, fmt_name);
-
-    switch (_cam_state.fmt.pixelformat) {
-        case V4L2_PIX_FMT_YUYV:
+        case IO_METHOD_DMABUF:
+        case IO_METHOD_USERPTR:
+            if (!_init_io_external(cam)) return false;
+            break;
+        case IO_METHOD_FILE:
+            // recordings have no format to apply
             break;
-        default:
-            cam_warn("Can not convert %s to RGB24", fmt_name);
     }
 
-    return ret;
+    return true;
 }
 
-bool camera_begin()
-{
-    if (_cam_state.running) {
-        cam_warn("Camera is already running");
-        return false;
-    }
+// Recordings start with a _Cam_RecHeader followed by the frames, each a
+// _Cam_RecFrame and its payload padded to _CAM_REC_ALIGN. The index is an
+// array of frame offsets written at the end when the recording is finished.
+#define _CAM_REC_MAGIC "CAMREC\0\0"
+#define _CAM_REC_VERSION 1
+#define _CAM_REC_FRAME_MAGIC 0x464d4143 // "CAMF"
+#define _CAM_REC_ALIGN 64
 
-    unsigned int i;
-    enum v4l2_buf_type type;
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t pixelformat;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t sizeimage;
+    uint32_t fps_num;
+    uint32_t fps_den;
+    // 0 until the recording is finished
+    uint64_t index_offset;
+    uint64_t n_frames;
+    uint8_t reserved[8];
+} _Cam_RecHeader;
 
-    switch (_cam_state.io) {
-        case IO_METHOD_READ:
-            /* Nothing to do. */
-            break;
+typedef struct {
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t timestamp_ns;
+    uint64_t bytesused;
+    uint32_t sequence;
+    uint32_t clock;
+    uint32_t start_of_exposure;
+    uint8_t reserved[28];
+} _Cam_RecFrame;
+
+_Static_assert(sizeof(_Cam_RecHeader) == _CAM_REC_ALIGN, "recording header");
+_Static_assert(sizeof(_Cam_RecFrame) == _CAM_REC_ALIGN, "recording frame");
+
+static size_t _cam_rec_align(size_t size)
+{
+    return (size + _CAM_REC_ALIGN - 1) & ~(size_t)(_CAM_REC_ALIGN - 1);
+}
 
-        case IO_METHOD_MMAP:
-            for (i = 0; i < _cam_state.n_buffers; ++i) {
-                struct v4l2_buffer buf;
+struct _Cam_Replay {
+    unsigned char *map;
+    size_t size;
+    // points into map for finished recordings, otherwise allocated
+    const uint64_t *offsets;
+    bool offsets_owned;
+    size_t n_frames;
+    // next frame to hand out and the buffer it went into last
+    size_t next;
+    unsigned int last_index;
+};
+
+static void _cam_replay_free(struct _Cam_Replay *replay)
+{
+    if (replay->map) munmap(replay->map, replay->size);
+    if (replay->offsets_owned) free((void *)replay->offsets);
+    free(replay);
+}
 
-                __CLEAR(buf);
-                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                buf.memory = V4L2_MEMORY_MMAP;
-                buf.index = i;
+// the record at offset if it is complete
+static const _Cam_RecFrame *_cam_replay_record(const struct _Cam_Replay *replay,
+        uint64_t offset)
+{
+    if (offset < sizeof(_Cam_RecHeader) || offset % _CAM_REC_ALIGN ||
+            offset > replay->size - sizeof(_Cam_RecFrame))
+        return NULL;
+
+    const _Cam_RecFrame *rec = (const void *)(replay->map + offset);
+    if (rec->magic != _CAM_REC_FRAME_MAGIC ||
+            rec->bytesused > replay->size - offset - sizeof(*rec))
+        return NULL;
+    return rec;
+}
 
-                if (_xioctl(_cam_state.fd, VIDIOC_QBUF, &buf) == -1) {
-                    cam_error("Could not query buffer");
-                    return false;
-                }
-            }
-            type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            if (_xioctl(_cam_state.fd, VIDIOC_STREAMON, &type) == -1) {
-                cam_error("Could not turn on stream");
+// walks the frames of a recording that was not finished
+static bool _cam_replay_scan(struct _Cam_Replay *replay)
+{
+    size_t cap = 0;
+    uint64_t *offsets = NULL;
+    uint64_t offset = sizeof(_Cam_RecHeader);
+    const _Cam_RecFrame *rec;
+
+    while ((rec = _cam_replay_record(replay, offset))) {
+        if (replay->n_frames == cap) {
+            cap = cap ? cap * 2 : 256;
+            uint64_t *grown = realloc(offsets, cap * sizeof(*offsets));
+            if (!grown) {
+                free(offsets);
                 return false;
             }
-            break;
+            offsets = grown;
+        }
+        offsets[replay->n_frames++] = offset;
+        offset += sizeof(*rec) + _cam_rec_align(rec->bytesused);
     }
 
-    _cam_state.running = true;
+    replay->offsets = offsets;
+    replay->offsets_owned = true;
     return true;
 }
 
-#ifndef CAM_DEFAULT_TIMEOUT_US
-#define CAM_DEFAULT_TIMEOUT_US 33333
-#endif
-bool camera_get_frame_raw(Cam_Buffer *buf, struct timeval *timeout)
+static bool _cam_open_recording(Cam_Camera *cam, const Cam_Format *cam_fmt)
 {
-    fd_set fds;
-    struct timeval tv;
-    int r;
+    cam->fd = open(cam->dev_name, O_RDONLY | O_CLOEXEC);
+    if (cam->fd == -1) {
+        cam_error("Cannot open '%s': %s", cam->dev_name, strerror(errno));
+        return false;
+    }
+    cam->io = IO_METHOD_FILE;
 
-    if (!buf) return false;
+    struct stat st;
+    struct _Cam_Replay *replay = calloc(1, sizeof(*replay));
+    if (!replay || fstat(cam->fd, &st) == -1) {
+        cam_error("Could not open recording '%s'", cam->dev_name);
+        free(replay);
+        return false;
+    }
+    cam->replay = replay;
 
-    FD_ZERO(&fds);
-        FD_SET(_cam_state.fd, &fds);
+    replay->size = st.st_size;
+    if (replay->size < sizeof(_Cam_RecHeader)) {
+        cam_error("'%s' is not a recording", cam->dev_name);
+        return false;
+    }
+    // private so a user writing into a frame does not touch the file
+    void *map = mmap(NULL, replay->size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+            cam->fd, 0);
+    if (map == MAP_FAILED) {
+        cam_error("Could not map '%s': %s", cam->dev_name, strerror(errno));
+        return false;
+    }
+    replay->map = map;
+    madvise(map, replay->size, MADV_SEQUENTIAL);
+    madvise(map, replay->size, MADV_WILLNEED);
+
+    const _Cam_RecHeader *header = map;
+    if (memcmp(header->magic, _CAM_REC_MAGIC, sizeof(header->magic)) ||
+            header->version != _CAM_REC_VERSION) {
+        cam_error("'%s' is not a recording", cam->dev_name);
+        return false;
+    }
 
-    if (timeout) {
-        tv = *timeout;
+    uint64_t index = header->index_offset, n = header->n_frames;
+    if (index && index % _CAM_REC_ALIGN == 0 && index <= replay->size &&
+            n <= (replay->size - index) / sizeof(uint64_t)) {
+        replay->offsets = (const void *)(replay->map + index);
+        replay->n_frames = n;
     } else {
-        tv.tv_sec = 0;
-        tv.tv_usec = CAM_DEFAULT_TIMEOUT_US;
+        cam_warn("'%s' was not finished, scanning it", cam->dev_name);
+        if (!_cam_replay_scan(replay)) {
+            cam_error("Could not index '%s'", cam->dev_name);
+            return false;
+        }
     }
 
-    r = select(_cam_state.fd + 1, &fds, NULL, NULL, &tv);
-    if (r == -1) {
-        cam_error("select");
+    cam->fmt = (Cam_Format){
+        .width = header->width,
+        .height = header->height,
+        .stride = header->stride,
+        .sizeimage = header->sizeimage,
+        .pixelformat = header->pixelformat,
+        .fps = { header->fps_num, header->fps_den },
+        .buffer_count = cam_fmt->buffer_count ? cam_fmt->buffer_count
+            : CAM_DEFAULT_BUFFER_COUNT,
+    };
+    if ((cam_fmt->width && cam_fmt->width != cam->fmt.width) ||
+            (cam_fmt->height && cam_fmt->height != cam->fmt.height) ||
+            (cam_fmt->pixelformat &&
+             cam_fmt->pixelformat != cam->fmt.pixelformat))
+        cam_warn("'%s' is replayed in the format it was recorded in",
+                cam->dev_name);
+
+    snprintf((char *)cam->capability.driver, sizeof(cam->capability.driver),
+            "recording");
+    snprintf((char *)cam->capability.card, sizeof(cam->capability.card),
+            "%zu recorded frames", replay->n_frames);
+
+    if (!_cam_init_output(cam)) return false;
+
+    // buffers only point into the mapping, they are filled in when dequeued
+    cam->n_buffers = cam->fmt.buffer_count;
+    cam->buffers = calloc(cam->n_buffers, sizeof(*cam->buffers));
+    cam->held = calloc(cam->n_buffers, sizeof(*cam->held));
+    if (!cam->buffers || !cam->held) {
+        cam_error("Out of memory");
         return false;
     }
-    if (r == 0) return false;
-
-    return _read_frame(buf);
+    for (unsigned int i = 0; i < cam->n_buffers; i++)
+        cam->buffers[i].dmabuf_fd = -1;
+    replay->last_index = cam->n_buffers - 1;
+    return true;
 }
 
-#define CLAMP(x) ((x) > 255 ? 255 : ((x) < 0 ? 0 : (x)))
-
-// There is so little information about converting YUYV to rgb
-// (or maybe search engines are just cooked)
-// https://stackoverflow.com/a/72234444
-static void yuyv_to_rgb(Cam_Surface *surf, Cam_Buffer *buf)
+// hands out the next recorded frame in a buffer that is not held
+static bool _cam_replay_next(Cam_Camera *cam, Cam_Frame *frame)
 {
-#define Y_OFFSET   16
-#define UV_OFFSET 128
-#define YUV2RGB_11  298
-#define YUV2RGB_12   -1
-#define YUV2RGB_13  409
-#define YUV2RGB_22 -100
-#define YUV2RGB_23 -210
-#define YUV2RGB_32  519
-#define YUV2RGB_33    0
+    struct _Cam_Replay *replay = cam->replay;
+    if (replay->next >= replay->n_frames) return false;
+
+    const _Cam_RecFrame *rec = _cam_replay_record(replay,
+            replay->offsets[replay->next]);
+    if (!rec) {
+        cam_error("Frame %zu of '%s' is damaged, stopping", replay->next,
+                cam->dev_name);
+        replay->next = replay->n_frames;
+        return false;
+    }
+    replay->next++;
 
-    unsigned char *pixels   = _cam_state.rgb_buffer;
-    unsigned char *yuyvdata = buf->ptr;
-    int count = buf->length / 4; // 2 YUYV 16bit "pixels" per loop
-    while (count--) {
-        int y, u, v;
-        int uv_r, uv_g, uv_b;
+    unsigned int index = replay->last_index;
+    do {
+        index = (index + 1) % cam->n_buffers;
+    } while (cam->held[index]);
+    replay->last_index = index;
+
+    Cam_Buffer *buf = &cam->buffers[index];
+    buf->ptr = (unsigned char *)rec + sizeof(*rec);
+    buf->length = rec->bytesused;
+    buf->info = (Cam_FrameInfo){
+        .timestamp_ns = rec->timestamp_ns,
+        .sequence = rec->sequence,
+        .bytesused = rec->bytesused,
+        .flags = rec->flags,
+        .clock = rec->clock,
+        .start_of_exposure = rec->start_of_exposure,
+    };
+    frame->buffer = *buf;
+    frame->index = index;
+    return true;
+}
 
-        u = yuyvdata[1] - UV_OFFSET;
-        v = yuyvdata[3] - UV_OFFSET;
-        uv_r = YUV2RGB_12*u + YUV2RGB_13*v;
-        uv_g = YUV2RGB_22*u + YUV2RGB_23*v;
-        uv_b = YUV2RGB_32*u + YUV2RGB_33*v;
+size_t camera_replay_length(Cam_Camera *cam)
+{
+    cam = _CAM_HANDLE(cam);
+    return cam->replay ? cam->replay->n_frames : 0;
+}
 
-        // 1st pixel
-        y = YUV2RGB_11 * (yuyvdata[0] - Y_OFFSET);
-        pixels[0] = CLAMP((y + uv_r) >> 8); // r
-        pixels[1] = CLAMP((y + uv_g) >> 8); // g
-        pixels[2] = CLAMP((y + uv_b) >> 8); // b
-        pixels += 3;
+// with io_uring full staging buffers are written in the background while
+// the next one fills up
+#ifdef CAM_USE_IO_URING
+#define _CAM_REC_CHUNKS 4
+#else
+#define _CAM_REC_CHUNKS 1
+#endif
 
-        // 2nd pixel
-        y = YUV2RGB_11*(yuyvdata[2] - Y_OFFSET);
-        pixels[0] = CLAMP((y + uv_r) >> 8); // r
-        pixels[1] = CLAMP((y + uv_g) >> 8); // g
-        pixels[2] = CLAMP((y + uv_b) >> 8); // b
-        pixels += 3;
+struct Cam_Recorder {
+    char *path;
+    int fd;
+    bool direct;
+    // _CAM_REC_CHUNKS staging buffers aligned for O_DIRECT, data is the one
+    // being filled
+    unsigned char *chunks;
+    unsigned int chunk;
+    unsigned char *data;
+    size_t used;
+    // bytes appended so far (the offset of the next record) and the ones
+    // handed to the file
+    uint64_t offset;
+    uint64_t written;
+    uint64_t *offsets;
+    size_t n_frames;
+    size_t cap;
+    _Cam_RecHeader header;
+    bool failed;
+#ifdef CAM_USE_IO_URING
+    _Cam_Uring ring;
+    bool uring;
+    // bytes in flight from each chunk (0 when it is free) and where to
+    size_t busy[_CAM_REC_CHUNKS];
+    uint64_t busy_at[_CAM_REC_CHUNKS];
+#endif
+};
 
-        yuyvdata += 4;
+static bool _cam_rec_write(Cam_Recorder *rec, const unsigned char *data,
+        size_t size, uint64_t offset)
+{
+    while (size) {
+        ssize_t n = pwrite(rec->fd, data, size, offset);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            cam_error("Could not write to '%s': %s", rec->path, strerror(errno));
+            rec->failed = true;
+            return false;
+        }
+        data += n;
+        size -= n;
+        offset += n;
     }
-
-    surf->pixelformat = CAM_PIX_FMT_RGB24;
-    surf->data = _cam_state.rgb_buffer;
+    return true;
 }
 
-bool camera_get_frame(Cam_Surface *surf, struct timeval *timeout)
+#ifdef CAM_USE_IO_URING
+static void _cam_rec_reap(Cam_Recorder *rec)
 {
-    if (!surf) return false;
+    struct io_uring_cqe cqe;
+    while (_cam_uring_cqe(&rec->ring, &cqe)) {
+        unsigned int i = cqe.user_data;
+        size_t size = rec->busy[i];
+        rec->busy[i] = 0;
+        if (cqe.res < 0) {
+            cam_error("Could not write to '%s': %s", rec->path,
+                    strerror(-cqe.res));
+            rec->failed = true;
+        } else if ((size_t)cqe.res < size) {
+            // short write, finish it here
+            _cam_rec_write(rec, rec->chunks + i * CAM_RECORD_BUFFER_SIZE +
+                    cqe.res, size - cqe.res, rec->busy_at[i] + cqe.res);
+        }
+    }
+}
 
-    Cam_Buffer buf = {0};
-    if (!camera_get_frame_raw(&buf, timeout)) return false;
+// waits until chunk (every chunk when it is _CAM_REC_CHUNKS) is written
+static void _cam_rec_wait(Cam_Recorder *rec, unsigned int chunk)
+{
+    for (;;) {
+        _cam_rec_reap(rec);
+        bool busy = false;
+        for (unsigned int i = 0; i < _CAM_REC_CHUNKS; i++)
+            if (rec->busy[i] && (chunk == _CAM_REC_CHUNKS || i == chunk))
+                busy = true;
+        if (!busy) return;
+
+        if (!_cam_uring_enter(&rec->ring, 1, NULL) && errno != EINTR) {
+            cam_error("io_uring_enter: %s", strerror(errno));
+            rec->failed = true;
+            return;
+        }
+    }
+}
+#endif
 
-    surf->data = buf.ptr;
-    surf->width = _cam_state.fmt.width;
-    surf->height = _cam_state.fmt.height;
-    surf->pixelformat = _cam_state.fmt.pixelformat;
+// hands the full staging buffer to the file
+static bool _cam_rec_flush(Cam_Recorder *rec)
+{
+    size_t size = rec->used;
+    uint64_t at = rec->written;
+    rec->written += size;
+    rec->used = 0;
+
+#ifdef CAM_USE_IO_URING
+    if (rec->uring) {
+        unsigned int i = rec->chunk;
+        // at most one write per chunk, the ring has room for all of them
+        struct io_uring_sqe *sqe = _cam_uring_sqe(&rec->ring);
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = rec->fd;
+        sqe->addr = (uintptr_t)rec->data;
+        sqe->len = size;
+        sqe->off = at;
+        sqe->buf_index = i;
+        sqe->user_data = i;
+        rec->busy[i] = size;
+        rec->busy_at[i] = at;
+        if (!_cam_uring_enter(&rec->ring, 0, NULL)) {
+            cam_error("io_uring_enter: %s", strerror(errno));
+            rec->failed = true;
+            return false;
+        }
 
-#ifndef CAM_NO_COVERT_TO_RGB
-    switch (surf->pixelformat) {
-        case V4L2_PIX_FMT_YUYV:
-            yuyv_to_rgb(surf, &buf);
-            break;
-        default:
-            break;
-            // Not supported
+        rec->chunk = (i + 1) % _CAM_REC_CHUNKS;
+        rec->data = rec->chunks + rec->chunk * CAM_RECORD_BUFFER_SIZE;
+        _cam_rec_wait(rec, rec->chunk);
+        return !rec->failed;
     }
 #endif
+    return _cam_rec_write(rec, rec->data, size, at);
+}
+
+// copies size bytes of data (zeros when data is NULL) into the staging
+// buffer and writes it out whenever it is full
+static bool _cam_rec_append(Cam_Recorder *rec, const void *data, size_t size)
+{
+    const unsigned char *src = data;
+    rec->offset += size;
+    while (size) {
+        size_t n = CAM_RECORD_BUFFER_SIZE - rec->used;
+        if (n > size) n = size;
+        if (src) {
+            memcpy(rec->data + rec->used, src, n);
+            src += n;
+        } else {
+            memset(rec->data + rec->used, 0, n);
+        }
+        rec->used += n;
+        size -= n;
 
+        if (rec->used == CAM_RECORD_BUFFER_SIZE && !_cam_rec_flush(rec))
+            return false;
+    }
     return true;
 }
 
-bool camera_end()
+Cam_Recorder *camera_recorder_create(const char *path, const Cam_Format *fmt,
+        bool direct)
 {
-    if (!_cam_state.running) {
-        cam_warn("Camera is not running");
-        return false;
-    }
+    if (!path || !fmt) return NULL;
 
-    enum v4l2_buf_type type;
+    Cam_Recorder *rec = calloc(1, sizeof(*rec));
+    if (!rec) {
+        cam_error("Could not allocate recorder");
+        return NULL;
+    }
+    rec->fd = -1;
+#ifdef CAM_USE_IO_URING
+    rec->ring.fd = -1;
+#endif
+    rec->path = strdup(path);
+    if (!rec->path || posix_memalign((void **)&rec->chunks,
+                sysconf(_SC_PAGESIZE),
+                _CAM_REC_CHUNKS * (size_t)CAM_RECORD_BUFFER_SIZE)) {
+        cam_error("Could not allocate the recording buffer");
+        camera_recorder_destroy(rec);
+        return NULL;
+    }
+    rec->data = rec->chunks;
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    if (direct) {
+        rec->fd = open(path, flags | O_DIRECT, 0644);
+        // e.g. tmpfs
+        if (rec->fd == -1 && errno == EINVAL)
+            cam_warn("'%s' does not support O_DIRECT", path);
+        else
+            rec->direct = rec->fd != -1;
+    }
+    if (rec->fd == -1) rec->fd = open(path, flags, 0644);
+    if (rec->fd == -1) {
+        cam_error("Cannot open '%s': %s", path, strerror(errno));
+        camera_recorder_destroy(rec);
+        return NULL;
+    }
 
-    switch (_cam_state.io) {
-        case IO_METHOD_READ:
-            /* Nothing to do. */
-            break;
-        case IO_METHOD_MMAP:
-            type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            if (_xioctl(_cam_state.fd, VIDIOC_STREAMOFF, &type) == -1) {
-                cam_error("Could not turn off stream");
-                return false;
-            }
-            break;
+#ifdef CAM_USE_IO_URING
+    struct iovec iov[_CAM_REC_CHUNKS];
+    for (unsigned int i = 0; i < _CAM_REC_CHUNKS; i++) {
+        iov[i].iov_base = rec->chunks + i * CAM_RECORD_BUFFER_SIZE;
+        iov[i].iov_len = CAM_RECORD_BUFFER_SIZE;
+    }
+    if (_cam_uring_init(&rec->ring, _CAM_REC_CHUNKS) &&
+            _cam_uring_register(&rec->ring, iov, _CAM_REC_CHUNKS)) {
+        rec->uring = true;
+    } else {
+        cam_info("io_uring is not available (%s), writing '%s' directly",
+                strerror(errno), path);
+        _cam_uring_free(&rec->ring);
     }
+#endif
 
-    _cam_state.running = false;
-    return true;
+    rec->header = (_Cam_RecHeader){
+        .version = _CAM_REC_VERSION,
+        .pixelformat = fmt->pixelformat,
+        .width = fmt->width,
+        .height = fmt->height,
+        .stride = fmt->stride,
+        .sizeimage = fmt->sizeimage,
+        .fps_num = fmt->fps.num,
+        .fps_den = fmt->fps.den,
+    };
+    memcpy(rec->header.magic, _CAM_REC_MAGIC, sizeof(rec->header.magic));
+    _cam_rec_append(rec, &rec->header, sizeof(rec->header));
+    return rec;
 }
 
-bool camera_close()
+bool camera_recorder_write(Cam_Recorder *rec, const Cam_Buffer *buf)
 {
-    if (_cam_state.fd < 0) {
-        cam_warn("Camera is not open");
-        return false;
-    }
+    if (!rec || !buf || !buf->ptr || rec->failed) return false;
 
-    unsigned int i;
+    if (rec->n_frames == rec->cap) {
+        size_t cap = rec->cap ? rec->cap * 2 : 1024;
+        uint64_t *offsets = realloc(rec->offsets, cap * sizeof(*offsets));
+        if (!offsets) {
+            cam_error("Could not grow the recording index");
+            return false;
+        }
+        rec->offsets = offsets;
+        rec->cap = cap;
+    }
 
-    // free the buffers
-    if (_cam_state.rgb_buffer)
-        free(_cam_state.rgb_buffer);
-    switch (_cam_state.io) {
+    size_t size = buf->info.bytesused;
+    if (!size || size > buf->length) size = buf->length;
+    _Cam_RecFrame frame = {
+        .magic = _CAM_REC_FRAME_MAGIC,
+        .flags = buf->info.flags,
+        .timestamp_ns = buf->info.timestamp_ns,
+        .bytesused = size,
+        .sequence = buf->info.sequence,
+        .clock = buf->info.clock,
+        .start_of_exposure = buf->info.start_of_exposure,
+    };
+    uint64_t offset = rec->offset;
+    if (!_cam_rec_append(rec, &frame, sizeof(frame)) ||
+            !_cam_rec_append(rec, buf->ptr, size) ||
+            !_cam_rec_append(rec, NULL, _cam_rec_align(size) - size))
+        return false;
+
+    rec->offsets[rec->n_frames++] = offset;
+    return true;
+}
+
+bool camera_recorder_destroy(Cam_Recorder *rec)
+{
+    if (!rec) return false;
+
+#ifdef CAM_USE_IO_URING
+    if (rec->uring) _cam_rec_wait(rec, _CAM_REC_CHUNKS);
+    _cam_uring_free(&rec->ring);
+#endif
+
+    bool ret = false;
+    if (rec->fd >= 0 && !rec->failed) {
+        // the tail is not a whole block, finish without O_DIRECT
+        if (rec->direct) {
+            int flags = fcntl(rec->fd, F_GETFL);
+            if (flags == -1 || fcntl(rec->fd, F_SETFL, flags & ~O_DIRECT) == -1)
+                cam_error("Could not turn off O_DIRECT: %s", strerror(errno));
+        }
+
+        rec->header.index_offset = rec->offset;
+        rec->header.n_frames = rec->n_frames;
+        ret = _cam_rec_write(rec, rec->data, rec->used, rec->written) &&
+            _cam_rec_write(rec, (const void *)rec->offsets,
+                    rec->n_frames * sizeof(*rec->offsets), rec->offset) &&
+            _cam_rec_write(rec, (const void *)&rec->header,
+                    sizeof(rec->header), 0);
+        if (!ret) cam_error("Could not finish '%s'", rec->path);
+    }
+
+    if (rec->fd >= 0 && close(rec->fd) == -1) {
+        cam_error("close");
+        ret = false;
+    }
+    free(rec->chunks);
+    free(rec->offsets);
+    free(rec->path);
+    free(rec);
+    return ret;
+}
+
+static void _cam_log_opened(Cam_Camera *cam)
+{
+    cam_info("Device '%s' opened", cam->dev_name);
+    cam_info("Model: %s", cam->capability.card);
+    // extract the 4cc from pixelformat
+    char fmt_name[5];
+    memcpy(fmt_name, &cam->fmt.pixelformat, sizeof(cam->fmt.pixelformat));
+    fmt_name[4] = '\0';
+    cam_info("Format: %zux%zu %s", cam->fmt.width, cam->fmt.height, fmt_name);
+    if (cam->fmt.fps.den)
+        cam_info("Framerate: %.2f", (double)cam->fmt.fps.num / cam->fmt.fps.den);
+
+    switch (cam->fmt.pixelformat) {
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_UYVY:
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_NV21:
+        case V4L2_PIX_FMT_YUV420:
+        case V4L2_PIX_FMT_YVU420:
+        case V4L2_PIX_FMT_GREY:
+        case V4L2_PIX_FMT_RGB565:
+#ifndef CAM_NO_COVERT_TO_RGB
+            cam_info("Conversion: %s", cam->kernels->name);
+#endif
+            break;
+#if defined(CAM_USE_TURBOJPEG) && !defined(CAM_NO_COVERT_TO_RGB)
+        case V4L2_PIX_FMT_MJPEG:
+        case V4L2_PIX_FMT_JPEG:
+            cam_info("Conversion: turbojpeg");
+            break;
+#endif
+        default:
+            cam_warn("Can not convert %s to RGB24", fmt_name);
+    }
+}
+
+static bool _camera_open(Cam_Camera *cam, const char *device,
+        Cam_Format *cam_fmt, Cam_IoMethod io)
+{
+    struct stat st;
+
+    if (!cam_fmt) {
+        cam_error("cam_fmt cannot be NULL");
+        return false;
+    }
+
+    if (device)
+        cam->dev_name = device;
+
+    if (stat(cam->dev_name, &st) == -1) {
+        cam_error("Cannot identify '%s':  %s",
+                cam->dev_name, strerror(errno));
+        return false;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        if (!_cam_open_recording(cam, cam_fmt)) return false;
+        *cam_fmt = cam->fmt;
+        _cam_log_opened(cam);
+        return true;
+    }
+
+    if (!S_ISCHR(st.st_mode)) {
+        cam_error("%s is not device", cam->dev_name);
+        return false;
+    }
+
+    cam->fd = open(cam->dev_name,
+            O_RDWR /* required */ | O_NONBLOCK, 0);
+    if (cam->fd == -1) {
+        cam_error("Cannot open '%s': %s", cam->dev_name,
+                strerror(errno));
+        return false;
+    }
+    
+    // Camera Initialization
+    struct v4l2_capability cap;
+    struct v4l2_cropcap cropcap;
+    struct v4l2_crop crop;
+
+    cam->io = io;
+
+    if (_xioctl(cam->fd, VIDIOC_QUERYCAP, &cap) == -1) {
+        if (errno == EINVAL) {
+            cam_error("%s is not V4L2 device", cam->dev_name);
+            return false;
+        } else {
+            cam_error("Could not query capabilities");
+            return false;
+        }
+    }
+
+    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
+        cam_error("%s is not video capture device", cam->dev_name);
+        return false;
+    }
+
+    cam->capability = cap;
+
+    switch (cam->io) {
         case IO_METHOD_READ:
-            free(_cam_state.buffers[0].ptr);
+            if (!(cap.capabilities & V4L2_CAP_READWRITE)) {
+                cam_error("%s does not support read i/o",
+                cam->dev_name);
+                return false;
+            }
             break;
 
         case IO_METHOD_MMAP:
-            for (i = 0; i < _cam_state.n_buffers; ++i)
-                if (-1 == munmap(_cam_state.buffers[i].ptr,
-                            _cam_state.buffers[i].length)) {
-                    cam_error("munmap");
-                    return false;
-                }
+        case IO_METHOD_DMABUF_EXPORT:
+        case IO_METHOD_DMABUF:
+        case IO_METHOD_USERPTR:
+            if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
+                cam_error("%s does not support streaming i/o",
+                        cam->dev_name);
+                return false;
+            }
             break;
+
+        case IO_METHOD_FILE:
+            cam_error("%s is a device, not a recording", cam->dev_name);
+            return false;
+    }
+
+    /* Select video input, video standard and tune here. */
+    __CLEAR(cropcap);
+    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (_xioctl(cam->fd, VIDIOC_CROPCAP, &cropcap) == 0) {
+        crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        crop.c = cropcap.defrect; /* reset to default */
+
+        if (_xioctl(cam->fd, VIDIOC_S_CROP, &crop) == -1) {
+            switch (errno) {
+                case EINVAL:
+                    /* Cropping not supported. */
+                    break;
+                default:
+                    /* Errors ignored. */
+                    break;
+                }
+        }
+    }
+
+    if (!_cam_apply_format(cam, cam_fmt)) return false;
+    *cam_fmt = cam->fmt;
+
+    _cam_log_opened(cam);
+    return true;
+}
+
+
+// frees the capture buffers, a user provided arena is kept around
+static bool _cam_free_buffers(Cam_Camera *cam)
+{
+    bool ret = true;
+    unsigned int i;
+
+    if (cam->buffers) {
+        switch (cam->io) {
+            case IO_METHOD_READ:
+#ifdef CAM_USE_IO_URING
+                _cam_uring_close(cam);
+#endif
+                free(cam->buffers[0].ptr);
+                break;
+
+            case IO_METHOD_MMAP:
+            case IO_METHOD_DMABUF_EXPORT:
+                for (i = 0; i < cam->n_buffers; ++i) {
+                    if (-1 == munmap(cam->buffers[i].ptr,
+                                cam->buffers[i].length)) {
+                        cam_error("munmap");
+                        ret = false;
+                    }
+                    // exported fds are ours, imported ones are not
+                    if (cam->buffers[i].dmabuf_fd >= 0)
+                        close(cam->buffers[i].dmabuf_fd);
+                }
+                break;
+
+            case IO_METHOD_DMABUF:
+                for (i = 0; i < cam->n_buffers; ++i)
+                    if (cam->buffers[i].ptr)
+                        munmap(cam->buffers[i].ptr, cam->buffers[i].length);
+                break;
+
+            case IO_METHOD_USERPTR:
+                if (cam->arena_owned) {
+                    munmap(cam->arena, cam->arena_size);
+                    cam->arena = NULL;
+                    cam->arena_size = 0;
+                    cam->arena_owned = false;
+                }
+                break;
+
+            case IO_METHOD_FILE:
+                // the buffers point into the recording
+                break;
+        }
+    }
+
+    free(cam->buffers);
+    free(cam->held);
+    cam->buffers = NULL;
+    cam->held = NULL;
+    cam->n_buffers = 0;
+    cam->n_held = 0;
+    cam->pending = -1;
+    return ret;
+}
+
+// reserved huge pages are assumed to be 2 MiB (x86 and arm64 with 4k pages)
+#define _CAM_HUGE_PAGE_SIZE (2 << 20)
+
+// Anonymous memory for frames, page aligned and pre-faulted so the first
+// frames written into it do not take the page faults. *mapped is set to the
+// size that has to be passed to _cam_unmap_frames.
+static void *_cam_map_frames(size_t size, unsigned int flags, size_t *mapped)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size = (size + page - 1) / page * page;
+
+    void *ptr = MAP_FAILED;
+    if (flags & CAM_BUFFERS_HUGE_PAGES) {
+        size_t huge = (size + _CAM_HUGE_PAGE_SIZE - 1) / _CAM_HUGE_PAGE_SIZE *
+            _CAM_HUGE_PAGE_SIZE;
+        ptr = mmap(NULL, huge, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        if (ptr != MAP_FAILED) size = huge;
+    }
+    if (ptr == MAP_FAILED) {
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) return NULL;
+        // has to come before the pages are faulted in
+        if (flags & CAM_BUFFERS_HUGE_PAGES &&
+                madvise(ptr, size, MADV_HUGEPAGE) == -1)
+            cam_info("No huge pages for frames: %s", strerror(errno));
+        memset(ptr, 0, size);
+    }
+
+    if (flags & CAM_BUFFERS_LOCKED && mlock(ptr, size) == -1)
+        cam_warn("Could not lock %zu bytes of frames: %s", size, strerror(errno));
+
+    *mapped = size;
+    return ptr;
+}
+
+static void _cam_unmap_frames(void *ptr, size_t mapped)
+{
+    if (ptr && munmap(ptr, mapped) == -1) cam_error("munmap");
+}
+
+// see camera_set_output_buffers, count buffers of size bytes back to back in
+// one mapping
+struct _Cam_OutBuffers {
+    unsigned char *map;
+    size_t map_size;
+    size_t size;
+    unsigned int count;
+    // the buffers that are not handed out
+    unsigned char **free;
+    unsigned int n_free;
+#ifdef _CAM_THREADS
+    pthread_mutex_t lock;
+#endif
+};
+
+static void _cam_out_buffers_free(struct _Cam_OutBuffers *b)
+{
+    _cam_unmap_frames(b->map, b->map_size);
+#ifdef _CAM_THREADS
+    pthread_mutex_destroy(&b->lock);
+#endif
+    free(b->free);
+    free(b);
+}
+
+// (re)maps the buffers for frames of size bytes, none may be handed out
+static bool _cam_out_buffers_map(struct _Cam_OutBuffers *b, size_t size,
+        unsigned int flags)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size = (size + page - 1) / page * page;
+
+    _cam_unmap_frames(b->map, b->map_size);
+    b->map = _cam_map_frames(size * b->count, flags, &b->map_size);
+    if (!b->map) {
+        cam_error("Could not allocate %u output buffers", b->count);
+        b->size = 0;
+        b->n_free = 0;
+        return false;
     }
 
-    free(_cam_state.buffers);
+    b->size = size;
+    for (b->n_free = 0; b->n_free < b->count; b->n_free++)
+        b->free[b->n_free] = b->map + (b->count - 1 - b->n_free) * size;
+    return true;
+}
+
+// frees everything _camera_open managed to set up, this also has to handle a
+// partially opened camera
+static bool _camera_close(Cam_Camera *cam)
+{
+    bool ret = true;
+
+    // the capture thread has to be gone before anything it uses is freed
+    if (cam->running && !camera_end_ex(cam)) ret = false;
+
+    // free the buffers
+    _cam_unmap_frames(cam->rgb_buffer, cam->rgb_buffer_size);
+    if (cam->out_buffers)
+        _cam_out_buffers_free(cam->out_buffers);
+    free(cam->controls);
+    free(cam->control_batch);
+#ifdef CAM_USE_TURBOJPEG
+    if (cam->jpeg)
+        tjDestroy(cam->jpeg);
+#endif
+#ifdef _CAM_POOL
+    if (cam->pool)
+        _cam_pool_destroy(cam->pool);
+#endif
+#ifdef _CAM_THREADS
+    if (cam->ring)
+        _cam_ring_free(cam->ring);
+    if (cam->broadcast)
+        _cam_broadcast_free(cam->broadcast);
+#endif
+    if (!_cam_free_buffers(cam)) ret = false;
+    if (cam->replay)
+        _cam_replay_free(cam->replay);
 
     // close device
-    if (close(_cam_state.fd) == -1) {
+    if (cam->fd >= 0 && close(cam->fd) == -1) {
         cam_error("close");
+        ret = false;
+    }
+
+    *cam = (Cam_Camera)_CAM_CAMERA_INIT;
+    return ret;
+}
+
+Cam_Camera *camera_open_ex(const char *device, Cam_Format *cam_fmt,
+        Cam_IoMethod io)
+{
+    Cam_Camera *cam = malloc(sizeof(*cam));
+    if (!cam) {
+        cam_error("Could not allocate camera");
+        return NULL;
+    }
+    *cam = (Cam_Camera)_CAM_CAMERA_INIT;
+
+    if (!_camera_open(cam, device, cam_fmt, io)) {
+        _camera_close(cam);
+        free(cam);
+        return NULL;
+    }
+
+    return cam;
+}
+
+bool camera_open(const char *device, Cam_Format *cam_fmt, Cam_IoMethod io)
+{
+    Cam_Camera *cam = &_cam_default;
+    if (cam->fd >= 0) {
+        cam_warn("Camera is already open");
+        return false;
+    }
+
+    if (!_camera_open(cam, device, cam_fmt, io)) {
+        _camera_close(cam);
         return false;
     }
 
-    _cam_state.fd = -1;
     return true;
 }
 
-#endif // CAMERA_IMPLEMENTATION
-#endif // CAMERA_H
+bool camera_begin_ex(Cam_Camera *cam)
+{
+    cam = _CAM_HANDLE(cam);
+    if (cam->running) {
+        cam_warn("Camera is already running");
+        return false;
+    }
+
+    unsigned int i;
+    enum v4l2_buf_type type;
+
+    switch (cam->io) {
+        case IO_METHOD_READ:
+            /* Nothing to do. */
+            break;
+
+        case IO_METHOD_FILE:
+            cam->replay->next = 0;
+            break;
+
+        case IO_METHOD_MMAP:
+        case IO_METHOD_DMABUF_EXPORT:
+        case IO_METHOD_DMABUF:
+        case IO_METHOD_USERPTR:
+            if (cam->io == IO_METHOD_USERPTR && !cam->arena) {
+                size_t size = camera_userptr_size(cam);
+                void *arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+                if (arena == MAP_FAILED) {
+                    cam_error("Could not allocate user pointer arena");
+                    return false;
+                }
+                camera_set_userptr(cam, arena, size);
+                cam->arena_owned = true;
+            }
+
+            for (i = 0; i < cam->n_buffers; ++i) {
+                if (cam->io == IO_METHOD_DMABUF &&
+                        cam->buffers[i].dmabuf_fd < 0) {
+                    cam_error("No dmabufs given, call camera_set_dmabufs");
+                    return false;
+                }
+
+                if (!_queue_buffer(cam, i)) {
+                    cam_error("Could not queue buffer");
+                    return false;
+                }
+            }
+            type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            if (_xioctl(cam->fd, VIDIOC_STREAMON, &type) == -1) {
+                cam_error("Could not turn on stream");
+                return false;
+            }
+            break;
+    }
+
+    cam->running = true;
+    // sequence numbers start over with the stream
+    cam->have_sequence = false;
+#ifdef _CAM_THREADS
+    if (cam->ring && !_cam_ring_start(cam)) {
+        camera_end_ex(cam);
+        return false;
+    }
+#endif
+    return true;
+}
+
+static bool _cam_wait_fd(int fd, struct timeval *timeout, long timeout_us)
+{
+    fd_set fds;
+    struct timeval tv;
+    int r;
+
+    // the fds are non-blocking, reading just fails with EAGAIN when there
+    // is nothing. Useful when the caller already knows it is readable.
+    if (_cam_zero_timeout(timeout))
+        return true;
+
+    FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+
+    if (timeout) {
+        tv = *timeout;
+    } else {
+        tv.tv_sec = timeout_us / 1000000;
+        tv.tv_usec = timeout_us % 1000000;
+    }
+
+    r = select(fd + 1, &fds, NULL, NULL, &tv);
+    if (r == -1) {
+        cam_error("select");
+        return false;
+    }
+    return r > 0;
+}
+
+static bool _wait_frame(Cam_Camera *cam, struct timeval *timeout)
+{
+    // recorded frames are always there
+    if (cam->io == IO_METHOD_FILE) return true;
+#ifdef CAM_USE_IO_URING
+    // picks up a read that is still in flight
+    if (cam->uring && _cam_zero_timeout(timeout))
+        return _cam_uring_wait(cam, timeout);
+#endif
+    if (_cam_zero_timeout(timeout)) return true;
+
+    uint64_t start = _cam_stage_begin(cam, CAM_STAGE_WAIT);
+#ifdef CAM_USE_IO_URING
+    bool ready = cam->uring ? _cam_uring_wait(cam, timeout) :
+        _cam_wait_fd(cam->fd, timeout, cam->timeout_us);
+#else
+    bool ready = _cam_wait_fd(cam->fd, timeout, cam->timeout_us);
+#endif
+    _cam_stage_end(cam, CAM_STAGE_WAIT, start);
+
+    if (!ready) _cam_count(&cam->stats.timeouts, 1);
+    return ready;
+}
+
+// true while frames are dequeued by the capture thread instead of the user
+static bool _cam_threaded(Cam_Camera *cam)
+{
+    return cam->ring && cam->running;
+}
+
+#ifdef _CAM_THREADS
+static bool _cam_broadcast_release(Cam_Camera *cam, unsigned int index);
+#endif
+
+static bool _camera_acquire_frame(Cam_Camera *cam, Cam_Frame *frame,
+        struct timeval *timeout)
+{
+    if (!frame) return false;
+
+    if (!cam->running) {
+        cam_warn("Camera is not running");
+        return false;
+    }
+
+    if (cam->n_held == cam->n_buffers) {
+        cam_warn("All %u buffers are held, release a frame first",
+                cam->n_buffers);
+        return false;
+    }
+
+    if (!_wait_frame(cam, timeout)) return false;
+
+    uint64_t start = _cam_stage_begin(cam, CAM_STAGE_DEQUEUE);
+    bool ok = _dequeue_frame(cam, frame);
+
+    // drain the queue, read only has the one buffer so there is nothing to do
+    // and a recording would be skipped to the end
+    if (ok && __atomic_load_n(&cam->latest_only, __ATOMIC_RELAXED) &&
+            cam->io != IO_METHOD_READ && cam->io != IO_METHOD_FILE) {
+        Cam_Frame next;
+        while (cam->n_held < cam->n_buffers && _dequeue_frame(cam, &next)) {
+            if (!_enqueue_frame(cam, frame->index)) {
+                ok = false;
+                break;
+            }
+            *frame = next;
+        }
+    }
+
+    _cam_stage_end(cam, CAM_STAGE_DEQUEUE, start);
+    return ok;
+}
+
+bool camera_acquire_frame_ex(Cam_Camera *cam, Cam_Frame *frame,
+        struct timeval *timeout)
+{
+    cam = _CAM_HANDLE(cam);
+    if (_cam_threaded(cam)) {
+        cam_error("Frames are dequeued by the capture thread, use camera_get_frame");
+        return false;
+    }
+#ifdef _CAM_THREADS
+    if (_cam_broadcasting(cam)) {
+        cam_error("Frames are broadcast, use camera_subscriber_acquire");
+        return false;
+    }
+#endif
+
+    return _camera_acquire_frame(cam, frame, timeout);
+}
+
+void camera_set_latest_only(Cam_Camera *cam, bool enable)
+{
+    // atomic since the capture thread reads it
+    __atomic_store_n(&_CAM_HANDLE(cam)->latest_only, enable, __ATOMIC_RELAXED);
+}
+
+bool camera_release_frame(Cam_Frame *frame)
+{
+    if (!frame || !frame->camera) return false;
+
+    Cam_Camera *cam = frame->camera;
+
+#ifdef _CAM_THREADS
+    if (cam->broadcast) return _cam_broadcast_release(cam, frame->index);
+#endif
+
+    if (frame->index >= cam->n_buffers ||
+            !cam->held[frame->index]) {
+        cam_warn("Frame %u is not held", frame->index);
+        return false;
+    }
+
+    return _enqueue_frame(cam, frame->index);
+}
+
+// the buffer returned by the last camera_get_frame_raw was only lent out until
+// the next call
+static bool _release_pending(Cam_Camera *cam)
+{
+    if (cam->pending < 0) return true;
+
+    unsigned int index = cam->pending;
+    cam->pending = -1;
+    return _enqueue_frame(cam, index);
+}
+
+bool camera_get_frame_raw_ex(Cam_Camera *cam, Cam_Buffer *buf,
+        struct timeval *timeout)
+{
+    cam = _CAM_HANDLE(cam);
+    if (!buf) return false;
+
+    if (!_release_pending(cam)) return false;
+
+    Cam_Frame frame;
+    if (!camera_acquire_frame_ex(cam, &frame, timeout)) return false;
+
+    cam->pending = frame.index;
+    *buf = frame.buffer;
+    return true;
+}
+
+static const size_t _cam_output_bpp[] = { 3, 3, 4, 4, 1 };
+
+#ifndef CAM_NO_COVERT_TO_RGB
+#define CLAMP(x) ((x) > 255 ? 255 : ((x) < 0 ? 0 : (x)))
+
+// There is so little information about converting YUYV to rgb
+// (or maybe search engines are just cooked)
+// https://stackoverflow.com/a/72234444
+//
+// Fixed point BT.601 coefficients, every kernel below uses these so the
+// SIMD paths are bit-exact with the scalar one.
+#define Y_OFFSET   16
+#define UV_OFFSET 128
+#define YUV2RGB_11  298
+#define YUV2RGB_12   -1
+#define YUV2RGB_13  409
+#define YUV2RGB_22 -100
+#define YUV2RGB_23 -210
+#define YUV2RGB_32  519
+#define YUV2RGB_33    0
+
+// one pair of pixels sharing u and v, the channel swap and alpha are just
+// different offsets into the pixel
+static inline void _cam_put_pair(unsigned char *pixels, int y0, int y1,
+        int u, int v, _Cam_Output out)
+{
+    const int ri = (out == _CAM_OUT_BGR24 || out == _CAM_OUT_BGRA32) ? 2 : 0;
+    const int bi = 2 - ri;
+    const size_t bpp = _cam_output_bpp[out];
+    const bool alpha = bpp == 4;
+    int y, uv_r, uv_g, uv_b;
+
+    u -= UV_OFFSET;
+    v -= UV_OFFSET;
+    uv_r = YUV2RGB_12*u + YUV2RGB_13*v;
+    uv_g = YUV2RGB_22*u + YUV2RGB_23*v;
+    uv_b = YUV2RGB_32*u + YUV2RGB_33*v;
+
+    // 1st pixel
+    y = YUV2RGB_11 * (y0 - Y_OFFSET);
+    pixels[ri] = CLAMP((y + uv_r) >> 8); // r
+    pixels[1]  = CLAMP((y + uv_g) >> 8); // g
+    pixels[bi] = CLAMP((y + uv_b) >> 8); // b
+    if (alpha) pixels[3] = 255;
+    pixels += bpp;
+
+    // 2nd pixel
+    y = YUV2RGB_11 * (y1 - Y_OFFSET);
+    pixels[ri] = CLAMP((y + uv_r) >> 8); // r
+    pixels[1]  = CLAMP((y + uv_g) >> 8); // g
+    pixels[bi] = CLAMP((y + uv_b) >> 8); // b
+    if (alpha) pixels[3] = 255;
+}
+
+// count is the number of YUYV macropixels (2 pixels, 4 bytes) in src
+static void _yuyv_to_rgb_scalar(const unsigned char *yuyvdata,
+        unsigned char *pixels, size_t count, _Cam_Output out)
+{
+    const size_t step = 2 * _cam_output_bpp[out];
+
+    for (; count--; yuyvdata += 4, pixels += step)
+        _cam_put_pair(pixels, yuyvdata[0], yuyvdata[2], yuyvdata[1],
+                yuyvdata[3], out);
+}
+
+// same as YUYV with the bytes of every 16 bit pair swapped
+static void _uyvy_to_rgb_scalar(const unsigned char *uyvydata,
+        unsigned char *pixels, size_t count, _Cam_Output out)
+{
+    const size_t step = 2 * _cam_output_bpp[out];
+
+    for (; count--; uyvydata += 4, pixels += step)
+        _cam_put_pair(pixels, uyvydata[1], uyvydata[3], uyvydata[0],
+                uyvydata[2], out);
+}
+
+// a row of a 4:2:0 frame, count pixel pairs with the chroma of pair i at
+// u[i * step] and v[i * step] (step is 2 for NV12 and 1 for I420)
+static void _planar_to_rgb_scalar(const unsigned char *y,
+        const unsigned char *u, const unsigned char *v, size_t step,
+        unsigned char *pixels, size_t count, _Cam_Output out)
+{
+    const size_t pixel_step = 2 * _cam_output_bpp[out];
+
+    for (; count--; y += 2, u += step, v += step, pixels += pixel_step)
+        _cam_put_pair(pixels, y[0], y[1], *u, *v, out);
+}
+
+// count GREY pixels, the values are used as they are (full range)
+static void _grey_to_rgb_scalar(const unsigned char *src,
+        unsigned char *pixels, size_t count, _Cam_Output out)
+{
+    const size_t bpp = _cam_output_bpp[out];
+
+    for (; count--; src++, pixels += bpp) {
+        pixels[0] = pixels[1] = pixels[2] = *src;
+        if (bpp == 4) pixels[3] = 255;
+    }
+}
+
+// count little endian RGB565 pixels, the top bits are repeated into the
+// bottom ones so 0x1f turns into 0xff
+static void _rgb565_to_rgb_scalar(const unsigned char *src,
+        unsigned char *pixels, size_t count, _Cam_Output out)
+{
+    const int ri = (out == _CAM_OUT_BGR24 || out == _CAM_OUT_BGRA32) ? 2 : 0;
+    const int bi = 2 - ri;
+    const size_t bpp = _cam_output_bpp[out];
+
+    for (; count--; src += 2, pixels += bpp) {
+        unsigned int px = src[0] | (src[1] << 8);
+        unsigned int r = px >> 11, g = (px >> 5) & 0x3f, b = px & 0x1f;
+        pixels[ri] = (r << 3) | (r >> 2);
+        pixels[1]  = (g << 2) | (g >> 4);
+        pixels[bi] = (b << 3) | (b >> 2);
+        if (bpp == 4) pixels[3] = 255;
+    }
+}
+
+// luma only, count macropixels in and 2 * count bytes out
+static void _yuyv_to_luma_scalar(const unsigned char *src,
+        unsigned char *dst, size_t count, _Cam_Output out)
+{
+    (void)out;
+    for (; count--; src += 4, dst += 2) {
+        dst[0] = src[0];
+        dst[1] = src[2];
+    }
+}
+
+static void _uyvy_to_luma_scalar(const unsigned char *src,
+        unsigned char *dst, size_t count, _Cam_Output out)
+{
+    (void)out;
+    for (; count--; src += 4, dst += 2) {
+        dst[0] = src[1];
+        dst[1] = src[3];
+    }
+}
+
+// count bytes, GREY and the Y plane of NV12, I420 are passed through
+static void _cam_copy_row(const unsigned char *src, unsigned char *dst,
+        size_t count, _Cam_Output out)
+{
+    (void)out;
+    memcpy(dst, src, count);
+}
+
+// packs two 16 bit coefficients into the (u, v) lane pairs used by madd
+#define _CAM_COEF_PAIR(lo, hi) \
+    ((int)(((unsigned int)(hi) << 16) | ((unsigned int)(lo) & 0xffff)))
+
+#ifdef _CAM_SIMD_X86
+#define _CAM_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define _CAM_TARGET_AVX2  __attribute__((target("avx2")))
+
+// The math is done in 32 bit lanes (298*239 does not fit in 16 bits) so the
+// result matches _yuyv_to_rgb_scalar exactly. packs/packus do the CLAMP.
+static inline _CAM_TARGET_SSSE3 __m128i _cam_sse_channel(__m128i yl, __m128i yh,
+        __m128i uv)
+{
+    __m128i lo = _mm_add_epi32(yl, _mm_shuffle_epi32(uv, _MM_SHUFFLE(1, 1, 0, 0)));
+    __m128i hi = _mm_add_epi32(yh, _mm_shuffle_epi32(uv, _MM_SHUFFLE(3, 3, 2, 2)));
+    return _mm_packs_epi32(_mm_srai_epi32(lo, 8), _mm_srai_epi32(hi, 8));
+}
+
+// 16 bytes of YUYV (8 pixels) -> 8 16 bit values for each of r, g and b
+static inline _CAM_TARGET_SSSE3 void _cam_sse_yuyv8(__m128i px,
+        __m128i *r, __m128i *g, __m128i *b)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i y  = _mm_sub_epi16(_mm_and_si128(px, _mm_set1_epi16(0x00ff)),
+            _mm_set1_epi16(Y_OFFSET));
+    // U0 V0 U1 V1 ... one (u, v) pair per macropixel
+    __m128i uv = _mm_sub_epi16(_mm_srli_epi16(px, 8), _mm_set1_epi16(UV_OFFSET));
+
+    __m128i ky = _mm_set1_epi32(_CAM_COEF_PAIR(YUV2RGB_11, 0));
+    __m128i yl = _mm_madd_epi16(_mm_unpacklo_epi16(y, zero), ky);
+    __m128i yh = _mm_madd_epi16(_mm_unpackhi_epi16(y, zero), ky);
+
+    __m128i uv_r = _mm_madd_epi16(uv, _mm_set1_epi32(_CAM_COEF_PAIR(YUV2RGB_12, YUV2RGB_13)));
+    __m128i uv_g = _mm_madd_epi16(uv, _mm_set1_epi32(_CAM_COEF_PAIR(YUV2RGB_22, YUV2RGB_23)));
+    __m128i uv_b = _mm_madd_epi16(uv, _mm_set1_epi32(_CAM_COEF_PAIR(YUV2RGB_32, YUV2RGB_33)));
+
+    *r = _cam_sse_channel(yl, yh, uv_r);
+    *g = _cam_sse_channel(yl, yh, uv_g);
+    *b = _cam_sse_channel(yl, yh, uv_b);
+}
+
+// interleave 16 r, g and b bytes into 48 bytes of RGB24
+static inline _CAM_TARGET_SSSE3 void _cam_sse_store_rgb24(unsigned char *dst,
+        __m128i r, __m128i g, __m128i b)
+{
+    const __m128i r0 = _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5);
+    const __m128i r1 = _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1);
+    const __m128i r2 = _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1);
+    const __m128i g0 = _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1);
+    const __m128i g1 = _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10);
+    const __m128i g2 = _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1);
+    const __m128i b0 = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+    const __m128i b1 = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1);
+    const __m128i b2 = _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15);
+
+    _mm_storeu_si128((__m128i *)(dst +  0), _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(r, r0), _mm_shuffle_epi8(g, g0)), _mm_shuffle_epi8(b, b0)));
+    _mm_storeu_si128((__m128i *)(dst + 16), _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(r, r1), _mm_shuffle_epi8(g, g1)), _mm_shuffle_epi8(b, b1)));
+    _mm_storeu_si128((__m128i *)(dst + 32), _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(r, r2), _mm_shuffle_epi8(g, g2)), _mm_shuffle_epi8(b, b2)));
+}
+
+// interleave 16 r, g and b bytes with an opaque alpha into 64 bytes
+static inline _CAM_TARGET_SSSE3 void _cam_sse_store_rgba32(unsigned char *dst,
+        __m128i r, __m128i g, __m128i b)
+{
+    const __m128i a = _mm_set1_epi8(-1);
+    __m128i rg_lo = _mm_unpacklo_epi8(r, g), rg_hi = _mm_unpackhi_epi8(r, g);
+    __m128i ba_lo = _mm_unpacklo_epi8(b, a), ba_hi = _mm_unpackhi_epi8(b, a);
+
+    _mm_storeu_si128((__m128i *)(dst +  0), _mm_unpacklo_epi16(rg_lo, ba_lo));
+    _mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(rg_lo, ba_lo));
+    _mm_storeu_si128((__m128i *)(dst + 32), _mm_unpacklo_epi16(rg_hi, ba_hi));
+    _mm_storeu_si128((__m128i *)(dst + 48), _mm_unpackhi_epi16(rg_hi, ba_hi));
+}
+
+// store 16 pixels, the BGR layouts just swap the r and b registers
+static inline _CAM_TARGET_SSSE3 void _cam_sse_store(unsigned char *dst,
+        __m128i r, __m128i g, __m128i b, _Cam_Output out)
+{
+    switch (out) {
+        case _CAM_OUT_RGB24:  _cam_sse_store_rgb24(dst, r, g, b); break;
+        case _CAM_OUT_BGR24:  _cam_sse_store_rgb24(dst, b, g, r); break;
+        case _CAM_OUT_RGBA32: _cam_sse_store_rgba32(dst, r, g, b); break;
+        case _CAM_OUT_BGRA32: _cam_sse_store_rgba32(dst, b, g, r); break;
+        // luma only never gets here, the luma kernels are used instead
+        case _CAM_OUT_GREY: break;
+    }
+}
+
+// UYVY -> YUYV and VU -> UV
+static inline _CAM_TARGET_SSSE3 __m128i _cam_sse_swap16(__m128i px)
+{
+    return _mm_or_si128(_mm_srli_epi16(px, 8), _mm_slli_epi16(px, 8));
+}
+
+// 32 bytes of YUYV (16 pixels) -> 16 pixels of out
+static inline _CAM_TARGET_SSSE3 void _cam_sse_yuyv16(__m128i px0, __m128i px1,
+        unsigned char *dst, _Cam_Output out)
+{
+    __m128i r0, g0, b0, r1, g1, b1;
+    _cam_sse_yuyv8(px0, &r0, &g0, &b0);
+    _cam_sse_yuyv8(px1, &r1, &g1, &b1);
+    _cam_sse_store(dst, _mm_packus_epi16(r0, r1),
+            _mm_packus_epi16(g0, g1), _mm_packus_epi16(b0, b1), out);
+}
+
+// the chroma of 8 pixel pairs as U V U V ..., the order YUYV has them in
+static inline _CAM_TARGET_SSSE3 __m128i _cam_sse_chroma8(const unsigned char *u,
+        const unsigned char *v, size_t step)
+{
+    if (step == 1)
+        return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)u),
+                _mm_loadl_epi64((const __m128i *)v));
+    // NV12 already is U V U V, NV21 is V U V U
+    if (u < v) return _mm_loadu_si128((const __m128i *)u);
+    return _cam_sse_swap16(_mm_loadu_si128((const __m128i *)v));
+}
+
+static _CAM_TARGET_SSSE3 void _yuyv_to_rgb_ssse3(const unsigned char *src,
+        unsigned char *dst, size_t count, _Cam_Output out)
+{
+    const size_t step = 16 * _cam_output_bpp[out];
+
+    // 8 macropixels (16 pixels) per iteration
+    for (size_t n = count / 8; n--; src += 32, dst += step)
+        _cam_sse_yuyv16(_mm_loadu_si128((const __m128i *)src),
+                _mm_loadu_si128((const __m128i *)(src + 16)), dst, out);
+    _yuyv_to_rgb_scalar(src, dst, count % 8, out);
+}
+
+static _CAM_TARGET_SSSE3 void _uyvy_to_rgb_ssse3(const unsigned char *src,
+        unsigned char *dst, size_t count, _Cam_Output out)
+{
+    const size_t step = 16 * _cam_output_bpp[out];
+
+    for (size_t n = count / 8; n--; src += 32, dst += step)
+        _cam_sse_yuyv16(_cam_sse_swap16(_mm_loadu_si128((const __m128i *)src)),
+                _cam_sse_swap16(_mm_loadu_si128((const __m128i *)(src + 16))),
+                dst, out);
+    _uyvy_to_rgb_scalar(src, dst, count % 8, out);
+}
+
+// the planes are interleaved back into YUYV registers, after that it is the
+// same math
+static _CAM_TARGET_SSSE3 void _planar_to_rgb_ssse3(const unsigned char *y,
+        const unsigned char *u, const unsigned char *v, size_t step,
+        unsigned char *dst, size_t count, _Cam_Output out)
+{
+    const size_t pixel_step = 16 * _cam_output_bpp[out];
+
+    for (size_t n = count / 8; n--; y += 16, u += 8 * step, v += 8 * step,
+            dst += pixel_step) {
+        __m128i luma = _mm_loadu_si128((const __m128i *)y);
+        __m128i uv = _cam_sse_chroma8(u, v, step);
+        _cam_sse_yuyv16(_mm_unpacklo_epi8(luma, uv),
+                _mm_unpackhi_epi8(luma, uv), dst, out);
+    }
+    _planar_to_rgb_scalar(y, u, v, step, dst, count % 8, out);
+}
+
+static _CAM_TARGET_SSSE3 void _grey_to_rgb_ssse3(const unsigned char *src,
+        unsigned char *dst, size_t count, _Cam_Output out)
+{
+    const size_t step = 16 * _cam_output_bpp[out];
+
+    for (size_t n = count / 16; n--; src += 16, dst += step) {
+        __m128i px = _mm_loadu_si128((const __m128i *)src);
+        _cam_sse_store(dst, px, px, px, out);
+    }
+    _grey_to_rgb_scalar(src, dst, count % 16, out);
+}
+
+// 8 RGB565 pixels -> 8 16 bit values per channel
+static inline _CAM_TARGET_SSSE3 void _cam_sse_rgb565(__m128i px,
+        __m128i *r, __m128i *g, __m128i *b)
+{
+    __m128i r5 = _mm_srli_epi16(px, 11);
+    __m128i g6 = _mm_and_si128(_mm_srli_epi16(px, 5), _mm_set1_epi16(0x3f));
+    __m128i b5 = _mm_and_si128(px, _mm_set1_epi16(0x1f));
+    *r = _mm_or_si128(_mm_slli_epi16(r5, 3), _mm_srli_epi16(r5, 2));
+    *g = _mm_or_si128(_mm_slli_epi16(g6, 2), _mm_srli_epi16(g6, 4));
+    *b = _mm_or_si128(_mm_slli_epi16(b5, 3), _mm_srli_epi16(b5, 2));
+}
+
+static _CAM_TARGET_SSSE3 void _rgb565_to_rgb_ssse3(const unsigned char *src,
+        unsigned char *dst, size_t count, _Cam_Output out)
+{
+    const size_t step = 16 * _cam_output_bpp[out];
+
+    for (size_t n = count / 16; n--; src += 32, dst += step) {
+        __m128i r0, g0, b0, r1, g1, b1;
+        _cam_sse_rgb565(_mm_loadu_si128((const __m128i *)src), &r0, &g0, &b0);
+        _cam_sse_rgb565(_mm_loadu_si128((const __m128i *)(src + 16)), &r1, &g1, &b1);
+        _cam_sse_store(dst, _mm_packus_epi16(r0, r1),
+                _mm_packus_epi16(g0, g1), _mm_packus_epi16(b0, b1), out);
+    }
+    _rgb565_to_rgb_scalar(src, dst, count % 16, out);
+}
+
+// the even (YUYV) or odd (UYVY) bytes of 32 bytes
+static inline _CAM_TARGET_SSSE3 __m128i _cam_sse_luma16(const unsigned char *src,
+        bool uyvy)
+{
+    __m128i a = _mm_loadu_si128((const __m128i *)src);
+    __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+    if (uyvy) {
+        a = _mm_srli_epi16(a, 8);
+        b = _mm_srli_epi16(b, 8);
+    } else {
+        a = _mm_and_si128(a, _mm_set1_epi16(0x00ff));
+        b = _mm_and_si128(b, _mm_set1_epi16(0x00ff));
+    }
+    return _mm_packus_epi16(a, b);
+}
+
+static _CAM_TARGET_SSSE3 void _yuyv_to_luma_ssse3(const unsigned char *src,
+        unsigned char *dst, size_t count, _Cam_Output out)
+{
+    for (size_t n = count / 8; n--; src += 32, dst += 16)
+        _mm_storeu_si128((__m128i *)dst, _cam_sse_luma16(src, false));
+    _yuyv_to_luma_scalar(src, dst, count % 8, out);
+}
+
+static _CAM_TARGET_SSSE3 void _uyvy_to_luma_ssse3(const unsigned char *src,
+        unsigned char *dst, size_t count, _Cam_Output out)
+{
+    for (size_t n = count / 8; n--; src += 32, dst += 16)
+        _mm_storeu_si128((__m128i *)dst, _cam_sse_luma16(src, true));
+    _uyvy_to_luma_scalar(src, dst, count % 8, out);
+}
+
+static inline _CAM_TARGET_AVX2 __m256i _cam_avx2_channel(__m256i yl, __m256i yh,
+        __m256i uv)
+{
+    __m256i lo = _mm256_add_epi32(yl, _mm256_shuffle_epi32(uv, _MM_SHUFFLE(1, 1, 0, 0)));
+    __m256i hi = _mm256_add_epi32(yh, _mm256_shuffle_epi32(uv, _MM_SHUFFLE(3, 3, 2, 2)));
+    return _mm256_packs_epi32(_mm256_srai_epi32(lo, 8), _mm256_srai_epi32(hi, 8));
+}
+
+// Same as _cam_sse_yuyv8 but every op stays inside its 128 bit lane, so
+// 32 bytes (16 pixels) in gives 16 16 bit values per channel in pixel order.
+static inline _CAM_TARGET_AVX2 void _cam_avx2_yuyv16(__m256i px,
+        __m256i *r, __m256i *g, __m256i *b)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i y  = _mm256_sub_epi16(_mm256_and_si256(px, _mm256_set1_epi16(0x00ff)),
+            _mm256_set1_epi16(Y_OFFSET));
+    __m256i uv = _mm256_sub_epi16(_mm256_srli_epi16(px, 8),
+            _mm256_set1_epi16(UV_OFFSET));
+
+    __m256i ky = _mm256_set1_epi32(_CAM_COEF_PAIR(YUV2RGB_11, 0));
+    __m256i yl = _mm256_madd_epi16(_mm256_unpacklo_epi16(y, zero), ky);
+    __m256i yh = _mm256_madd_epi16(_mm256_unpackhi_epi16(y, zero), ky);
+
+    __m256i uv_r = _mm256_madd_epi16(uv, _mm256_set1_epi32(_CAM_COEF_PAIR(YUV2RGB_12, YUV2RGB_13)));
+    __m256i uv_g = _mm256_madd_epi16(uv, _mm256_set1_epi32(_CAM_COEF_PAIR(YUV2RGB_22, YUV2RGB_23)));
+    __m256i uv_b = _mm256_madd_epi16(uv, _mm256_set1_epi32(_CAM_COEF_PAIR(YUV2RGB_32, YUV2RGB_33)));
+
+    *r = _cam_avx2_channel(yl, yh, uv_r);
+    *g = _cam_avx2_channel(yl, yh, uv_g);
+    *b = _cam_avx2_channel(yl, yh, uv_b);
+}
+
+// packus works per lane, permute the 64 bit quarters back into pixel order
+static inline _CAM_TARGET_AVX2 __m256i _cam_avx2_pack(__m256i a, __m256i b)
+{
+    return _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b),
+            _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+static inline _CAM_TARGET_AVX2 __m256i _cam_avx2_swap16(__m256i px)
+{
+    return _mm256_or_si256(_mm256_srli_epi16(px, 8), _mm256_slli_epi16(px, 8));
+}
+
+// 64 bytes of YUYV (32 pixels) -> 32 pixels of out
+static inline _CAM_TARGET_AVX2 void _cam_avx2_yuyv32(__m256i px0, __m256i px1,
+        unsigned char *dst, _Cam_Output out)
+{
+    const size_t half = 16 * _cam_output_bpp[out];
+    __m256i r0, g0, b0, r1, g1, b1;
+
+    _cam_avx2_yuyv16(px0, &r0, &g0, &b0);
+    _cam_avx2_yuyv16(px1, &r1, &g1, &b1);
+    __m256i r = _cam_avx2_pack(r0, r1);
+    __m256i g = _cam_avx2_pack(g0, g1);
+    __m256i b = _cam_avx2_pack(b0, b1);
+    _cam_sse_store(dst, _mm256_castsi256_si128(r),
+            _mm256_castsi256_si128(g), _mm256_castsi256_si128(b), out);
+    _cam_sse_store(dst + half, _mm256_extracti128_si256(r, 1),
+            _mm256_extracti128_si256(g, 1), _mm256_extracti128_si256(b, 1),
+            out);
+}
+
+static _CAM_TARGET_AVX2 void _yuyv_to_rgb_avx2(const unsigned char *src,
+        unsigned char *dst, size_t count, _Cam_Output out)
+{
+    const size_t step = 32 * _cam_output_bpp[out];
+
+    // 16 macropixels (32 pixels) per iteration
+    for (size_t n = count / 16; n--; src += 64, dst += step)
+        _cam_avx2_yuyv32(_mm256_loadu_si256((const __m256i *)src),
+                _mm256_loadu_si256((const __m256i *)(src + 32)), dst, out);
+    _yuyv_to_rgb_ssse3(src, dst, count % 16, out);
+}
+
+static _CAM_TARGET_AVX2 void _uyvy_to_rgb_avx2(const unsigned char *src,
+        unsigned char *dst, size_t count, _Cam_Output out)
+{
+    const size_t step = 32 * _cam_output_bpp[out];
+
+    for (size_t n = count / 16; n--; src += 64, dst += step)
+        _cam_avx2_yuyv32(
+                _cam_avx2_swap16(_mm256_loadu_si256((const __m256i *)src)),
+                _cam_avx2_swap16(_mm256_loadu_si256((const __m256i *)(src + 32))),
+                dst, out);
+    _uyvy_to_rgb_ssse3(src, dst, count % 16, out);
+}
+
+static _CAM_TARGET_AVX2 void _planar_to_rgb_avx2(const unsigned char *y,
+        const unsigned char *u, const unsigned char *v, size_t step,
+        unsigned char *dst, size_t count, _Cam_Output out)
+{
+    const size_t pixel_step = 32 * _cam_output_bpp[out];
+
+    for (size_t n = count / 16; n--; y += 32, u += 16 * step, v += 16 * step,
+            dst += pixel_step) {
+        __m128i y0 = _mm_loadu_si128((const __m128i *)y);
+        __m128i y1 = _mm_loadu_si128((const __m128i *)(y + 16));
+        __m128i c0 = _cam_sse_chroma8(u, v, step);
+        __m128i c1 = _cam_sse_chroma8(u + 8 * step, v + 8 * step, step);
+        _cam_avx2_yuyv32(
+                _mm256_set_m128i(_mm_unpackhi_epi8(y0, c0), _mm_unpacklo_epi8(y0, c0)),
+                _mm256_set_m128i(_mm_unpackhi_epi8(y1, c1), _mm_unpacklo_epi8(y1, c1)),
+                dst, out);
+    }
+    _planar_to_rgb_ssse3(y, u, v, step, dst, count % 16, out);
+}
+#endif // _CAM_SIMD_X86
+
+#ifdef _CAM_SIMD_NEON
+// y is 8 even or odd pixels, cl/ch the chroma term of the 8 macropixels
+static inline uint8x8_t _cam_neon_channel(int16x8_t y, int32x4_t cl, int32x4_t ch)
+{
+    int32x4_t lo = vshrq_n_s32(vmlal_n_s16(cl, vget_low_s16(y), YUV2RGB_11), 8);
+    int32x4_t hi = vshrq_n_s32(vmlal_n_s16(ch, vget_high_s16(y), YUV2RGB_11), 8);
+    return vqmovun_s16(vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+}
+
+static inline uint8x16_t _cam_neon_zip(uint8x8_t even, uint8x8_t odd)
+{
+    uint8x8x2_t z = vzip_u8(even, odd);
+    return vcombine_u8(z.val[0], z.val[1]);
+}
+
+static inline void _cam_neon_store(unsigned char *dst, uint8x16_t r,
+        uint8x16_t g, uint8x16_t b, _Cam_Output out)
+{
+    const bool bgr = out == _CAM_OUT_BGR24 || out == _CAM_OUT_BGRA32;
+
+    if (_cam_output_bpp[out] == 4) {
+        uint8x16x4_t px = {{ bgr ? b : r, g, bgr ? r : b, vdupq_n_u8(255) }};
+        vst4q_u8(dst, px);
+    } else {
+        uint8x16x3_t px = {{ bgr ? b : r, g, bgr ? r : b }};
+        vst3q_u8(dst, px);
+    }
+}
+
+// 8 even and 8 odd luma samples with the chroma of the 8 pairs -> 16 pixels
+static inline void _cam_neon_yuv16(uint8x8_t y_even, uint8x8_t y_odd,
+        uint8x8_t u8, uint8x8_t v8, unsigned char *dst, _Cam_Output out)
+{
+    int16x8_t ye = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(y_even)),
+            vdupq_n_s16(Y_OFFSET));
+    int16x8_t yo = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(y_odd)),
+            vdupq_n_s16(Y_OFFSET));
+    int16x8_t u = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u8)),
+            vdupq_n_s16(UV_OFFSET));
+    int16x8_t v = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v8)),
+            vdupq_n_s16(UV_OFFSET));
+
+    int16x4_t ul = vget_low_s16(u), uh = vget_high_s16(u);
+    int16x4_t vl = vget_low_s16(v), vh = vget_high_s16(v);
+    int32x4_t rl = vmlal_n_s16(vmull_n_s16(ul, YUV2RGB_12), vl, YUV2RGB_13);
+    int32x4_t rh = vmlal_n_s16(vmull_n_s16(uh, YUV2RGB_12), vh, YUV2RGB_13);
+    int32x4_t gl = vmlal_n_s16(vmull_n_s16(ul, YUV2RGB_22), vl, YUV2RGB_23);
+    int32x4_t gh = vmlal_n_s16(vmull_n_s16(uh, YUV2RGB_22), vh, YUV2RGB_23);
+    int32x4_t bl = vmlal_n_s16(vmull_n_s16(ul, YUV2RGB_32), vl, YUV2RGB_33);
+    int32x4_t bh = vmlal_n_s16(vmull_n_s16(uh, YUV2RGB_32), vh, YUV2RGB_33);
+
+    _cam_neon_store(dst,
+            _cam_neon_zip(_cam_neon_channel(ye, rl, rh),
+                _cam_neon_channel(yo, rl, rh)),
+            _cam_neon_zip(_cam_neon_channel(ye, gl, gh),
+                _cam_neon_channel(yo, gl, gh)),
+            _cam_neon_zip(_cam_neon_channel(ye, bl, bh),
+                _cam_neon_channel(yo, bl, bh)),
+            out);
+}
+
+static void _yuyv_to_rgb_neon(const unsigned char *src, unsigned char *dst,
+        size_t count, _Cam_Output out)
+{
+    const size_t step = 16 * _cam_output_bpp[out];
+
+    // 8 macropixels (16 pixels) per iteration
+    for (size_t n = count / 8; n--; src += 32, dst += step) {
+        // val[0] = Y0, val[1] = U, val[2] = Y1, val[3] = V
+        uint8x8x4_t px = vld4_u8(src);
+        _cam_neon_yuv16(px.val[0], px.val[2], px.val[1], px.val[3], dst, out);
+    }
+    _yuyv_to_rgb_scalar(src, dst, count % 8, out);
+}
+
+static void _uyvy_to_rgb_neon(const unsigned char *src, unsigned char *dst,
+        size_t count, _Cam_Output out)
+{
+    const size_t step = 16 * _cam_output_bpp[out];
+
+    for (size_t n = count / 8; n--; src += 32, dst += step) {
+        // val[0] = U, val[1] = Y0, val[2] = V, val[3] = Y1
+        uint8x8x4_t px = vld4_u8(src);
+        _cam_neon_yuv16(px.val[1], px.val[3], px.val[0], px.val[2], dst, out);
+    }
+    _uyvy_to_rgb_scalar(src, dst, count % 8, out);
+}
+
+static void _planar_to_rgb_neon(const unsigned char *y,
+        const unsigned char *u, const unsigned char *v, size_t step,
+        unsigned char *dst, size_t count, _Cam_Output out)
+{
+    const size_t pixel_step = 16 * _cam_output_bpp[out];
+
+    for (size_t n = count / 8; n--; y += 16, u += 8 * step, v += 8 * step,
+            dst += pixel_step) {
+        uint8x8x2_t luma = vld2_u8(y);
+        uint8x8_t cu, cv;
+        if (step == 1) {
+            cu = vld1_u8(u);
+            cv = vld1_u8(v);
+        } else {
+            // NV12 is U V U V, NV21 is V U V U
+            uint8x8x2_t c = vld2_u8(u < v ? u : v);
+            cu = u < v ? c.val[0] : c.val[1];
+            cv = u < v ? c.val[1] : c.val[0];
+        }
+        _cam_neon_yuv16(luma.val[0], luma.val[1], cu, cv, dst, out);
+    }
+    _planar_to_rgb_scalar(y, u, v, step, dst, count % 8, out);
+}
+
+static void _grey_to_rgb_neon(const unsigned char *src, unsigned char *dst,
+        size_t count, _Cam_Output out)
+{
+    const size_t step = 16 * _cam_output_bpp[out];
+
+    for (size_t n = count / 16; n--; src += 16, dst += step) {
+        uint8x16_t px = vld1q_u8(src);
+        _cam_neon_store(dst, px, px, px, out);
+    }
+    _grey_to_rgb_scalar(src, dst, count % 16, out);
+}
+
+// 8 RGB565 pixels (loaded as bytes so src does not have to be aligned)
+static inline void _cam_neon_rgb565(const unsigned char *src,
+        uint8x8_t *r, uint8x8_t *g, uint8x8_t *b)
+{
+    uint16x8_t px = vreinterpretq_u16_u8(vld1q_u8(src));
+    uint16x8_t r5 = vshrq_n_u16(px, 11);
+    uint16x8_t g6 = vandq_u16(vshrq_n_u16(px, 5), vdupq_n_u16(0x3f));
+    uint16x8_t b5 = vandq_u16(px, vdupq_n_u16(0x1f));
+    *r = vmovn_u16(vorrq_u16(vshlq_n_u16(r5, 3), vshrq_n_u16(r5, 2)));
+    *g = vmovn_u16(vorrq_u16(vshlq_n_u16(g6, 2), vshrq_n_u16(g6, 4)));
+    *b = vmovn_u16(vorrq_u16(vshlq_n_u16(b5, 3), vshrq_n_u16(b5, 2)));
+}
+
+static void _rgb565_to_rgb_neon(const unsigned char *src, unsigned char *dst,
+        size_t count, _Cam_Output out)
+{
+    const size_t step = 16 * _cam_output_bpp[out];
+
+    for (size_t n = count / 16; n--; src += 32, dst += step) {
+        uint8x8_t r0, g0, b0, r1, g1, b1;
+        _cam_neon_rgb565(src, &r0, &g0, &b0);
+        _cam_neon_rgb565(src + 16, &r1, &g1, &b1);
+        _cam_neon_store(dst, vcombine_u8(r0, r1), vcombine_u8(g0, g1),
+                vcombine_u8(b0, b1), out);
+    }
+    _rgb565_to_rgb_scalar(src, dst, count % 16, out);
+}
+
+static void _yuyv_to_luma_neon(const unsigned char *src, unsigned char *dst,
+        size_t count, _Cam_Output out)
+{
+    for (size_t n = count / 8; n--; src += 32, dst += 16)
+        vst1q_u8(dst, vld2q_u8(src).val[0]);
+    _yuyv_to_luma_scalar(src, dst, count % 8, out);
+}
+
+static void _uyvy_to_luma_neon(const unsigned char *src, unsigned char *dst,
+        size_t count, _Cam_Output out)
+{
+    for (size_t n = count / 8; n--; src += 32, dst += 16)
+        vst1q_u8(dst, vld2q_u8(src).val[1]);
+    _uyvy_to_luma_scalar(src, dst, count % 8, out);
+}
+#endif // _CAM_SIMD_NEON
+
+static const _Cam_Kernels _cam_kernels_scalar = {
+    .name = "scalar",
+    .yuyv = _yuyv_to_rgb_scalar,
+    .uyvy = _uyvy_to_rgb_scalar,
+    .grey = _grey_to_rgb_scalar,
+    .rgb565 = _rgb565_to_rgb_scalar,
+    .planar = _planar_to_rgb_scalar,
+    .yuyv_luma = _yuyv_to_luma_scalar,
+    .uyvy_luma = _uyvy_to_luma_scalar,
+};
+
+#if defined(_CAM_SIMD_X86)
+static const _Cam_Kernels _cam_kernels_ssse3 = {
+    .name = "ssse3",
+    .yuyv = _yuyv_to_rgb_ssse3,
+    .uyvy = _uyvy_to_rgb_ssse3,
+    .grey = _grey_to_rgb_ssse3,
+    .rgb565 = _rgb565_to_rgb_ssse3,
+    .planar = _planar_to_rgb_ssse3,
+    .yuyv_luma = _yuyv_to_luma_ssse3,
+    .uyvy_luma = _uyvy_to_luma_ssse3,
+};
+
+// the formats that are only memory bound stay on SSSE3
+static const _Cam_Kernels _cam_kernels_avx2 = {
+    .name = "avx2",
+    .yuyv = _yuyv_to_rgb_avx2,
+    .uyvy = _uyvy_to_rgb_avx2,
+    .grey = _grey_to_rgb_ssse3,
+    .rgb565 = _rgb565_to_rgb_ssse3,
+    .planar = _planar_to_rgb_avx2,
+    .yuyv_luma = _yuyv_to_luma_ssse3,
+    .uyvy_luma = _uyvy_to_luma_ssse3,
+};
+#elif defined(_CAM_SIMD_NEON)
+static const _Cam_Kernels _cam_kernels_neon = {
+    .name = "neon",
+    .yuyv = _yuyv_to_rgb_neon,
+    .uyvy = _uyvy_to_rgb_neon,
+    .grey = _grey_to_rgb_neon,
+    .rgb565 = _rgb565_to_rgb_neon,
+    .planar = _planar_to_rgb_neon,
+    .yuyv_luma = _yuyv_to_luma_neon,
+    .uyvy_luma = _uyvy_to_luma_neon,
+};
+#endif
+
+// Picks the fastest kernels the cpu supports, this only has to run once
+// (camera_open calls it).
+static void _cam_select_kernels(Cam_Camera *cam)
+{
+    cam->kernels = &_cam_kernels_scalar;
+
+#if defined(_CAM_SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        cam->kernels = &_cam_kernels_avx2;
+    else if (__builtin_cpu_supports("ssse3"))
+        cam->kernels = &_cam_kernels_ssse3;
+#elif defined(_CAM_SIMD_NEON)
+#if defined(__arm__)
+    if (getauxval(AT_HWCAP) & HWCAP_NEON)
+#endif
+        cam->kernels = &_cam_kernels_neon;
+#endif
+}
+#endif // CAM_NO_COVERT_TO_RGB
+
+static _Cam_Output _cam_output_layout(Cam_PixelFormat pixelformat)
+{
+    switch (pixelformat) {
+        case CAM_PIX_FMT_BGR24:  return _CAM_OUT_BGR24;
+        case CAM_PIX_FMT_RGBA32: return _CAM_OUT_RGBA32;
+        case CAM_PIX_FMT_BGRA32: return _CAM_OUT_BGRA32;
+        case CAM_PIX_FMT_GREY:   return _CAM_OUT_GREY;
+        default:                 return _CAM_OUT_RGB24;
+    }
+}
+
+bool camera_set_output_format(Cam_Camera *cam, Cam_PixelFormat pixelformat,
+        size_t stride)
+{
+    cam = _CAM_HANDLE(cam);
+    if (_cam_threaded(cam)) {
+        cam_error("The output can not be changed while the capture thread runs");
+        return false;
+    }
+
+#ifdef CAM_NO_COVERT_TO_RGB
+    (void)pixelformat;
+    (void)stride;
+    cam_warn("Conversion is disabled with CAM_NO_COVERT_TO_RGB");
+    return false;
+#else
+    if (cam->fd < 0) {
+        cam_warn("Camera is not open");
+        return false;
+    }
+
+    switch (pixelformat) {
+        case CAM_PIX_FMT_RGB24:
+        case CAM_PIX_FMT_BGR24:
+        case CAM_PIX_FMT_RGBA32:
+        case CAM_PIX_FMT_BGRA32:
+        case CAM_PIX_FMT_GREY:
+            break;
+        default:
+            cam_error("Unsupported output format");
+            return false;
+    }
+
+    size_t min = cam->out_width * _cam_output_bpp[_cam_output_layout(pixelformat)];
+    if (stride && stride < min) {
+        cam_error("Output stride is too small (%zu < %zu)", stride, min);
+        return false;
+    }
+
+    cam->out_format = pixelformat;
+    cam->out_stride = stride;
+    cam->out_packed = stride == 0;
+    return _cam_update_output(cam);
+#endif
+}
+
+#ifndef CAM_NO_COVERT_TO_RGB
+static bool _cam_is_jpeg(Cam_PixelFormat pixelformat)
+{
+    return pixelformat == V4L2_PIX_FMT_MJPEG || pixelformat == V4L2_PIX_FMT_JPEG;
+}
+
+static bool _cam_is_yuyv(Cam_PixelFormat pixelformat)
+{
+    return pixelformat == V4L2_PIX_FMT_YUYV || pixelformat == V4L2_PIX_FMT_UYVY;
+}
+
+// (re)compute the size of converted frames and make sure rgb_buffer fits,
+// this has to be called whenever something it depends on changes
+static bool _cam_update_output(Cam_Camera *cam)
+{
+    cam->out_width = cam->fmt.width;
+    cam->out_height = cam->fmt.height;
+    if (cam->roi_soft) {
+        if (_cam_is_jpeg(cam->fmt.pixelformat)) {
+            cam_warn("MJPEG frames are decoded without the roi");
+        } else if (cam->roi.x + cam->roi.width > cam->fmt.width ||
+                cam->roi.y + cam->roi.height > cam->fmt.height) {
+            cam_warn("The roi does not fit the frame anymore, dropping it");
+            cam->roi_soft = false;
+        } else {
+            cam->out_width = cam->roi.width;
+            cam->out_height = cam->roi.height;
+        }
+    }
+    if (_cam_is_jpeg(cam->fmt.pixelformat) && cam->jpeg_scale > 1) {
+        // same rounding as TJSCALED
+        cam->out_width = (cam->out_width + cam->jpeg_scale - 1) / cam->jpeg_scale;
+        cam->out_height = (cam->out_height + cam->jpeg_scale - 1) / cam->jpeg_scale;
+    }
+    if (cam->scale_width) {
+        if (_cam_is_yuyv(cam->fmt.pixelformat)) {
+            cam->out_width = cam->scale_width;
+            cam->out_height = cam->scale_height;
+        } else {
+            cam_warn("Only YUYV and UYVY frames can be scaled");
+        }
+    }
+
+    size_t min = cam->out_width *
+        _cam_output_bpp[_cam_output_layout(cam->out_format)];
+    if (cam->out_packed || cam->out_stride < min)
+        cam->out_stride = min;
+
+    size_t size = cam->out_stride * cam->out_height;
+    if (size > cam->rgb_buffer_size) {
+        size_t mapped;
+        unsigned char *rgb_buffer = _cam_map_frames(size, cam->buffer_flags,
+                &mapped);
+        if (!rgb_buffer) {
+            cam_error("Could not allocate output buffer");
+            return false;
+        }
+        _cam_unmap_frames(cam->rgb_buffer, cam->rgb_buffer_size);
+        cam->rgb_buffer = rgb_buffer;
+        cam->rgb_buffer_size = mapped;
+    }
+
+    return true;
+}
+#endif
+
+bool camera_set_output_buffers(Cam_Camera *cam, unsigned int count,
+        unsigned int flags)
+{
+    cam = _CAM_HANDLE(cam);
+#ifdef CAM_NO_COVERT_TO_RGB
+    (void)count;
+    (void)flags;
+    cam_warn("Conversion is disabled with CAM_NO_COVERT_TO_RGB");
+    return false;
+#else
+    if (cam->fd < 0) {
+        cam_warn("Camera is not open");
+        return false;
+    }
+    if (_cam_threaded(cam)) {
+        cam_error("The buffers can not be changed while the capture thread runs");
+        return false;
+    }
+
+    struct _Cam_OutBuffers *b = cam->out_buffers;
+    if (b && b->n_free < b->count) {
+        cam_error("%u output buffers are still handed out",
+                b->count - b->n_free);
+        return false;
+    }
+    if (b) {
+        _cam_out_buffers_free(b);
+        cam->out_buffers = NULL;
+    }
+
+    // everything is mapped again with the new flags
+    if (flags != cam->buffer_flags) {
+        cam->buffer_flags = flags;
+        _cam_unmap_frames(cam->rgb_buffer, cam->rgb_buffer_size);
+        cam->rgb_buffer = NULL;
+        cam->rgb_buffer_size = 0;
+        if (!_cam_update_output(cam)) return false;
+#ifdef _CAM_THREADS
+        if (cam->ring) _cam_ring_unmap_slots(cam->ring);
+#endif
+    }
+    if (!count) return true;
+
+    b = calloc(1, sizeof(*b));
+    if (!b || !(b->free = calloc(count, sizeof(*b->free)))) {
+        cam_error("Could not allocate output buffers");
+        free(b);
+        return false;
+    }
+    b->count = count;
+#ifdef _CAM_THREADS
+    pthread_mutex_init(&b->lock, NULL);
+#endif
+    if (!_cam_out_buffers_map(b, cam->out_stride * cam->out_height, flags)) {
+        _cam_out_buffers_free(b);
+        return false;
+    }
+
+    cam->out_buffers = b;
+    return true;
+#endif
+}
+
+void *camera_acquire_output_buffer(Cam_Camera *cam, size_t *stride)
+{
+    cam = _CAM_HANDLE(cam);
+    struct _Cam_OutBuffers *b = cam->out_buffers;
+    if (!b) {
+        cam_warn("There are no output buffers, see camera_set_output_buffers");
+        return NULL;
+    }
+
+    size_t size = cam->out_stride * cam->out_height;
+    unsigned char *buffer = NULL;
+#ifdef _CAM_THREADS
+    pthread_mutex_lock(&b->lock);
+#endif
+    // the output grew, the buffers follow once they are all back
+    if (size > b->size && b->n_free < b->count) {
+        cam_warn("The output buffers are too small for the output, release them first");
+    } else if (size <= b->size ||
+            _cam_out_buffers_map(b, size, cam->buffer_flags)) {
+        if (b->n_free) buffer = b->free[--b->n_free];
+    }
+#ifdef _CAM_THREADS
+    pthread_mutex_unlock(&b->lock);
+#endif
+
+    if (buffer && stride) *stride = cam->out_stride;
+    return buffer;
+}
+
+bool camera_release_output_buffer(Cam_Camera *cam, void *buffer)
+{
+    cam = _CAM_HANDLE(cam);
+    struct _Cam_OutBuffers *b = cam->out_buffers;
+    if (!b || !buffer) return false;
+
+    unsigned char *p = buffer;
+    bool ok;
+#ifdef _CAM_THREADS
+    pthread_mutex_lock(&b->lock);
+#endif
+    ok = b->map && p >= b->map && p < b->map + b->count * b->size &&
+        (size_t)(p - b->map) % b->size == 0 && b->n_free < b->count;
+    if (ok) b->free[b->n_free++] = p;
+#ifdef _CAM_THREADS
+    pthread_mutex_unlock(&b->lock);
+#endif
+
+    if (!ok) cam_error("%p is not a handed out output buffer", buffer);
+    return ok;
+}
+
+bool camera_set_jpeg_scale(Cam_Camera *cam, unsigned int denom)
+{
+    cam = _CAM_HANDLE(cam);
+    if (_cam_threaded(cam)) {
+        cam_error("The output can not be changed while the capture thread runs");
+        return false;
+    }
+
+#if defined(CAM_USE_TURBOJPEG) && !defined(CAM_NO_COVERT_TO_RGB)
+    switch (denom) {
+        case 1: case 2: case 4: case 8:
+            break;
+        default:
+            cam_error("jpeg scale has to be 1, 2, 4 or 8");
+            return false;
+    }
+
+    cam->jpeg_scale = denom;
+    if (cam->fd < 0) return true;
+    return _cam_update_output(cam);
+#else
+    (void)cam, (void)denom;
+    cam_warn("jpeg decoding needs CAM_USE_TURBOJPEG");
+    return false;
+#endif
+}
+
+bool camera_set_output_size(Cam_Camera *cam, size_t width, size_t height,
+        Cam_ScaleFilter filter)
+{
+    cam = _CAM_HANDLE(cam);
+    if (_cam_threaded(cam)) {
+        cam_error("The output can not be changed while the capture thread runs");
+        return false;
+    }
+
+#ifndef CAM_NO_COVERT_TO_RGB
+    if (!width != !height) {
+        cam_error("Output size %zux%zu is invalid", width, height);
+        return false;
+    }
+    if (filter != CAM_SCALE_BOX && filter != CAM_SCALE_BILINEAR) {
+        cam_error("Unknown scale filter %d", (int)filter);
+        return false;
+    }
+
+    cam->scale_width = width;
+    cam->scale_height = height;
+    cam->scale_filter = filter;
+    if (cam->fd < 0) return true;
+    return _cam_update_output(cam);
+#else
+    (void)cam, (void)width, (void)height, (void)filter;
+    cam_warn("Conversion is disabled with CAM_NO_COVERT_TO_RGB");
+    return false;
+#endif
+}
+
+// the size of the frame data, some drivers leave bytesused at 0
+static inline size_t _cam_payload(const Cam_Buffer *buf)
+{
+    return buf->info.bytesused ? buf->info.bytesused : buf->length;
+}
+
+#ifndef CAM_NO_COVERT_TO_RGB
+// converts rows [y0, y1) of the job
+typedef void (*_Cam_RowFn)(const void *job, size_t y0, size_t y1);
+
+// runs fn over rows, split across the pool when there is one
+static void _cam_run_rows(Cam_Camera *cam, _Cam_RowFn fn, const void *job,
+        size_t rows);
+#endif
+
+#ifdef _CAM_POOL
+struct _Cam_Pool {
+    pthread_t *threads;
+    unsigned int n_threads;
+
+    pthread_mutex_t lock;
+    // workers wait on work for the generation to change, the caller waits
+    // on done until no worker is busy anymore
+    pthread_cond_t work;
+    pthread_cond_t done;
+    unsigned long generation;
+    unsigned int busy;
+    bool quit;
+
+    // the current job, bands are grabbed with an atomic counter so faster
+    // threads just take more of them
+    _Cam_RowFn fn;
+    const void *job;
+    size_t rows;
+    size_t band;
+    size_t next_band;
+};
+
+typedef struct {
+    struct _Cam_Pool *pool;
+    int cpu;
+} _Cam_Worker;
+
+static void _cam_pool_bands(struct _Cam_Pool *pool)
+{
+    for (;;) {
+        size_t band = __atomic_fetch_add(&pool->next_band, 1, __ATOMIC_RELAXED);
+        size_t y0 = band * pool->band;
+        if (y0 >= pool->rows) break;
+
+        size_t y1 = y0 + pool->band;
+        if (y1 > pool->rows) y1 = pool->rows;
+        pool->fn(pool->job, y0, y1);
+    }
+}
+
+static void *_cam_pool_worker(void *arg)
+{
+    _Cam_Worker worker = *(_Cam_Worker*)arg;
+    struct _Cam_Pool *pool = worker.pool;
+    free(arg);
+
+    if (worker.cpu >= 0) {
+        // raw syscall, cpu_set_t needs _GNU_SOURCE before every include
+        unsigned long mask[1024 / (8 * sizeof(unsigned long))] = {0};
+        size_t bits = 8 * sizeof(unsigned long);
+        if ((size_t)worker.cpu < sizeof(mask) * 8) {
+            mask[worker.cpu / bits] |= 1UL << (worker.cpu % bits);
+            if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) == -1)
+                cam_warn("Could not pin conversion thread to cpu %d: %s",
+                        worker.cpu, strerror(errno));
+        }
+    }
+
+    unsigned long seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->quit && pool->generation == seen)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if (pool->quit) break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        _cam_pool_bands(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void _cam_pool_destroy(struct _Cam_Pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned int i = 0; i < pool->n_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+static struct _Cam_Pool *_cam_pool_create(unsigned int n_threads,
+        const int *cpus, size_t n_cpus)
+{
+    struct _Cam_Pool *pool = calloc(1, sizeof(*pool));
+    if (!pool) return NULL;
+
+    pool->threads = calloc(n_threads, sizeof(*pool->threads));
+    if (!pool->threads) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (unsigned int i = 0; i < n_threads; i++) {
+        _Cam_Worker *worker = malloc(sizeof(*worker));
+        int err = ENOMEM;
+        if (worker) {
+            worker->pool = pool;
+            worker->cpu = cpus && n_cpus ? cpus[i % n_cpus] : -1;
+            err = pthread_create(&pool->threads[i], NULL, _cam_pool_worker,
+                    worker);
+            if (err) free(worker);
+        }
+        if (err) {
+            cam_error("Could not start conversion thread: %s", strerror(err));
+            _cam_pool_destroy(pool);
+            return NULL;
+        }
+        pool->n_threads++;
+    }
+
+    return pool;
+}
+
+static void _cam_run_rows(Cam_Camera *cam, _Cam_RowFn fn, const void *job,
+        size_t rows)
+{
+    struct _Cam_Pool *pool = cam->pool;
+    unsigned int threads = pool ? pool->n_threads + 1 : 1;
+
+    // not worth waking anyone up for a couple of rows
+    if (threads == 1 || rows < 4 * threads) {
+        fn(job, 0, rows);
+        return;
+    }
+
+    // a few bands per thread to even out the load, kept even so 4:2:0
+    // formats never split a chroma row
+    size_t band = (rows + 4 * threads - 1) / (4 * threads);
+    band = (band + 1) & ~(size_t)1;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->job = job;
+    pool->rows = rows;
+    pool->band = band;
+    pool->next_band = 0;
+    pool->busy = pool->n_threads;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    _cam_pool_bands(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+#elif !defined(CAM_NO_COVERT_TO_RGB)
+static void _cam_run_rows(Cam_Camera *cam, _Cam_RowFn fn, const void *job,
+        size_t rows)
+{
+    (void)cam;
+    fn(job, 0, rows);
+}
+#endif
+
+bool camera_set_conversion_threads(Cam_Camera *cam, unsigned int threads,
+        const int *cpus, size_t n_cpus)
+{
+    cam = _CAM_HANDLE(cam);
+    if (_cam_threaded(cam)) {
+        cam_error("The pool can not be changed while the capture thread runs");
+        return false;
+    }
+
+#ifdef _CAM_POOL
+    if (cam->pool) {
+        _cam_pool_destroy(cam->pool);
+        cam->pool = NULL;
+    }
+    if (threads <= 1) return true;
+
+    cam->pool = _cam_pool_create(threads - 1, cpus, n_cpus);
+    return cam->pool != NULL;
+#else
+    (void)cpus, (void)n_cpus;
+    if (threads <= 1) return true;
+    cam_warn("Parallel conversion is disabled");
+    return false;
+#endif
+}
+
+#ifndef CAM_NO_COVERT_TO_RGB
+// rows of a format where every row is count units of the same size
+typedef struct {
+    _Cam_PackedKernel kernel;
+    const unsigned char *src;
+    size_t stride;
+    // bytes a row of count units takes in src and in dst
+    size_t row_bytes;
+    size_t dst_row_bytes;
+    size_t count;
+    unsigned char *dst;
+    size_t dst_stride;
+    _Cam_Output out;
+} _Cam_PackedJob;
+
+static void _cam_packed_rows(const void *job, size_t y0, size_t y1)
+{
+    const _Cam_PackedJob *j = job;
+    const unsigned char *src = j->src + y0 * j->stride;
+    unsigned char *dst = j->dst + y0 * j->dst_stride;
+
+    if (j->stride == j->row_bytes && j->dst_stride == j->dst_row_bytes) {
+        j->kernel(src, dst, (y1 - y0) * j->count, j->out);
+    } else {
+        for (size_t y = y0; y < y1; y++) {
+            j->kernel(src, dst, j->count, j->out);
+            src += j->stride;
+            dst += j->dst_stride;
+        }
+    }
+}
+
+// the part of a frame that gets converted, all of it unless there is a
+// software roi
+typedef struct {
+    const unsigned char *ptr;
+    size_t stride;
+    size_t width;
+    size_t height;
+    // rows of it that were actually captured, never the padding at the end
+    // of the buffer
+    size_t rows;
+} _Cam_View;
+
+// the view of a packed format (or the Y plane) with pixel_bytes per pixel
+static _Cam_View _cam_view(const Cam_Camera *cam, const Cam_Buffer *buf,
+        size_t pixel_bytes)
+{
+    _Cam_View view = {
+        .ptr = buf->ptr,
+        .stride = cam->fmt.stride,
+        .width = cam->fmt.width,
+        .height = cam->fmt.height,
+    };
+    size_t top = 0;
+    if (cam->roi_soft) {
+        top = cam->roi.y;
+        view.ptr += top * view.stride + cam->roi.x * pixel_bytes;
+        view.width = cam->roi.width;
+        view.height = cam->roi.height;
+    }
+
+    size_t rows = _cam_payload(buf) / view.stride;
+    view.rows = rows > top ? rows - top : 0;
+    if (view.rows > view.height) view.rows = view.height;
+    return view;
+}
+
+// convert with a kernel that takes count units of unit_bytes per row
+static void _cam_packed_to_rgb(Cam_Camera *cam, const _Cam_View *view,
+        _Cam_PackedKernel kernel, size_t count, size_t unit_bytes,
+        size_t unit_pixels, unsigned char *dst, size_t dst_stride)
+{
+    _Cam_Output out = _cam_output_layout(cam->out_format);
+    _Cam_PackedJob job = {
+        .kernel = kernel,
+        .src = view->ptr,
+        .stride = view->stride,
+        .row_bytes = count * unit_bytes,
+        .dst_row_bytes = count * unit_pixels * _cam_output_bpp[out],
+        .count = count,
+        .dst = dst,
+        .dst_stride = dst_stride,
+        .out = out,
+    };
+
+    _cam_run_rows(cam, _cam_packed_rows, &job, view->rows);
+}
+
+// output macropixels sampled per chunk, small enough to stay on the stack
+#define _CAM_SCALE_CHUNK 256
+
+typedef struct {
+    // a YUYV kernel, the sampled rows are always YUYV
+    _Cam_PackedKernel kernel;
+    const unsigned char *src;
+    size_t stride;
+    size_t src_width;
+    size_t src_height;
+    // offsets of Y and U in a source macropixel, V is at u_off + 2
+    size_t y_off;
+    size_t u_off;
+    unsigned char *dst;
+    size_t dst_stride;
+    size_t width;
+    size_t height;
+    Cam_ScaleFilter filter;
+    // 2 or 4 for a box filter that is an exact decimation, 0 otherwise
+    size_t decimate;
+    _Cam_Output out;
+} _Cam_ScaleJob;
+
+// k x k blocks, both the luma and the chroma average k * k samples
+static inline void _cam_decimate_row(const _Cam_ScaleJob *j, size_t y,
+        size_t m0, size_t n, unsigned char *tmp, const size_t k)
+{
+    const unsigned int shift = k == 2 ? 2 : 4;
+    const unsigned int round = 1u << (shift - 1);
+    const unsigned char *row = j->src + y * k * j->stride;
+
+    for (size_t m = m0; m < m0 + n; m++, tmp += 4) {
+        // output pixels 2m and 2m + 1 cover source macropixels [mk, mk + k)
+        const unsigned char *px = row + m * k * 4;
+        unsigned int y0 = 0, y1 = 0, u = 0, v = 0;
+        for (size_t r = 0; r < k; r++, px += j->stride) {
+            for (size_t i = 0; i < k; i++) {
+                y0 += px[i * 2 + j->y_off];
+                y1 += px[(k + i) * 2 + j->y_off];
+                u += px[i * 4 + j->u_off];
+                v += px[i * 4 + j->u_off + 2];
+            }
+        }
+        tmp[0] = (y0 + round) >> shift;
+        tmp[1] = (u + round) >> shift;
+        tmp[2] = (y1 + round) >> shift;
+        tmp[3] = (v + round) >> shift;
+    }
+}
+
+// source pixels [*x0, *x1) that output pixel x covers, at least one
+static inline void _cam_box_span(size_t x, size_t src, size_t dst,
+        size_t *x0, size_t *x1)
+{
+    *x0 = x * src / dst;
+    *x1 = (x + 1) * src / dst;
+    if (*x1 <= *x0) *x1 = *x0 + 1;
+}
+
+static void _cam_box_row(const _Cam_ScaleJob *j, size_t y, size_t m0,
+        size_t n, unsigned char *tmp)
+{
+    size_t r0, r1;
+    _cam_box_span(y, j->src_height, j->height, &r0, &r1);
+
+    for (size_t m = m0; m < m0 + n; m++, tmp += 4) {
+        size_t x[4];
+        _cam_box_span(2 * m, j->src_width, j->width, &x[0], &x[1]);
+        // an odd width repeats the last pixel
+        _cam_box_span(2 * m + 1 < j->width ? 2 * m + 1 : 2 * m, j->src_width,
+                j->width, &x[2], &x[3]);
+
+        unsigned int sum[2] = { 0, 0 }, u = 0, v = 0;
+        // the chroma is averaged over every macropixel the pair touches
+        size_t c0 = x[0] / 2, c1 = (x[3] - 1) / 2 + 1;
+        const unsigned char *row = j->src + r0 * j->stride;
+        for (size_t r = r0; r < r1; r++, row += j->stride) {
+            for (size_t p = 0; p < 2; p++)
+                for (size_t i = x[2 * p]; i < x[2 * p + 1]; i++)
+                    sum[p] += row[i * 2 + j->y_off];
+            for (size_t c = c0; c < c1; c++) {
+                u += row[c * 4 + j->u_off];
+                v += row[c * 4 + j->u_off + 2];
+            }
+        }
+
+        size_t rows = r1 - r0;
+        size_t n0 = rows * (x[1] - x[0]), n1 = rows * (x[3] - x[2]);
+        size_t nc = rows * (c1 - c0);
+        tmp[0] = (sum[0] + n0 / 2) / n0;
+        tmp[1] = (u + nc / 2) / nc;
+        tmp[2] = (sum[1] + n1 / 2) / n1;
+        tmp[3] = (v + nc / 2) / nc;
+    }
+}
+
+// position of output sample x in source samples as 24.8 fixed point, the
+// integer part is clamped so the next sample is still valid
+static inline void _cam_bilinear_pos(size_t x, size_t src, size_t dst,
+        size_t *i, unsigned int *w)
+{
+    // centers line up, (x + 0.5) * src / dst - 0.5
+    long pos = (long)(((2 * x + 1) * src * 256) / (2 * dst)) - 128;
+    if (pos < 0) pos = 0;
+    *i = (size_t)pos >> 8;
+    *w = (unsigned int)pos & 0xff;
+    if (*i >= src - 1) {
+        *i = src > 1 ? src - 2 : 0;
+        *w = src > 1 ? 256 : 0;
+    }
+}
+
+static inline unsigned char _cam_lerp(unsigned int a, unsigned int b,
+        unsigned int c, unsigned int d, unsigned int wx, unsigned int wy)
+{
+    unsigned int top = a * (256 - wx) + b * wx;
+    unsigned int bottom = c * (256 - wx) + d * wx;
+    return (top * (256 - wy) + bottom * wy + (1u << 15)) >> 16;
+}
+
+static void _cam_bilinear_row(const _Cam_ScaleJob *j, size_t y, size_t m0,
+        size_t n, unsigned char *tmp)
+{
+    // the chroma is sampled on its own grid of macropixels
+    size_t src_pairs = j->src_width / 2, dst_pairs = (j->width + 1) / 2;
+    size_t r;
+    unsigned int wy;
+    _cam_bilinear_pos(y, j->src_height, j->height, &r, &wy);
+
+    const unsigned char *a = j->src + r * j->stride;
+    const unsigned char *b = r + 1 < j->src_height ? a + j->stride : a;
+
+    for (size_t m = m0; m < m0 + n; m++, tmp += 4) {
+        for (size_t p = 0; p < 2; p++) {
+            size_t x = 2 * m + p < j->width ? 2 * m + p : 2 * m, i;
+            unsigned int wx;
+            _cam_bilinear_pos(x, j->src_width, j->width, &i, &wx);
+            size_t o0 = i * 2 + j->y_off, o1 = o0 + (i + 1 < j->src_width) * 2;
+            tmp[2 * p] = _cam_lerp(a[o0], a[o1], b[o0], b[o1], wx, wy);
+        }
+
+        size_t c;
+        unsigned int wx;
+        _cam_bilinear_pos(m, src_pairs, dst_pairs, &c, &wx);
+        size_t o0 = c * 4 + j->u_off, o1 = o0 + (c + 1 < src_pairs) * 4;
+        tmp[1] = _cam_lerp(a[o0], a[o1], b[o0], b[o1], wx, wy);
+        tmp[3] = _cam_lerp(a[o0 + 2], a[o1 + 2], b[o0 + 2], b[o1 + 2], wx, wy);
+    }
+}
+
+// samples an output row into YUYV a chunk at a time and converts that,
+// the chunk is still in L1 when the kernel reads it
+static void _cam_scale_rows(const void *job, size_t y0, size_t y1)
+{
+    const _Cam_ScaleJob *j = job;
+    const size_t bpp = _cam_output_bpp[j->out];
+    const size_t pairs = (j->width + 1) / 2;
+    unsigned char tmp[4 * _CAM_SCALE_CHUNK];
+
+    for (size_t y = y0; y < y1; y++) {
+        unsigned char *dst = j->dst + y * j->dst_stride;
+        for (size_t m = 0; m < pairs; m += _CAM_SCALE_CHUNK) {
+            size_t n = pairs - m < _CAM_SCALE_CHUNK ? pairs - m : _CAM_SCALE_CHUNK;
+            if (j->decimate == 2)
+                _cam_decimate_row(j, y, m, n, tmp, 2);
+            else if (j->decimate == 4)
+                _cam_decimate_row(j, y, m, n, tmp, 4);
+            else if (j->filter == CAM_SCALE_BILINEAR)
+                _cam_bilinear_row(j, y, m, n, tmp);
+            else
+                _cam_box_row(j, y, m, n, tmp);
+
+            // an odd width only takes the first pixel of the last pair
+            bool odd = m + n == pairs && (j->width & 1);
+            j->kernel(tmp, dst + m * 2 * bpp, n - odd, j->out);
+            if (odd) {
+                unsigned char last[8];
+                j->kernel(tmp + (n - 1) * 4, last, 1, j->out);
+                memcpy(dst + (j->width - 1) * bpp, last, bpp);
+            }
+        }
+    }
+}
+
+static void _cam_scale_to_rgb(Cam_Camera *cam, const _Cam_View *view,
+        _Cam_PackedKernel kernel, unsigned char *dst, size_t dst_stride)
+{
+    bool uyvy = cam->fmt.pixelformat == V4L2_PIX_FMT_UYVY;
+    _Cam_ScaleJob job = {
+        .kernel = kernel,
+        .src = view->ptr,
+        .stride = view->stride,
+        .src_width = view->width,
+        .src_height = view->height,
+        .y_off = uyvy,
+        .u_off = !uyvy,
+        .dst = dst,
+        .dst_stride = dst_stride,
+        .width = cam->out_width,
+        .height = cam->out_height,
+        .filter = cam->scale_filter,
+        .out = _cam_output_layout(cam->out_format),
+    };
+
+    if (job.filter == CAM_SCALE_BOX && job.width % 2 == 0) {
+        for (size_t k = 2; k <= 4; k *= 2) {
+            if (job.width * k == job.src_width && job.height * k == job.src_height)
+                job.decimate = k;
+        }
+    }
+
+    // only the output rows whose source rows were captured
+    size_t rows = view->rows;
+    if (rows >= job.src_height)
+        rows = job.height;
+    else
+        rows = rows * job.height / job.src_height;
+
+    _cam_run_rows(cam, _cam_scale_rows, &job, rows);
+}
+
+static void yuyv_to_rgb(Cam_Camera *cam, const Cam_Buffer *buf,
+        unsigned char *dst, size_t dst_stride)
+{
+    // 2 YUYV 16bit "pixels" per macropixel
+    bool luma = cam->out_format == CAM_PIX_FMT_GREY;
+    bool uyvy = cam->fmt.pixelformat == V4L2_PIX_FMT_UYVY;
+    _Cam_PackedKernel kernel = luma
+        ? (uyvy ? cam->kernels->uyvy_luma : cam->kernels->yuyv_luma)
+        : (uyvy ? cam->kernels->uyvy : cam->kernels->yuyv);
+
+    _Cam_View view = _cam_view(cam, buf, 2);
+
+    // scaled rows are sampled into YUYV whatever the source order is
+    if (cam->scale_width) {
+        _cam_scale_to_rgb(cam, &view,
+                luma ? cam->kernels->yuyv_luma : cam->kernels->yuyv,
+                dst, dst_stride);
+        return;
+    }
+
+    _cam_packed_to_rgb(cam, &view, kernel, view.width / 2, 4, 2, dst,
+            dst_stride);
+}
+
+typedef struct {
+    _Cam_PlanarKernel kernel;
+    const unsigned char *y;
+    const unsigned char *u;
+    const unsigned char *v;
+    size_t stride;
+    size_t chroma_stride;
+    // distance between the chroma samples of 2 pixel pairs
+    size_t step;
+    unsigned char *dst;
+    size_t dst_stride;
+    size_t width;
+    _Cam_Output out;
+} _Cam_PlanarJob;
+
+static void _cam_planar_rows(const void *job, size_t y0, size_t y1)
+{
+    const _Cam_PlanarJob *j = job;
+
+    // every chroma row is shared by 2 luma rows
+    for (size_t y = y0; y < y1; y++) {
+        size_t chroma = y / 2 * j->chroma_stride;
+        j->kernel(j->y + y * j->stride, j->u + chroma, j->v + chroma, j->step,
+                j->dst + y * j->dst_stride, j->width / 2, j->out);
+    }
+}
+
+// false if the planes do not fit into the payload of buf
+static bool _cam_planes(const Cam_Camera *cam, const Cam_Buffer *buf,
+        _Cam_PlanarJob *job)
+{
+    size_t luma = cam->fmt.stride * cam->fmt.height;
+    size_t chroma_rows = (cam->fmt.height + 1) / 2;
+    const unsigned char *plane = (const unsigned char *)buf->ptr + luma;
+    size_t size;
+
+    job->y = buf->ptr;
+    job->stride = cam->fmt.stride;
+    switch (cam->fmt.pixelformat) {
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_NV21: {
+            // a single plane of interleaved U V (V U for NV21)
+            bool nv21 = cam->fmt.pixelformat == V4L2_PIX_FMT_NV21;
+            job->chroma_stride = cam->fmt.stride;
+            job->step = 2;
+            job->u = plane + nv21;
+            job->v = plane + !nv21;
+            size = luma + job->chroma_stride * chroma_rows;
+            break;
+        }
+        default: {
+            // U then V for YU12, the other way around for YV12
+            bool yv12 = cam->fmt.pixelformat == V4L2_PIX_FMT_YVU420;
+            job->chroma_stride = cam->fmt.stride / 2;
+            job->step = 1;
+            job->u = plane + yv12 * job->chroma_stride * chroma_rows;
+            job->v = plane + !yv12 * job->chroma_stride * chroma_rows;
+            size = luma + 2 * job->chroma_stride * chroma_rows;
+            break;
+        }
+    }
+
+    if (cam->roi_soft) {
+        size_t chroma = cam->roi.y / 2 * job->chroma_stride +
+            cam->roi.x / 2 * job->step;
+        job->y += cam->roi.y * job->stride + cam->roi.x;
+        job->u += chroma;
+        job->v += chroma;
+    }
+
+    return _cam_payload(buf) >= size;
+}
+
+static bool planar_to_rgb(Cam_Camera *cam, const Cam_Buffer *buf,
+        unsigned char *dst, size_t dst_stride)
+{
+    _Cam_PlanarJob job = {
+        .kernel = cam->kernels->planar,
+        .dst = dst,
+        .dst_stride = dst_stride,
+        .out = _cam_output_layout(cam->out_format),
+    };
+    _Cam_View view = _cam_view(cam, buf, 1);
+    job.width = view.width;
+
+    if (!_cam_planes(cam, buf, &job)) {
+        cam_warn("Frame is too short (%zu bytes)", _cam_payload(buf));
+        return false;
+    }
+
+    // luma only just copies the Y plane
+    if (job.out == _CAM_OUT_GREY) {
+        _cam_packed_to_rgb(cam, &view, _cam_copy_row, view.width, 1, 1, dst,
+                dst_stride);
+        return true;
+    }
+
+    _cam_run_rows(cam, _cam_planar_rows, &job, view.height);
+    return true;
+}
+#endif // CAM_NO_COVERT_TO_RGB
+
+#ifdef CAM_USE_TURBOJPEG
+static bool mjpeg_to_rgb(Cam_Camera *cam, const Cam_Buffer *buf,
+        unsigned char *dst, size_t dst_stride)
+{
+    int pixelformat;
+    switch (_cam_output_layout(cam->out_format)) {
+        case _CAM_OUT_RGB24:  pixelformat = TJPF_RGB;  break;
+        case _CAM_OUT_BGR24:  pixelformat = TJPF_BGR;  break;
+        // X is always 0xff when decompressing
+        case _CAM_OUT_RGBA32: pixelformat = TJPF_RGBX; break;
+        case _CAM_OUT_BGRA32: pixelformat = TJPF_BGRX; break;
+        case _CAM_OUT_GREY:   pixelformat = TJPF_GRAY; break;
+        default: return false;
+    }
+
+    // asking for the scaled size makes turbojpeg do the scaling in the IDCT
+    if (tjDecompress2(cam->jpeg, buf->ptr, _cam_payload(buf), dst,
+                cam->out_width, dst_stride, cam->out_height, pixelformat,
+                CAM_TURBOJPEG_FLAGS) == -1) {
+        // webcams regularly send slightly corrupt frames, those still decode
+        if (tjGetErrorCode(cam->jpeg) == TJERR_WARNING) return true;
+
+        cam_warn("Could not decode frame: %s", tjGetErrorStr2(cam->jpeg));
+        return false;
+    }
+
+    return true;
+}
+#endif
+
+// convert buf into dst using the output format, returns 1 on success, 0 if
+// the format of the camera can not be converted and -1 on errors
+static int _cam_convert(Cam_Camera *cam, Cam_Surface *surf,
+        const Cam_Buffer *buf, unsigned char *dst, size_t dst_stride)
+{
+#ifndef CAM_NO_COVERT_TO_RGB
+    // an imported dmabuf that could not be mapped
+    if (!buf->ptr || !dst) return 0;
+
+    switch (cam->fmt.pixelformat) {
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_UYVY:
+            yuyv_to_rgb(cam, buf, dst, dst_stride);
+            break;
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_NV21:
+        case V4L2_PIX_FMT_YUV420:
+        case V4L2_PIX_FMT_YVU420:
+            if (!planar_to_rgb(cam, buf, dst, dst_stride)) return -1;
+            break;
+        case V4L2_PIX_FMT_GREY: {
+            _Cam_View view = _cam_view(cam, buf, 1);
+            _cam_packed_to_rgb(cam, &view, cam->out_format == CAM_PIX_FMT_GREY
+                    ? _cam_copy_row : cam->kernels->grey,
+                    view.width, 1, 1, dst, dst_stride);
+            break;
+        }
+        case V4L2_PIX_FMT_RGB565: {
+            // there is no luma to pass through
+            if (cam->out_format == CAM_PIX_FMT_GREY) return 0;
+            _Cam_View view = _cam_view(cam, buf, 2);
+            _cam_packed_to_rgb(cam, &view, cam->kernels->rgb565, view.width,
+                    2, 1, dst, dst_stride);
+            break;
+        }
+#ifdef CAM_USE_TURBOJPEG
+        case V4L2_PIX_FMT_MJPEG:
+        case V4L2_PIX_FMT_JPEG:
+            if (!mjpeg_to_rgb(cam, buf, dst, dst_stride)) return -1;
+            break;
+#endif
+        default:
+            return 0;
+            // Not supported
+    }
+
+    surf->data = dst;
+    surf->width = cam->out_width;
+    surf->height = cam->out_height;
+    surf->pixelformat = cam->out_format;
+    surf->stride = dst_stride;
+    return 1;
+#else
+    (void)cam, (void)surf, (void)buf, (void)dst, (void)dst_stride;
+    return 0;
+#endif
+}
+
+static bool _camera_get_frame(Cam_Camera *cam, Cam_Surface *surf,
+        unsigned char *dst, size_t dst_stride, struct timeval *timeout)
+{
+    if (!surf) return false;
+
+    if (!_release_pending(cam)) return false;
+
+    Cam_Frame frame;
+    if (!camera_acquire_frame_ex(cam, &frame, timeout)) return false;
+
+    surf->data = frame.buffer.ptr;
+    surf->width = cam->fmt.width;
+    surf->height = cam->fmt.height;
+    surf->pixelformat = cam->fmt.pixelformat;
+    surf->stride = cam->fmt.stride;
+    surf->info = frame.buffer.info;
+
+    // once converted the capture buffer can go straight back to the driver,
+    // otherwise the raw data is lent out until the next call
+    uint64_t start = _cam_stage_begin(cam, CAM_STAGE_CONVERT);
+    int converted = _cam_convert(cam, surf, &frame.buffer, dst, dst_stride);
+    _cam_stage_end(cam, CAM_STAGE_CONVERT, start);
+    if (converted != 0) {
+        bool released = camera_release_frame(&frame);
+        return converted > 0 && released;
+    }
+
+    cam->pending = frame.index;
+    return true;
+}
+
+#ifdef _CAM_THREADS
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    Cam_Surface surf;
+} _Cam_Slot;
+
+// single producer (the capture thread) single consumer ring. head and tail
+// only ever increase, the slot at tail is the one last returned to the
+// consumer and stays untouched until the consumer comes back for the next.
+struct _Cam_Ring {
+    _Cam_Slot *slots;
+    unsigned int n_slots;
+    bool convert;
+
+    unsigned long head;
+    unsigned long tail;
+    // only touched by the consumer
+    bool holding;
+    // frames go here instead of into the slots, see camera_set_frame_callback
+    Cam_FrameCallback on_frame;
+    void *on_frame_user;
+
+    pthread_t thread;
+    bool thread_running;
+    // readable while there are frames, and stop_fd to wake up the thread
+    int ready_fd;
+    int stop_fd;
+};
+
+// the slots are mapped again by the next _cam_ring_start
+static void _cam_ring_unmap_slots(struct _Cam_Ring *ring)
+{
+    for (unsigned int i = 0; ring->slots && i < ring->n_slots; i++) {
+        _cam_unmap_frames(ring->slots[i].data, ring->slots[i].size);
+        ring->slots[i].data = NULL;
+        ring->slots[i].size = 0;
+    }
+}
+
+static void _cam_ring_free(struct _Cam_Ring *ring)
+{
+    _cam_ring_unmap_slots(ring);
+    free(ring->slots);
+    if (ring->ready_fd >= 0) close(ring->ready_fd);
+    if (ring->stop_fd >= 0) close(ring->stop_fd);
+    free(ring);
+}
+
+static void _cam_ring_produce(Cam_Camera *cam, struct _Cam_Ring *ring)
+{
+    struct timeval zero = {0};
+    Cam_Frame frame;
+    if (!_camera_acquire_frame(cam, &frame, &zero)) return;
+
+    if (ring->on_frame) {
+        ring->on_frame(&frame, ring->on_frame_user);
+        camera_release_frame(&frame);
+        return;
+    }
+
+    unsigned long head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->n_slots) {
+        _cam_count(&cam->stats.ring_dropped, 1);
+        camera_release_frame(&frame);
+        return;
+    }
+
+    _Cam_Slot *slot = &ring->slots[head % ring->n_slots];
+    Cam_Surface surf = {
+        .data = slot->data,
+        .width = cam->fmt.width,
+        .height = cam->fmt.height,
+        .pixelformat = cam->fmt.pixelformat,
+        .stride = cam->fmt.stride,
+        .info = frame.buffer.info,
+    };
+
+    uint64_t start = _cam_stage_begin(cam, CAM_STAGE_CONVERT);
+    int converted = 0;
+    if (ring->convert)
+        converted = _cam_convert(cam, &surf, &frame.buffer, slot->data,
+                cam->out_stride);
+
+    // the buffer goes back to the driver right away so a copy is published
+    if (converted == 0) {
+        size_t size = _cam_payload(&frame.buffer);
+        if (size > slot->size) size = slot->size;
+        if (frame.buffer.ptr) memcpy(slot->data, frame.buffer.ptr, size);
+        else surf.data = NULL;
+        surf.info.bytesused = size;
+    }
+    _cam_stage_end(cam, CAM_STAGE_CONVERT, start);
+
+    camera_release_frame(&frame);
+    if (converted < 0) return;
+
+    slot->surf = surf;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    uint64_t one = 1;
+    if (write(ring->ready_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        cam_warn("Could not signal frame: %s", strerror(errno));
+}
+
+static void *_cam_capture_thread(void *arg)
+{
+    Cam_Camera *cam = arg;
+    struct _Cam_Ring *ring = cam->ring;
+    struct pollfd fds[2] = {
+        { .fd = cam->fd, .events = POLLIN },
+        { .fd = ring->stop_fd, .events = POLLIN },
+    };
+
+    for (;;) {
+        uint64_t start = _cam_stage_begin(cam, CAM_STAGE_WAIT);
+        int r = poll(fds, 2, -1);
+        _cam_stage_end(cam, CAM_STAGE_WAIT, start);
+        if (r == -1) {
+            if (errno == EINTR) continue;
+            cam_error("poll: %s", strerror(errno));
+            break;
+        }
+        if (fds[1].revents) break;
+
+        if (fds[0].revents & POLLIN) {
+            _cam_ring_produce(cam, ring);
+            // a recording is always readable, even once it ran out
+            if (cam->replay && cam->replay->next >= cam->replay->n_frames) {
+                cam_info("End of recording '%s'", cam->dev_name);
+                break;
+            }
+        } else if (fds[0].revents & (POLLERR | POLLHUP)) {
+            // e.g. the device was unplugged, there will be no more frames
+            cam_error("Capture thread stopped, '%s' failed", cam->dev_name);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+// sizes the slots for the current output format and starts the thread
+static bool _cam_ring_start(Cam_Camera *cam)
+{
+    struct _Cam_Ring *ring = cam->ring;
+
+    // the slots are not used with a callback
+    size_t size = ring->on_frame ? 0 : cam->fmt.sizeimage;
+#ifndef CAM_NO_COVERT_TO_RGB
+    if (size && ring->convert && cam->out_stride * cam->out_height > size)
+        size = cam->out_stride * cam->out_height;
+#endif
+
+    for (unsigned int i = 0; i < ring->n_slots; i++) {
+        _Cam_Slot *slot = &ring->slots[i];
+        if (slot->size >= size) continue;
+
+        size_t mapped;
+        unsigned char *data = _cam_map_frames(size, cam->buffer_flags, &mapped);
+        if (!data) {
+            cam_error("Could not allocate capture slots");
+            return false;
+        }
+        _cam_unmap_frames(slot->data, slot->size);
+        slot->data = data;
+        slot->size = mapped;
+    }
+
+    ring->head = ring->tail = 0;
+    ring->holding = false;
+    int err = pthread_create(&ring->thread, NULL, _cam_capture_thread, cam);
+    if (err) {
+        cam_error("Could not start capture thread: %s", strerror(err));
+        return false;
+    }
+    ring->thread_running = true;
+    return true;
+}
+
+static void _cam_ring_stop(Cam_Camera *cam)
+{
+    struct _Cam_Ring *ring = cam->ring;
+    if (!ring->thread_running) return;
+
+    uint64_t value = 1;
+    if (write(ring->stop_fd, &value, sizeof(value)) == -1)
+        cam_warn("Could not stop capture thread: %s", strerror(errno));
+    pthread_join(ring->thread, NULL);
+    ring->thread_running = false;
+
+    // clear both so the next camera_begin starts out idle
+    while (read(ring->stop_fd, &value, sizeof(value)) > 0);
+    while (read(ring->ready_fd, &value, sizeof(value)) > 0);
+}
+
+static bool _cam_ring_get(Cam_Camera *cam, Cam_Surface *surf,
+        struct timeval *timeout)
+{
+    struct _Cam_Ring *ring = cam->ring;
+    if (!surf) return false;
+
+    // done with the slot handed out last time
+    unsigned long tail = ring->tail;
+    if (ring->holding) {
+        __atomic_store_n(&ring->tail, ++tail, __ATOMIC_RELEASE);
+        ring->holding = false;
+    }
+
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    bool waited = false;
+    while (head == tail) {
+        // ready_fd is only cleared once the ring looks empty, a frame
+        // published right after that signals it again
+        uint64_t value;
+        while (read(ring->ready_fd, &value, sizeof(value)) > 0);
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head != tail) break;
+
+        if (waited || _cam_zero_timeout(timeout)) return false;
+        if (!_cam_wait_fd(ring->ready_fd, timeout, cam->timeout_us)) {
+            _cam_count(&cam->stats.timeouts, 1);
+            return false;
+        }
+        waited = true;
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    }
+
+    if (__atomic_load_n(&cam->latest_only, __ATOMIC_RELAXED) &&
+            head - tail > 1) {
+        tail = head - 1;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    *surf = ring->slots[tail % ring->n_slots].surf;
+    ring->holding = true;
+    return true;
+}
+#endif
+
+#ifdef _CAM_THREADS
+struct Cam_Subscriber {
+    Cam_Camera *cam;
+    // buffer index + 1 of the newest frame not taken yet, 0 if there is none.
+    // It holds a reference which is moved to whoever exchanges it out.
+    unsigned int latest;
+    int ready_fd;
+};
+
+// a dequeued buffer is shared by every subscriber and only requeued once the
+// last reference is gone. Refs can drop on any thread, the buffers are handed
+// back to the driver by camera_broadcast_frame.
+struct _Cam_Broadcast {
+    // guards the subscriber list
+    pthread_mutex_t lock;
+    Cam_Subscriber **subs;
+    unsigned int n_subs;
+
+    unsigned int *refs;
+    Cam_FrameInfo *info;
+    // bit per buffer whose refs dropped to 0, release_fd is signalled with it
+    uint64_t returned;
+    int release_fd;
+};
+
+static void _cam_broadcast_unref(struct _Cam_Broadcast *broadcast,
+        unsigned int index)
+{
+    if (__atomic_sub_fetch(&broadcast->refs[index], 1, __ATOMIC_ACQ_REL) == 0) {
+        __atomic_fetch_or(&broadcast->returned, 1ull << index, __ATOMIC_RELEASE);
+
+        uint64_t one = 1;
+        if (write(broadcast->release_fd, &one, sizeof(one)) == -1 &&
+                errno != EAGAIN)
+            cam_warn("Could not signal release: %s", strerror(errno));
+    }
+}
+
+static bool _cam_broadcast_release(Cam_Camera *cam, unsigned int index)
+{
+    if (index >= cam->n_buffers ||
+            __atomic_load_n(&cam->broadcast->refs[index], __ATOMIC_ACQUIRE) == 0) {
+        cam_warn("Frame %u is not held", index);
+        return false;
+    }
+
+    _cam_broadcast_unref(cam->broadcast, index);
+    return true;
+}
+
+// hands the buffers nobody looks at anymore back to the driver
+static bool _cam_broadcast_requeue(Cam_Camera *cam)
+{
+    uint64_t returned = __atomic_exchange_n(&cam->broadcast->returned, 0,
+            __ATOMIC_ACQUIRE);
+    bool ret = true;
+
+    for (unsigned int i = 0; returned; i++, returned >>= 1) {
+        if ((returned & 1) && !_enqueue_frame(cam, i)) ret = false;
+    }
+    return ret;
+}
+
+static void _cam_broadcast_drop_latest(Cam_Subscriber *sub)
+{
+    unsigned int index = __atomic_exchange_n(&sub->latest, 0, __ATOMIC_ACQ_REL);
+    if (index) _cam_broadcast_unref(sub->cam->broadcast, index - 1);
+}
+
+// camera_end takes every buffer back, no matter who still looks at it
+static void _cam_broadcast_reset(Cam_Camera *cam)
+{
+    struct _Cam_Broadcast *broadcast = cam->broadcast;
+
+    pthread_mutex_lock(&broadcast->lock);
+    for (unsigned int i = 0; i < broadcast->n_subs; i++)
+        __atomic_store_n(&broadcast->subs[i]->latest, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&broadcast->lock);
+
+    for (unsigned int i = 0; i < cam->n_buffers; i++)
+        __atomic_store_n(&broadcast->refs[i], 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&broadcast->returned, 0, __ATOMIC_RELEASE);
+}
+
+static void _cam_broadcast_free(struct _Cam_Broadcast *broadcast)
+{
+    for (unsigned int i = 0; i < broadcast->n_subs; i++) {
+        close(broadcast->subs[i]->ready_fd);
+        free(broadcast->subs[i]);
+    }
+    pthread_mutex_destroy(&broadcast->lock);
+    if (broadcast->release_fd >= 0) close(broadcast->release_fd);
+    free(broadcast->subs);
+    free(broadcast->refs);
+    free(broadcast->info);
+    free(broadcast);
+}
+
+// whether frames are still shared. Once the last subscriber left and every
+// frame came back the broadcast is freed and the camera hands out frames
+// itself again, called on the thread that captures.
+static bool _cam_broadcasting(Cam_Camera *cam)
+{
+    struct _Cam_Broadcast *broadcast = cam->broadcast;
+    if (!broadcast) return false;
+
+    pthread_mutex_lock(&broadcast->lock);
+    bool subscribed = broadcast->n_subs > 0;
+    pthread_mutex_unlock(&broadcast->lock);
+    if (subscribed) return true;
+
+    for (unsigned int i = 0; i < cam->n_buffers; i++) {
+        if (__atomic_load_n(&broadcast->refs[i], __ATOMIC_ACQUIRE)) return true;
+    }
+
+    // what the last subscribers gave back still has to go to the driver
+    _cam_broadcast_requeue(cam);
+    _cam_broadcast_free(broadcast);
+    cam->broadcast = NULL;
+    return false;
+}
+
+// after the buffers were requested again, called while stopped
+static bool _cam_broadcast_resize(Cam_Camera *cam)
+{
+    struct _Cam_Broadcast *broadcast = cam->broadcast;
+    if (cam->n_buffers > 64) {
+        cam_error("Broadcasting supports at most 64 buffers");
+        return false;
+    }
+
+    unsigned int *refs = calloc(cam->n_buffers, sizeof(*refs));
+    Cam_FrameInfo *info = calloc(cam->n_buffers, sizeof(*info));
+    if (!refs || !info) {
+        cam_error("Could not allocate broadcast");
+        free(refs);
+        free(info);
+        return false;
+    }
+
+    free(broadcast->refs);
+    free(broadcast->info);
+    broadcast->refs = refs;
+    broadcast->info = info;
+    return true;
+}
+#endif
+
+Cam_Subscriber *camera_subscribe(Cam_Camera *cam)
+{
+    cam = _CAM_HANDLE(cam);
+
+#ifdef _CAM_THREADS
+    if (cam->fd < 0) {
+        cam_warn("Camera is not open");
+        return NULL;
+    }
+    if (cam->ring) {
+        cam_error("Frames can not be broadcast with a capture thread");
+        return NULL;
+    }
+    if (cam->n_buffers > 64) {
+        cam_error("Broadcasting supports at most 64 buffers");
+        return NULL;
+    }
+
+    struct _Cam_Broadcast *broadcast = cam->broadcast;
+    if (!broadcast) {
+        if (cam->running && cam->n_held) {
+            cam_error("Release every frame before subscribing");
+            return NULL;
+        }
+
+        broadcast = calloc(1, sizeof(*broadcast));
+        if (broadcast) {
+            broadcast->refs = calloc(cam->n_buffers, sizeof(*broadcast->refs));
+            broadcast->info = calloc(cam->n_buffers, sizeof(*broadcast->info));
+        }
+        if (!broadcast || !broadcast->refs || !broadcast->info) {
+            cam_error("Could not allocate broadcast");
+            if (broadcast) {
+                free(broadcast->refs);
+                free(broadcast->info);
+                free(broadcast);
+            }
+            return NULL;
+        }
+        pthread_mutex_init(&broadcast->lock, NULL);
+        broadcast->release_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (broadcast->release_fd < 0) {
+            cam_error("eventfd: %s", strerror(errno));
+            _cam_broadcast_free(broadcast);
+            return NULL;
+        }
+        cam->broadcast = broadcast;
+    }
+
+    Cam_Subscriber *sub = calloc(1, sizeof(*sub));
+    if (!sub) {
+        cam_error("Could not allocate subscriber");
+        return NULL;
+    }
+    sub->cam = cam;
+    sub->ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sub->ready_fd < 0) {
+        cam_error("eventfd: %s", strerror(errno));
+        free(sub);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&broadcast->lock);
+    Cam_Subscriber **subs = realloc(broadcast->subs,
+            (broadcast->n_subs + 1) * sizeof(*subs));
+    if (subs) {
+        broadcast->subs = subs;
+        broadcast->subs[broadcast->n_subs++] = sub;
+    }
+    pthread_mutex_unlock(&broadcast->lock);
+
+    if (!subs) {
+        cam_error("Could not allocate subscriber");
+        close(sub->ready_fd);
+        free(sub);
+        return NULL;
+    }
+    return sub;
+#else
+    cam_warn("Broadcasting is disabled");
+    return NULL;
+#endif
+}
+
+void camera_unsubscribe(Cam_Subscriber *sub)
+{
+#ifdef _CAM_THREADS
+    if (!sub) return;
+    struct _Cam_Broadcast *broadcast = sub->cam->broadcast;
+
+    pthread_mutex_lock(&broadcast->lock);
+    for (unsigned int i = 0; i < broadcast->n_subs; i++) {
+        if (broadcast->subs[i] != sub) continue;
+        broadcast->subs[i] = broadcast->subs[--broadcast->n_subs];
+        break;
+    }
+    pthread_mutex_unlock(&broadcast->lock);
+
+    _cam_broadcast_drop_latest(sub);
+    close(sub->ready_fd);
+    free(sub);
+#else
+    (void)sub;
+#endif
+}
+
+bool camera_broadcast_frame(Cam_Camera *cam, struct timeval *timeout)
+{
+    cam = _CAM_HANDLE(cam);
+
+#ifdef _CAM_THREADS
+    struct _Cam_Broadcast *broadcast = cam->broadcast;
+    if (!broadcast) {
+        cam_warn("Nobody is subscribed to '%s'", cam->dev_name);
+        return false;
+    }
+
+    if (!_cam_broadcast_requeue(cam)) return false;
+    if (cam->n_held == cam->n_buffers) {
+        // nothing to capture into, give the subscribers the timeout to let
+        // go of something
+        uint64_t value;
+        while (read(broadcast->release_fd, &value, sizeof(value)) > 0);
+        if (!_cam_broadcast_requeue(cam)) return false;
+
+        if (cam->n_held == cam->n_buffers) {
+            if (_cam_zero_timeout(timeout) ||
+                    !_cam_wait_fd(broadcast->release_fd, timeout, cam->timeout_us))
+                return false;
+            if (!_cam_broadcast_requeue(cam)) return false;
+        }
+        if (cam->n_held == cam->n_buffers) return false;
+    }
+
+    Cam_Frame frame;
+    if (!_camera_acquire_frame(cam, &frame, timeout)) return false;
+
+    unsigned int index = frame.index;
+    broadcast->info[index] = frame.buffer.info;
+
+    pthread_mutex_lock(&broadcast->lock);
+    // one ref per subscriber plus ours while handing it out
+    __atomic_store_n(&broadcast->refs[index], broadcast->n_subs + 1,
+            __ATOMIC_RELEASE);
+    for (unsigned int i = 0; i < broadcast->n_subs; i++) {
+        Cam_Subscriber *sub = broadcast->subs[i];
+
+        // a subscriber that did not get to the previous frame skips it
+        unsigned int old = __atomic_exchange_n(&sub->latest, index + 1,
+                __ATOMIC_ACQ_REL);
+        if (old) _cam_broadcast_unref(broadcast, old - 1);
+
+        uint64_t one = 1;
+        if (write(sub->ready_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            cam_warn("Could not signal frame: %s", strerror(errno));
+    }
+    pthread_mutex_unlock(&broadcast->lock);
+
+    _cam_broadcast_unref(broadcast, index);
+    return _cam_broadcast_requeue(cam);
+#else
+    (void)timeout;
+    cam_warn("Broadcasting is disabled");
+    return false;
+#endif
+}
+
+bool camera_subscriber_acquire(Cam_Subscriber *sub, Cam_Frame *frame,
+        struct timeval *timeout)
+{
+#ifdef _CAM_THREADS
+    if (!sub || !frame) return false;
+
+    unsigned int index = __atomic_exchange_n(&sub->latest, 0, __ATOMIC_ACQ_REL);
+    bool waited = false;
+    while (!index) {
+        // same as the capture ring, only clear the fd once there is nothing
+        uint64_t value;
+        while (read(sub->ready_fd, &value, sizeof(value)) > 0);
+        index = __atomic_exchange_n(&sub->latest, 0, __ATOMIC_ACQ_REL);
+        if (index) break;
+
+        if (waited || _cam_zero_timeout(timeout)) return false;
+        if (!_cam_wait_fd(sub->ready_fd, timeout, sub->cam->timeout_us))
+            return false;
+        waited = true;
+        index = __atomic_exchange_n(&sub->latest, 0, __ATOMIC_ACQ_REL);
+    }
+
+    Cam_Camera *cam = sub->cam;
+    frame->index = index - 1;
+    frame->buffer = cam->buffers[frame->index];
+    frame->buffer.info = cam->broadcast->info[frame->index];
+    frame->camera = cam;
+    return true;
+#else
+    (void)sub, (void)frame, (void)timeout;
+    return false;
+#endif
+}
+
+int camera_subscriber_fd(Cam_Subscriber *sub)
+{
+#ifdef _CAM_THREADS
+    return sub ? sub->ready_fd : -1;
+#else
+    (void)sub;
+    return -1;
+#endif
+}
+
+bool camera_set_capture_thread(Cam_Camera *cam, unsigned int slots,
+        bool convert)
+{
+    cam = _CAM_HANDLE(cam);
+    if (cam->running) {
+        cam_error("The capture thread can only be set up before camera_begin");
+        return false;
+    }
+
+#ifdef _CAM_THREADS
+    if (_cam_broadcasting(cam)) {
+        cam_error("Frames can not be broadcast with a capture thread");
+        return false;
+    }
+
+    // a callback stays in place
+    Cam_FrameCallback on_frame = NULL;
+    void *on_frame_user = NULL;
+    if (cam->ring) {
+        on_frame = cam->ring->on_frame;
+        on_frame_user = cam->ring->on_frame_user;
+        _cam_ring_free(cam->ring);
+        cam->ring = NULL;
+    }
+    if (!slots) return true;
+    if (slots < 2) {
+        cam_error("The capture thread needs at least 2 slots");
+        return false;
+    }
+
+    struct _Cam_Ring *ring = calloc(1, sizeof(*ring));
+    if (ring) ring->slots = calloc(slots, sizeof(*ring->slots));
+    if (!ring || !ring->slots) {
+        cam_error("Could not allocate capture ring");
+        free(ring);
+        return false;
+    }
+    ring->n_slots = slots;
+    ring->convert = convert;
+    ring->ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ring->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->ready_fd < 0 || ring->stop_fd < 0) {
+        cam_error("eventfd: %s", strerror(errno));
+        _cam_ring_free(ring);
+        return false;
+    }
+
+    ring->on_frame = on_frame;
+    ring->on_frame_user = on_frame_user;
+    cam->ring = ring;
+    return true;
+#else
+    (void)convert;
+    if (!slots) return true;
+    cam_warn("The capture thread is disabled");
+    return false;
+#endif
+}
+
+bool camera_set_frame_callback(Cam_Camera *cam, Cam_FrameCallback on_frame,
+        void *user)
+{
+    cam = _CAM_HANDLE(cam);
+    if (cam->running) {
+        cam_error("The frame callback can only be set before camera_begin");
+        return false;
+    }
+
+#ifdef _CAM_THREADS
+    if (!cam->ring) {
+        if (!on_frame) return true;
+        if (!camera_set_capture_thread(cam, 2, false)) return false;
+    }
+    cam->ring->on_frame = on_frame;
+    cam->ring->on_frame_user = user;
+    return true;
+#else
+    (void)user;
+    if (!on_frame) return true;
+    cam_warn("The capture thread is disabled");
+    return false;
+#endif
+}
+
+bool camera_get_frame_ex(Cam_Camera *cam, Cam_Surface *surf,
+        struct timeval *timeout)
+{
+    cam = _CAM_HANDLE(cam);
+#ifdef _CAM_THREADS
+    if (cam->ring) {
+        if (!cam->running) {
+            cam_warn("Camera is not running");
+            return false;
+        }
+        return _cam_ring_get(cam, surf, timeout);
+    }
+#endif
+    return _camera_get_frame(cam, surf, cam->rgb_buffer, cam->out_stride,
+            timeout);
+}
+
+bool camera_try_get_frame(Cam_Camera *cam, Cam_Surface *surf)
+{
+    struct timeval zero = {0};
+    return camera_get_frame_ex(cam, surf, &zero);
+}
+
+// 0 means tightly packed, false if dst_stride is too small
+static bool _cam_dst_stride(Cam_Camera *cam, size_t *dst_stride)
+{
+    size_t min = cam->out_width *
+        _cam_output_bpp[_cam_output_layout(cam->out_format)];
+    if (!*dst_stride) *dst_stride = min;
+    if (*dst_stride < min) {
+        cam_error("Destination stride is too small (%zu < %zu)", *dst_stride, min);
+        return false;
+    }
+    return true;
+}
+
+bool camera_get_frame_into(Cam_Camera *cam, Cam_Surface *surf, void *dst,
+        size_t dst_stride, struct timeval *timeout)
+{
+    cam = _CAM_HANDLE(cam);
+    if (!dst) return false;
+    if (_cam_threaded(cam)) {
+        cam_error("Frames are converted by the capture thread, use camera_get_frame");
+        return false;
+    }
+    if (!_cam_dst_stride(cam, &dst_stride)) return false;
+
+    return _camera_get_frame(cam, surf, dst, dst_stride, timeout);
+}
+
+bool camera_convert(Cam_Camera *cam, const Cam_Buffer *buf, Cam_Surface *surf,
+        void *dst, size_t dst_stride)
+{
+    cam = _CAM_HANDLE(cam);
+    if (!buf || !surf || !dst) return false;
+    if (!_cam_dst_stride(cam, &dst_stride)) return false;
+
+    surf->info = buf->info;
+    uint64_t start = _cam_stage_begin(cam, CAM_STAGE_CONVERT);
+    int converted = _cam_convert(cam, surf, buf, dst, dst_stride);
+    _cam_stage_end(cam, CAM_STAGE_CONVERT, start);
+    return converted > 0;
+}
+
+bool camera_end_ex(Cam_Camera *cam)
+{
+    cam = _CAM_HANDLE(cam);
+    if (!cam->running) {
+        cam_warn("Camera is not running");
+        return false;
+    }
+
+#ifdef _CAM_THREADS
+    // the thread has to be gone before the buffers are taken away from it
+    if (cam->ring)
+        _cam_ring_stop(cam);
+    if (cam->broadcast)
+        _cam_broadcast_reset(cam);
+#endif
+
+    enum v4l2_buf_type type;
+
+    switch (cam->io) {
+        case IO_METHOD_READ:
+#ifdef CAM_USE_IO_URING
+            // a read left in flight would land in the buffer later on
+            _cam_uring_cancel(cam);
+#endif
+            break;
+        case IO_METHOD_FILE:
+            /* Nothing to do. */
+            break;
+        case IO_METHOD_MMAP:
+        case IO_METHOD_DMABUF_EXPORT:
+        case IO_METHOD_DMABUF:
+        case IO_METHOD_USERPTR:
+            type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            if (_xioctl(cam->fd, VIDIOC_STREAMOFF, &type) == -1) {
+                cam_error("Could not turn off stream");
+                return false;
+            }
+            break;
+    }
+
+    // STREAMOFF takes every buffer back from both the driver and the user
+    memset(cam->held, 0, cam->n_buffers * sizeof(*cam->held));
+    cam->n_held = 0;
+    cam->pending = -1;
+
+    cam->running = false;
+    return true;
+}
+
+bool camera_close_ex(Cam_Camera *cam)
+{
+    Cam_Camera *handle = cam;
+    cam = _CAM_HANDLE(cam);
+    if (cam->fd < 0) {
+        cam_warn("Camera is not open");
+        return false;
+    }
+
+    bool ret = _camera_close(cam);
+    if (handle && handle != &_cam_default) free(handle);
+    return ret;
+}
+
+bool camera_set_fps(Cam_Camera *cam, Cam_Rate *rate)
+{
+    cam = _CAM_HANDLE(cam);
+    if (!rate) return false;
+    if (cam->fd < 0) {
+        cam_warn("Camera is not open");
+        return false;
+    }
+    if (cam->running) {
+        cam_error("The framerate can not be changed while running");
+        return false;
+    }
+    if (cam->replay) {
+        cam_error("'%s' is replayed at the rate it is read", cam->dev_name);
+        return false;
+    }
+
+    cam->fmt.fps = *rate;
+    bool ret = _cam_negotiate_fps(cam);
+    *rate = cam->fmt.fps;
+    return ret;
+}
+
+// frees our buffers and the driver's, it keeps its buffers (and refuses
+// S_FMT) until REQBUFS with a count of 0
+static bool _cam_release_buffers(Cam_Camera *cam)
+{
+    bool ret = _cam_free_buffers(cam);
+    if (cam->io == IO_METHOD_READ || cam->io == IO_METHOD_FILE) return ret;
+
+    struct v4l2_requestbuffers req;
+    __CLEAR(req);
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = _cam_memory(cam);
+    if (_xioctl(cam->fd, VIDIOC_REQBUFS, &req) == -1) {
+        cam_error("Could not free buffers: %s", strerror(errno));
+        ret = false;
+    }
+    return ret;
+}
+
+// sets the crop rectangle of the sensor, rect is set to what the driver
+// granted
+static bool _cam_set_crop(Cam_Camera *cam, struct v4l2_rect *rect)
+{
+    struct v4l2_selection sel;
+    __CLEAR(sel);
+    sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    sel.target = V4L2_SEL_TGT_CROP;
+    sel.r = *rect;
+    if (_xioctl(cam->fd, VIDIOC_S_SELECTION, &sel) == 0) {
+        *rect = sel.r;
+        return true;
+    }
+
+    // older drivers only have the crop api
+    struct v4l2_crop crop;
+    __CLEAR(crop);
+    crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    crop.c = *rect;
+    if (_xioctl(cam->fd, VIDIOC_S_CROP, &crop) == -1) {
+        cam_info("'%s' can not crop: %s", cam->dev_name, strerror(errno));
+        return false;
+    }
+    if (_xioctl(cam->fd, VIDIOC_G_CROP, &crop) == 0)
+        *rect = crop.c;
+    return true;
+}
+
+// the area of the sensor the frame shows without cropping, false if the
+// driver does not know about cropping at all
+static bool _cam_crop_default(Cam_Camera *cam, struct v4l2_rect *rect)
+{
+    struct v4l2_selection sel;
+    __CLEAR(sel);
+    sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    sel.target = V4L2_SEL_TGT_CROP_DEFAULT;
+    if (_xioctl(cam->fd, VIDIOC_G_SELECTION, &sel) == 0) {
+        *rect = sel.r;
+        return true;
+    }
+
+    struct v4l2_cropcap cropcap;
+    __CLEAR(cropcap);
+    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (_xioctl(cam->fd, VIDIOC_CROPCAP, &cropcap) == -1) return false;
+    *rect = cropcap.defrect;
+    return true;
+}
+
+// camera_set_format, with crop set on the sensor before the format when it
+// is not NULL
+static bool _cam_change_format(Cam_Camera *cam, Cam_Format *cam_fmt,
+        struct v4l2_rect *crop)
+{
+    // zeros keep what is there now
+    Cam_Format old = cam->fmt;
+    Cam_Format want = *cam_fmt;
+    if (!want.width) want.width = old.width;
+    if (!want.height) want.height = old.height;
+    if (!want.pixelformat) want.pixelformat = old.pixelformat;
+    if (!want.fps.num) want.fps = old.fps;
+    if (!want.buffer_count) want.buffer_count = old.buffer_count;
+
+    bool was_running = cam->running;
+    if (was_running && !camera_end_ex(cam)) return false;
+
+    // imported memory is put back in place if it still fits
+    int fds[VIDEO_MAX_FRAME];
+    unsigned int n_fds = 0;
+    if (cam->io == IO_METHOD_DMABUF) {
+        for (; n_fds < cam->n_buffers && n_fds < VIDEO_MAX_FRAME; n_fds++)
+            fds[n_fds] = cam->buffers[n_fds].dmabuf_fd;
+    }
+
+    bool ret = _cam_release_buffers(cam);
+
+    // drivers refuse a new crop while they have buffers, a failed one
+    // still has to bring the old buffers back
+    bool cropped = !crop || (ret && _cam_set_crop(cam, crop));
+    if (!cropped) want = old;
+
+    if (ret && !_cam_apply_format(cam, &want)) {
+        cam_warn("Going back to the previous format");
+        ret = false;
+        _cam_release_buffers(cam);
+        if (!_cam_apply_format(cam, &old)) {
+            cam_error("Could not restore the format of '%s'", cam->dev_name);
+            return false;
+        }
+    }
+
+    if (cam->io == IO_METHOD_USERPTR && cam->arena) {
+        if (cam->arena_size >= camera_userptr_size(cam)) {
+            camera_set_userptr(cam, cam->arena, cam->arena_size);
+        } else {
+            cam_warn("The arena is too small for the new format, allocating one");
+            cam->arena = NULL;
+            cam->arena_size = 0;
+        }
+    }
+    if (n_fds && (n_fds != cam->n_buffers ||
+                !camera_set_dmabufs(cam, fds, n_fds))) {
+        cam_error("The dmabufs do not fit the new format, call camera_set_dmabufs");
+        was_running = false;
+        ret = false;
+    }
+
+#ifdef _CAM_THREADS
+    if (cam->broadcast && !_cam_broadcast_resize(cam)) return false;
+#endif
+
+    if (was_running && !camera_begin_ex(cam)) return false;
+
+    *cam_fmt = cam->fmt;
+    return ret && cropped;
+}
+
+bool camera_set_format(Cam_Camera *cam, Cam_Format *cam_fmt)
+{
+    cam = _CAM_HANDLE(cam);
+    if (!cam_fmt) return false;
+    if (cam->fd < 0) {
+        cam_warn("Camera is not open");
+        return false;
+    }
+    if (cam->replay) {
+        cam_error("'%s' is replayed in the format it was recorded in",
+                cam->dev_name);
+        return false;
+    }
+
+    return _cam_change_format(cam, cam_fmt, NULL);
+}
+
+bool camera_set_roi(Cam_Camera *cam, Cam_Rect *roi)
+{
+    cam = _CAM_HANDLE(cam);
+    if (cam->fd < 0) {
+        cam_warn("Camera is not open");
+        return false;
+    }
+    if (_cam_threaded(cam)) {
+        cam_error("The roi can not be changed while the capture thread runs");
+        return false;
+    }
+
+    if (!cam->roi_hw) {
+        cam->full_width = cam->fmt.width;
+        cam->full_height = cam->fmt.height;
+    }
+    size_t full_width = cam->full_width, full_height = cam->full_height;
+
+    bool reset = !roi || !roi->width || !roi->height;
+    Cam_Rect want = { 0, 0, full_width, full_height };
+    if (!reset) {
+        want = *roi;
+        if (want.x >= full_width || want.y >= full_height) {
+            cam_error("The roi is outside of the %zux%zu frame", full_width,
+                    full_height);
+            return false;
+        }
+        if (want.width > full_width - want.x) want.width = full_width - want.x;
+        if (want.height > full_height - want.y) want.height = full_height - want.y;
+    }
+
+    struct v4l2_rect def;
+    if ((!reset || cam->roi_hw) && _cam_crop_default(cam, &def) &&
+            def.width && def.height) {
+        // the frame is the default crop scaled to full_width x full_height,
+        // so scale the roi up to sensor pixels and let the format scale it
+        // back down
+        struct v4l2_rect rect = {
+            .left = def.left + (int)(want.x * def.width / full_width),
+            .top = def.top + (int)(want.y * def.height / full_height),
+            .width = want.width * def.width / full_width,
+            .height = want.height * def.height / full_height,
+        };
+        Cam_Format fmt = { .width = want.width, .height = want.height };
+        if (_cam_change_format(cam, &fmt, &rect)) {
+            cam->roi_hw = !reset;
+            cam->roi_soft = false;
+            want = (Cam_Rect){
+                .x = (size_t)(rect.left - def.left) * full_width / def.width,
+                .y = (size_t)(rect.top - def.top) * full_height / def.height,
+                .width = cam->fmt.width,
+                .height = cam->fmt.height,
+            };
+            cam->roi = want;
+            if (roi) *roi = want;
+            if (!reset)
+                cam_info("Roi %zux%zu at %zu, %zu cropped by the sensor",
+                        want.width, want.height, want.x, want.y);
+            return true;
+        }
+        if (cam->roi_hw) {
+            // the frame is still cropped, a software roi would be off
+            cam_error("Could not change the crop of '%s'", cam->dev_name);
+            return false;
+        }
+    }
+
+#ifndef CAM_NO_COVERT_TO_RGB
+    if (!reset) {
+        // the chroma is shared by pairs of pixels (and rows for 4:2:0)
+        want.x &= ~(size_t)1;
+        want.y &= ~(size_t)1;
+        want.width &= ~(size_t)1;
+        if (!want.width) want.width = 2;
+        cam_info("Roi %zux%zu at %zu, %zu cut out while converting",
+                want.width, want.height, want.x, want.y);
+    }
+    cam->roi = want;
+    cam->roi_soft = !reset;
+    if (roi) *roi = want;
+    return _cam_update_output(cam);
+#else
+    if (reset) return true;
+    cam_warn("'%s' can not crop and conversion is disabled", cam->dev_name);
+    return false;
+#endif
+}
+
+size_t camera_enum_fps(Cam_Camera *cam, Cam_PixelFormat pixelformat,
+        size_t width, size_t height, Cam_Rate *rates, size_t max)
+{
+    cam = _CAM_HANDLE(cam);
+    if (cam->fd < 0) {
+        cam_warn("Camera is not open");
+        return 0;
+    }
+
+    struct v4l2_frmivalenum ival;
+    __CLEAR(ival);
+    ival.pixel_format = pixelformat;
+    ival.width = width;
+    ival.height = height;
+
+    size_t count = 0;
+    while (_xioctl(cam->fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival) == 0) {
+        if (ival.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+            if (count < max)
+                rates[count] = (Cam_Rate){ ival.discrete.denominator,
+                    ival.discrete.numerator };
+            count++;
+            ival.index++;
+            continue;
+        }
+
+        // stepwise and continuous only have the one entry
+        const struct v4l2_fract *fastest = &ival.stepwise.min;
+        const struct v4l2_fract *slowest = &ival.stepwise.max;
+        if (count < max)
+            rates[count] = (Cam_Rate){ fastest->denominator, fastest->numerator };
+        if (count + 1 < max)
+            rates[count + 1] = (Cam_Rate){ slowest->denominator, slowest->numerator };
+        count += 2;
+        break;
+    }
+
+    return count;
+}
+
+// how costly getting the output format out of a capture format is
+static int _cam_convert_cost(Cam_PixelFormat pixelformat)
+{
+    switch (pixelformat) {
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_UYVY:
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_NV21:
+        case V4L2_PIX_FMT_YUV420:
+        case V4L2_PIX_FMT_YVU420:
+        case V4L2_PIX_FMT_GREY:
+        case V4L2_PIX_FMT_RGB565:
+            return 1;
+#ifdef CAM_USE_TURBOJPEG
+        case V4L2_PIX_FMT_MJPEG:
+        case V4L2_PIX_FMT_JPEG:
+            return 3;
+#endif
+        default:
+            // handed out raw, the caller has to do the work
+            return 4;
+    }
+}
+
+// rough bits per pixel sent by the camera
+static double _cam_mode_bpp(const Cam_Mode *mode)
+{
+    switch (mode->pixelformat) {
+        case V4L2_PIX_FMT_GREY:
+            return 8;
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_NV21:
+        case V4L2_PIX_FMT_YUV420:
+        case V4L2_PIX_FMT_YVU420:
+            return 12;
+        case V4L2_PIX_FMT_RGB24:
+        case V4L2_PIX_FMT_BGR24:
+            return 24;
+        case V4L2_PIX_FMT_RGB32:
+        case V4L2_PIX_FMT_BGR32:
+            return 32;
+        default:
+            // a typical webcam MJPEG stream is around 1/8 of the raw data
+            return mode->compressed ? 2 : 16;
+    }
+}
+
+static double _cam_rate(Cam_Rate rate)
+{
+    return rate.den ? (double)rate.num / rate.den : 0;
+}
+
+static void _cam_add_mode(Cam_Camera *cam, const struct v4l2_fmtdesc *desc,
+        size_t width, size_t height, Cam_Mode *modes, size_t max,
+        size_t *count)
+{
+    Cam_Rate rates[64];
+    size_t n = camera_enum_fps(cam, desc->pixelformat, width, height, rates,
+            sizeof(rates) / sizeof(*rates));
+    if (n > sizeof(rates) / sizeof(*rates)) n = sizeof(rates) / sizeof(*rates);
+
+    Cam_Mode mode = {
+        .pixelformat = desc->pixelformat,
+        .width = width,
+        .height = height,
+        .compressed = desc->flags & V4L2_FMT_FLAG_COMPRESSED,
+    };
+    for (size_t i = 0; i < n; i++) {
+        if (_cam_rate(rates[i]) > _cam_rate(mode.fps)) mode.fps = rates[i];
+    }
+
+    if (*count < max) modes[*count] = mode;
+    (*count)++;
+}
+
+size_t camera_enum_modes(Cam_Camera *cam, Cam_Mode *modes, size_t max)
+{
+    cam = _CAM_HANDLE(cam);
+    if (cam->fd < 0) {
+        cam_warn("Camera is not open");
+        return 0;
+    }
+
+    size_t count = 0;
+    struct v4l2_fmtdesc desc;
+    __CLEAR(desc);
+    desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    for (; _xioctl(cam->fd, VIDIOC_ENUM_FMT, &desc) == 0; desc.index++) {
+        struct v4l2_frmsizeenum size;
+        __CLEAR(size);
+        size.pixel_format = desc.pixelformat;
+
+        for (; _xioctl(cam->fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0; size.index++) {
+            if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+                _cam_add_mode(cam, &desc, size.discrete.width,
+                        size.discrete.height, modes, max, &count);
+                continue;
+            }
+
+            // stepwise and continuous only have the one entry
+            _cam_add_mode(cam, &desc, size.stepwise.min_width,
+                    size.stepwise.min_height, modes, max, &count);
+            _cam_add_mode(cam, &desc, size.stepwise.max_width,
+                    size.stepwise.max_height, modes, max, &count);
+            break;
+        }
+    }
+
+    return count;
+}
+
+// < 0 if a is the better mode
+static double _cam_compare_modes(const Cam_Mode *a, const Cam_Mode *b,
+        Cam_ModePreference prefer)
+{
+    double cost = _cam_convert_cost(a->pixelformat) -
+        _cam_convert_cost(b->pixelformat);
+    double pixels = (double)a->width * a->height - (double)b->width * b->height;
+    // unknown rates count as one frame per second
+    double bandwidth = _cam_mode_bpp(a) * a->width * a->height *
+        (a->fps.den ? _cam_rate(a->fps) : 1) -
+        _cam_mode_bpp(b) * b->width * b->height *
+        (b->fps.den ? _cam_rate(b->fps) : 1);
+
+    if (prefer == CAM_PREFER_BANDWIDTH) {
+        if (bandwidth) return bandwidth;
+        if (cost) return cost;
+        return pixels;
+    }
+
+    if (cost) return cost;
+    if (pixels) return pixels;
+    return bandwidth;
+}
+
+bool camera_select_mode(const Cam_Mode *modes, size_t n_modes, size_t width,
+        size_t height, Cam_Rate fps, Cam_ModePreference prefer, Cam_Mode *out)
+{
+    const Cam_Mode *best = NULL;
+
+    for (size_t i = 0; i < n_modes; i++) {
+        const Cam_Mode *mode = &modes[i];
+        if (mode->width < width || mode->height < height) continue;
+        // a little slack for 30000/1001 vs 30/1
+        if (fps.den && _cam_rate(mode->fps) < _cam_rate(fps) * 0.99) continue;
+
+        if (!best || _cam_compare_modes(mode, best, prefer) < 0)
+            best = mode;
+    }
+
+    if (!best) return false;
+    if (out) *out = *best;
+    return true;
+}
+
+static void _cam_free_controls(Cam_Camera *cam)
+{
+    free(cam->controls);
+    free(cam->control_batch);
+    cam->controls = NULL;
+    cam->control_batch = NULL;
+    cam->n_controls = 0;
+    cam->controls_loaded = false;
+}
+
+// queries the controls once, camera_set_controls only needs their types
+static bool _cam_load_controls(Cam_Camera *cam)
+{
+    if (cam->controls_loaded) return true;
+    if (cam->fd < 0) {
+        cam_warn("Camera is not open");
+        return false;
+    }
+
+    size_t cap = 0;
+    struct v4l2_query_ext_ctrl query;
+    __CLEAR(query);
+    query.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+    // fails with EINVAL after the last one (ENOTTY for recordings)
+    for (; _xioctl(cam->fd, VIDIOC_QUERY_EXT_CTRL, &query) == 0;
+            query.id |= V4L2_CTRL_FLAG_NEXT_CTRL) {
+        // class headers and compound controls do not have a value
+        if (query.type == V4L2_CTRL_TYPE_CTRL_CLASS ||
+                query.flags & (V4L2_CTRL_FLAG_DISABLED | V4L2_CTRL_FLAG_HAS_PAYLOAD))
+            continue;
+
+        if (cam->n_controls == cap) {
+            cap = cap ? cap * 2 : 32;
+            Cam_Control *controls = realloc(cam->controls,
+                    cap * sizeof(*controls));
+            if (!controls) {
+                cam_error("Could not allocate controls");
+                _cam_free_controls(cam);
+                return false;
+            }
+            cam->controls = controls;
+        }
+
+        Cam_Control *control = &cam->controls[cam->n_controls++];
+        *control = (Cam_Control){
+            .id = query.id,
+            .type = query.type,
+            .minimum = query.minimum,
+            .maximum = query.maximum,
+            .step = query.step,
+            .default_value = query.default_value,
+            .flags = query.flags,
+        };
+        memcpy(control->name, query.name, sizeof(control->name) - 1);
+    }
+
+    cam->control_batch = calloc(cam->n_controls ? cam->n_controls : 1,
+            sizeof(*cam->control_batch));
+    if (!cam->control_batch) {
+        cam_error("Could not allocate controls");
+        _cam_free_controls(cam);
+        return false;
+    }
+    cam->controls_loaded = true;
+    return true;
+}
+
+static const Cam_Control *_cam_find_control(Cam_Camera *cam, uint32_t id)
+{
+    for (size_t i = 0; i < cam->n_controls; i++)
+        if (cam->controls[i].id == id) return &cam->controls[i];
+    return NULL;
+}
+
+size_t camera_enum_controls(Cam_Camera *cam, Cam_Control *controls, size_t max)
+{
+    cam = _CAM_HANDLE(cam);
+
+    // queried again for flags like V4L2_CTRL_FLAG_INACTIVE
+    _cam_free_controls(cam);
+    if (!_cam_load_controls(cam)) return 0;
+
+    for (size_t i = 0; controls && i < max && i < cam->n_controls; i++)
+        controls[i] = cam->controls[i];
+    return cam->n_controls;
+}
+
+// puts values into control_batch, false if the camera lacks one of them
+static bool _cam_batch_controls(Cam_Camera *cam, const Cam_ControlValue *values,
+        size_t count, struct v4l2_ext_controls *ctrls)
+{
+    if (!values || !_cam_load_controls(cam)) return false;
+    if (count > cam->n_controls) {
+        cam_error("'%s' only has %zu controls", cam->dev_name, cam->n_controls);
+        return false;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const Cam_Control *control = _cam_find_control(cam, values[i].id);
+        if (!control) {
+            cam_error("'%s' has no control 0x%08x", cam->dev_name, values[i].id);
+            return false;
+        }
+
+        struct v4l2_ext_control *ctrl = &cam->control_batch[i];
+        __CLEAR(*ctrl);
+        ctrl->id = values[i].id;
+        if (control->type == V4L2_CTRL_TYPE_INTEGER64)
+            ctrl->value64 = values[i].value;
+        else
+            ctrl->value = values[i].value;
+    }
+
+    __CLEAR(*ctrls);
+    ctrls->which = V4L2_CTRL_WHICH_CUR_VAL;
+    ctrls->count = count;
+    ctrls->controls = cam->control_batch;
+    return true;
+}
+
+static void _cam_controls_error(Cam_Camera *cam, const char *what,
+        const struct v4l2_ext_controls *ctrls)
+{
+    int err = errno;
+    // error_idx is count when it is not down to one control
+    const Cam_Control *control = ctrls->error_idx < ctrls->count ?
+        _cam_find_control(cam, ctrls->controls[ctrls->error_idx].id) : NULL;
+    if (control)
+        cam_error("Could not %s %s: %s", what, control->name, strerror(err));
+    else
+        cam_error("Could not %s %u controls: %s", what, ctrls->count,
+                strerror(err));
+}
+
+bool camera_set_controls(Cam_Camera *cam, const Cam_ControlValue *values,
+        size_t count)
+{
+    cam = _CAM_HANDLE(cam);
+    if (!count) return true;
+
+    struct v4l2_ext_controls ctrls;
+    if (!_cam_batch_controls(cam, values, count, &ctrls)) return false;
+    if (_xioctl(cam->fd, VIDIOC_S_EXT_CTRLS, &ctrls) == -1) {
+        _cam_controls_error(cam, "set", &ctrls);
+        return false;
+    }
+    return true;
+}
+
+bool camera_get_controls(Cam_Camera *cam, Cam_ControlValue *values,
+        size_t count)
+{
+    cam = _CAM_HANDLE(cam);
+    if (!count) return true;
+
+    struct v4l2_ext_controls ctrls;
+    if (!_cam_batch_controls(cam, values, count, &ctrls)) return false;
+    if (_xioctl(cam->fd, VIDIOC_G_EXT_CTRLS, &ctrls) == -1) {
+        _cam_controls_error(cam, "get", &ctrls);
+        return false;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const Cam_Control *control = _cam_find_control(cam, values[i].id);
+        values[i].value = control->type == V4L2_CTRL_TYPE_INTEGER64 ?
+            cam->control_batch[i].value64 : cam->control_batch[i].value;
+    }
+    return true;
+}
+
+// the driver lists index among the choices of the menu control id
+static bool _cam_menu_has(Cam_Camera *cam, uint32_t id, uint32_t index)
+{
+    struct v4l2_querymenu menu;
+    __CLEAR(menu);
+    menu.id = id;
+    menu.index = index;
+    return _xioctl(cam->fd, VIDIOC_QUERYMENU, &menu) == 0;
+}
+
+bool camera_set_performance_preset(Cam_Camera *cam)
+{
+    cam = _CAM_HANDLE(cam);
+    if (!_cam_load_controls(cam)) return false;
+
+    // the exposure time can only be set once it is not automatic anymore,
+    // that takes its own batch
+    Cam_ControlValue modes[2];
+    size_t n_modes = 0;
+    if (_cam_find_control(cam, V4L2_CID_EXPOSURE_AUTO)) {
+        // some cameras only offer shutter priority, which fixes the exposure
+        // time too (the iris still adjusts)
+        int64_t mode = V4L2_EXPOSURE_MANUAL;
+        if (!_cam_menu_has(cam, V4L2_CID_EXPOSURE_AUTO, mode) &&
+                _cam_menu_has(cam, V4L2_CID_EXPOSURE_AUTO,
+                    V4L2_EXPOSURE_SHUTTER_PRIORITY))
+            mode = V4L2_EXPOSURE_SHUTTER_PRIORITY;
+        modes[n_modes++] = (Cam_ControlValue){ V4L2_CID_EXPOSURE_AUTO, mode };
+    }
+    // UVC cameras lower the framerate in low light when this is on
+    if (_cam_find_control(cam, V4L2_CID_EXPOSURE_AUTO_PRIORITY))
+        modes[n_modes++] = (Cam_ControlValue){ V4L2_CID_EXPOSURE_AUTO_PRIORITY, 0 };
+
+    const Cam_Control *exposure = _cam_find_control(cam,
+            V4L2_CID_EXPOSURE_ABSOLUTE);
+    if (!n_modes && !exposure) {
+        cam_warn("'%s' has no exposure controls", cam->dev_name);
+        return false;
+    }
+    if (!camera_set_controls(cam, modes, n_modes)) return false;
+    if (!exposure) return true;
+
+    Cam_Rate fps = cam->fmt.fps;
+    if (!fps.num || !fps.den) {
+        cam_warn("The framerate is unknown, keeping the exposure time");
+        return true;
+    }
+
+    // V4L2_CID_EXPOSURE_ABSOLUTE is in 100 us
+    Cam_ControlValue value = { V4L2_CID_EXPOSURE_ABSOLUTE, 0 };
+    if (!camera_get_controls(cam, &value, 1)) return false;
+    int64_t period = (int64_t)fps.den * 10000 / fps.num;
+    if (value.value > period) {
+        int64_t step = exposure->step ? exposure->step : 1;
+        value.value = period < exposure->minimum ? exposure->minimum :
+            exposure->minimum + (period - exposure->minimum) / step * step;
+        if (!camera_set_controls(cam, &value, 1)) return false;
+    }
+
+    cam_info("Exposure fixed at %.1f ms for %.2f fps", value.value / 10.0,
+            _cam_rate(fps));
+    return true;
+}
+
+int camera_get_fd(Cam_Camera *cam)
+{
+    cam = _CAM_HANDLE(cam);
+#ifdef _CAM_THREADS
+    if (cam->ring) return cam->ring->ready_fd;
+#endif
+    return cam->fd;
+}
+
+uint64_t camera_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t _cam_load(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+bool camera_get_stats(Cam_Camera *cam, Cam_Stats *stats)
+{
+    cam = _CAM_HANDLE(cam);
+    if (!stats) return false;
+
+    // field by field, the thread dequeuing frames can be updating them
+    const Cam_Stats *src = &cam->stats;
+    __CLEAR(*stats);
+    stats->frames = _cam_load(&src->frames);
+    stats->sequence_gaps = _cam_load(&src->sequence_gaps);
+    stats->eagain = _cam_load(&src->eagain);
+    stats->timeouts = _cam_load(&src->timeouts);
+    stats->ring_dropped = _cam_load(&src->ring_dropped);
+    for (int i = 0; i < CAM_STAGE_COUNT; i++) {
+        const Cam_Histogram *hist = &src->latency[i];
+        stats->latency[i].count = _cam_load(&hist->count);
+        stats->latency[i].total_ns = _cam_load(&hist->total_ns);
+        stats->latency[i].max_ns = _cam_load(&hist->max_ns);
+        for (int j = 0; j < CAM_STATS_BUCKETS; j++)
+            stats->latency[i].buckets[j] = _cam_load(&hist->buckets[j]);
+    }
+
+    if (cam->io != IO_METHOD_READ) {
+        unsigned int held = __atomic_load_n(&cam->n_held, __ATOMIC_RELAXED);
+        unsigned int max_held = __atomic_load_n(&cam->max_held,
+                __ATOMIC_RELAXED);
+        stats->held = held;
+        if (cam->running) stats->queued = cam->n_buffers - held;
+        stats->min_queued = max_held < cam->n_buffers
+            ? cam->n_buffers - max_held : 0;
+    }
+
+#ifdef _CAM_THREADS
+    struct _Cam_Ring *ring = cam->ring;
+    if (ring && cam->running) {
+        unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        // the slot at tail is still with the consumer
+        if (__atomic_load_n(&ring->holding, __ATOMIC_RELAXED)) tail++;
+        stats->ring_waiting = head > tail ? head - tail : 0;
+    }
+#endif
+    return true;
+}
+
+bool camera_reset_stats(Cam_Camera *cam)
+{
+    cam = _CAM_HANDLE(cam);
+    if (_cam_threaded(cam)) {
+        cam_error("Stats can not be reset while the capture thread runs");
+        return false;
+    }
+
+    __CLEAR(cam->stats);
+    cam->max_held = cam->n_held;
+    return true;
+}
+
+// the capture thread reads these without locking
+static bool _cam_set_staged(Cam_Camera *cam, const char *what)
+{
+    if (_cam_threaded(cam)) {
+        cam_error("%s can not be changed while the capture thread runs", what);
+        return false;
+    }
+    return true;
+}
+
+bool camera_set_latency_stats(Cam_Camera *cam, bool enable)
+{
+    cam = _CAM_HANDLE(cam);
+    if (!_cam_set_staged(cam, "Latency stats")) return false;
+
+    cam->latency_stats = enable;
+    cam->staged = enable || cam->stage_begin || cam->stage_end;
+    return true;
+}
+
+bool camera_set_trace_hooks(Cam_Camera *cam, Cam_StageHook begin,
+        Cam_StageHook end, void *user)
+{
+    cam = _CAM_HANDLE(cam);
+    if (!_cam_set_staged(cam, "Trace hooks")) return false;
+
+    cam->stage_begin = begin;
+    cam->stage_end = end;
+    cam->stage_user = user;
+    cam->staged = cam->latency_stats || begin || end;
+    return true;
+}
+
+uint64_t camera_histogram_percentile(const Cam_Histogram *hist,
+        double fraction)
+{
+    if (!hist || !hist->count) return 0;
+
+    double want = fraction * hist->count;
+    uint64_t target = want, seen = 0;
+    if (target < want || target < 1) target++;
+    for (int i = 0; i < CAM_STATS_BUCKETS - 1; i++) {
+        seen += hist->buckets[i];
+        if (seen < target) continue;
+
+        uint64_t bound = (1ull << i) * 1000;
+        return bound < hist->max_ns ? bound : hist->max_ns;
+    }
+    return hist->max_ns;
+}
+
+struct Cam_Poller {
+    int epfd;
+    struct epoll_event *events;
+    int n_cameras;
+};
+
+Cam_Poller *camera_poller_create(void)
+{
+    Cam_Poller *poller = calloc(1, sizeof(*poller));
+    if (!poller) {
+        cam_error("Could not allocate poller");
+        return NULL;
+    }
+
+    poller->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (poller->epfd == -1) {
+        cam_error("epoll_create1: %s", strerror(errno));
+        free(poller);
+        return NULL;
+    }
+
+    return poller;
+}
+
+bool camera_poller_add(Cam_Poller *poller, Cam_Camera *cam)
+{
+    if (!poller) return false;
+    cam = _CAM_HANDLE(cam);
+
+    if (cam->fd < 0) {
+        cam_warn("Camera is not open");
+        return false;
+    }
+
+    // one slot per camera so a single wait can return all of them
+    struct epoll_event *events = realloc(poller->events,
+            (poller->n_cameras + 1) * sizeof(*events));
+    if (!events) {
+        cam_error("Could not allocate poller events");
+        return false;
+    }
+    poller->events = events;
+
+    struct epoll_event ev;
+    __CLEAR(ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = cam;
+    if (epoll_ctl(poller->epfd, EPOLL_CTL_ADD, camera_get_fd(cam), &ev) == -1) {
+        cam_error("Could not add '%s' to poller: %s", cam->dev_name,
+                strerror(errno));
+        return false;
+    }
+
+    poller->n_cameras++;
+    return true;
+}
+
+bool camera_poller_remove(Cam_Poller *poller, Cam_Camera *cam)
+{
+    if (!poller) return false;
+    cam = _CAM_HANDLE(cam);
+
+    if (epoll_ctl(poller->epfd, EPOLL_CTL_DEL, camera_get_fd(cam), NULL) == -1) {
+        cam_error("Could not remove '%s' from poller: %s", cam->dev_name,
+                strerror(errno));
+        return false;
+    }
+
+    poller->n_cameras--;
+    return true;
+}
+
+int camera_poller_wait(Cam_Poller *poller, Cam_Camera **ready, int max,
+        struct timeval *timeout)
+{
+    if (!poller || !ready || max <= 0) return -1;
+    if (poller->n_cameras == 0) return 0;
+
+    int timeout_ms;
+    if (timeout) {
+        // round up so short timeouts do not turn into busy polling
+        timeout_ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+    } else {
+        timeout_ms = (CAM_DEFAULT_TIMEOUT_US + 999) / 1000;
+    }
+
+    if (max > poller->n_cameras) max = poller->n_cameras;
+
+    int n;
+    do {
+        n = epoll_wait(poller->epfd, poller->events, max, timeout_ms);
+    } while (n == -1 && errno == EINTR);
+
+    if (n == -1) {
+        cam_error("epoll_wait: %s", strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++)
+        ready[i] = poller->events[i].data.ptr;
+
+    return n;
+}
+
+int camera_poller_fd(Cam_Poller *poller)
+{
+    return poller ? poller->epfd : -1;
+}
+
+void camera_poller_destroy(Cam_Poller *poller)
+{
+    if (!poller) return;
+
+    close(poller->epfd);
+    free(poller->events);
+    free(poller);
+}
+
+// frames of one camera that are acquired but not handed out, oldest first
+typedef struct {
+    Cam_Camera *cam;
+    Cam_Frame *frames;
+    unsigned int cap;
+    unsigned int first;
+    unsigned int n;
+} _Cam_SetQueue;
+
+struct Cam_Frameset {
+    Cam_Poller *poller;
+    Cam_Camera **ready;
+    _Cam_SetQueue *queues;
+    size_t n_queues;
+    // cameras that are set up, the first count queues
+    size_t count;
+    uint64_t tolerance_ns;
+    uint64_t dropped;
+};
+
+static Cam_Frame *_cam_set_frame(_Cam_SetQueue *q, unsigned int i)
+{
+    return &q->frames[(q->first + i) % q->cap];
+}
+
+static uint64_t _cam_set_time(_Cam_SetQueue *q, unsigned int i)
+{
+    return _cam_set_frame(q, i)->buffer.info.timestamp_ns;
+}
+
+// gives the oldest frame of q back to the driver
+static void _cam_set_drop(Cam_Frameset *set, _Cam_SetQueue *q)
+{
+    camera_release_frame(_cam_set_frame(q, 0));
+    q->first = (q->first + 1) % q->cap;
+    q->n--;
+    set->dropped++;
+}
+
+Cam_Frameset *camera_frameset_create(Cam_Camera **cameras, size_t count,
+        uint64_t tolerance_ns)
+{
+    if (!cameras || !count) return NULL;
+
+    Cam_Frameset *set = calloc(1, sizeof(*set));
+    if (!set || !(set->queues = calloc(count, sizeof(*set->queues))) ||
+            !(set->ready = calloc(count, sizeof(*set->ready)))) {
+        cam_error("Could not allocate frameset");
+        if (set) free(set->queues);
+        free(set);
+        return NULL;
+    }
+    set->n_queues = count;
+    set->tolerance_ns = tolerance_ns;
+
+    set->poller = camera_poller_create();
+    if (!set->poller) {
+        camera_frameset_destroy(set);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        Cam_Camera *cam = _CAM_HANDLE(cameras[i]);
+        _Cam_SetQueue *q = &set->queues[i];
+        if (cam->n_buffers < 2) {
+            cam_error("'%s' needs at least 2 buffers for a frameset",
+                    cam->dev_name);
+            camera_frameset_destroy(set);
+            return NULL;
+        }
+
+        q->cam = cam;
+        q->cap = cam->n_buffers;
+        q->frames = calloc(q->cap, sizeof(*q->frames));
+        if (!q->frames) {
+            cam_error("Could not allocate frameset");
+            camera_frameset_destroy(set);
+            return NULL;
+        }
+        if (!camera_poller_add(set->poller, cam)) {
+            camera_frameset_destroy(set);
+            return NULL;
+        }
+        set->count++;
+    }
+
+    return set;
+}
+
+// acquires the frame cam has ready
+static bool _cam_set_pull(Cam_Frameset *set, Cam_Camera *cam)
+{
+    _Cam_SetQueue *q = NULL;
+    for (size_t i = 0; i < set->count && !q; i++)
+        if (set->queues[i].cam == cam) q = &set->queues[i];
+    if (!q) return false;
+
+    // leave the driver a buffer to capture the next frame into
+    if (q->n && (q->n == q->cap || cam->n_held + 1 >= cam->n_buffers))
+        _cam_set_drop(set, q);
+
+    struct timeval zero = {0};
+    Cam_Frame *frame = &q->frames[(q->first + q->n) % q->cap];
+    if (!camera_acquire_frame_ex(cam, frame, &zero)) return false;
+    q->n++;
+    return true;
+}
+
+// fills frames if every camera has one within the tolerance of the newest
+// one, frames that can not be part of a set anymore are dropped on the way
+static bool _cam_set_match(Cam_Frameset *set, Cam_Frame *frames)
+{
+    uint64_t newest;
+    bool dropped;
+    do {
+        newest = 0;
+        for (size_t i = 0; i < set->count; i++) {
+            _Cam_SetQueue *q = &set->queues[i];
+            if (!q->n) return false;
+            if (_cam_set_time(q, 0) > newest) newest = _cam_set_time(q, 0);
+        }
+
+        // frames only get newer, so the camera with the newest one will never
+        // have one that matches these
+        dropped = false;
+        for (size_t i = 0; i < set->count; i++) {
+            _Cam_SetQueue *q = &set->queues[i];
+            while (q->n && _cam_set_time(q, 0) + set->tolerance_ns < newest) {
+                _cam_set_drop(set, q);
+                dropped = true;
+            }
+        }
+    } while (dropped);
+
+    for (size_t i = 0; i < set->count; i++) {
+        _Cam_SetQueue *q = &set->queues[i];
+        // the queue is in order, stop once they get further away
+        unsigned int best = 0;
+        uint64_t best_diff = newest - _cam_set_time(q, 0);
+        for (unsigned int j = 1; j < q->n; j++) {
+            uint64_t t = _cam_set_time(q, j);
+            uint64_t diff = t > newest ? t - newest : newest - t;
+            if (diff >= best_diff) break;
+            best = j;
+            best_diff = diff;
+        }
+
+        while (best--) _cam_set_drop(set, q);
+        frames[i] = *_cam_set_frame(q, 0);
+        q->first = (q->first + 1) % q->cap;
+        q->n--;
+    }
+    return true;
+}
+
+bool camera_frameset_wait(Cam_Frameset *set, Cam_Frame *frames,
+        struct timeval *timeout)
+{
+    if (!set || !frames) return false;
+
+    long timeout_us = timeout ? timeout->tv_sec * 1000000 + timeout->tv_usec :
+        CAM_DEFAULT_TIMEOUT_US;
+    uint64_t deadline = camera_now_ns() + timeout_us * 1000ull;
+
+    for (;;) {
+        if (_cam_set_match(set, frames)) return true;
+
+        uint64_t now = camera_now_ns();
+        uint64_t left = deadline > now ? deadline - now : 0;
+        struct timeval tv = {
+            .tv_sec = left / 1000000000,
+            .tv_usec = left % 1000000000 / 1000,
+        };
+        int n = camera_poller_wait(set->poller, set->ready, set->count, &tv);
+        if (n <= 0) return false;
+
+        for (int i = 0; i < n; i++)
+            _cam_set_pull(set, set->ready[i]);
+    }
+}
+
+void camera_frameset_release(Cam_Frameset *set, Cam_Frame *frames)
+{
+    if (!set || !frames) return;
+    for (size_t i = 0; i < set->count; i++)
+        camera_release_frame(&frames[i]);
+}
+
+uint64_t camera_frameset_dropped(Cam_Frameset *set)
+{
+    return set ? set->dropped : 0;
+}
+
+void camera_frameset_destroy(Cam_Frameset *set)
+{
+    if (!set) return;
+
+    for (size_t i = 0; i < set->count; i++) {
+        _Cam_SetQueue *q = &set->queues[i];
+        while (q->n) {
+            camera_release_frame(_cam_set_frame(q, 0));
+            q->first = (q->first + 1) % q->cap;
+            q->n--;
+        }
+        camera_poller_remove(set->poller, q->cam);
+    }
+    for (size_t i = 0; i < set->n_queues; i++)
+        free(set->queues[i].frames);
+    if (set->poller) camera_poller_destroy(set->poller);
+    free(set->queues);
+    free(set->ready);
+    free(set);
+}
+
+// The single camera api, these all use _cam_default
+bool camera_begin()
+{
+    return camera_begin_ex(NULL);
+}
+
+bool camera_get_frame(Cam_Surface *surf, struct timeval *timeout)
+{
+    return camera_get_frame_ex(NULL, surf, timeout);
+}
+
+bool camera_get_frame_raw(Cam_Buffer *buf, struct timeval *timeout)
+{
+    return camera_get_frame_raw_ex(NULL, buf, timeout);
+}
+
+bool camera_acquire_frame(Cam_Frame *frame, struct timeval *timeout)
+{
+    return camera_acquire_frame_ex(NULL, frame, timeout);
+}
+
+bool camera_end()
+{
+    return camera_end_ex(NULL);
+}
+
+bool camera_close()
+{
+    return camera_close_ex(NULL);
+}
+
+#endif // CAMERA_IMPLEMENTATION
+#endif // CAMERA_H
 
-/* 
-    TODO:
-    - Conversion for MJPG to RGB24.
-    - Add framerate options
-    - Change fmt while camera is open
-        maybe VIDIOC_ENUM_FRAMESIZES, VIDIOC_ENUM_FMT, ...
-    - multiple camera's by storing state in a Cam_Camera structure or something
-*/
@@ -0,0 +1,472 @@
+/*
+    C++ layer over camera.h (needs C++17), include it instead of camera.h.
+
+    cam::convert turns YUV frames into RGB with the source format, the
+    destination format, the matrix (BT.601 or BT.709), the range (limited
+    or full) and a box decimation by 1, 2 or 4 fixed at compile time. The
+    coefficients are constexpr, so the compiler gets one branch-free loop
+    for the combination that is used instead of camera_get_frame's runtime
+    dispatch.
+
+    cam::Camera and cam::Frame own a Cam_Camera handle and an acquired frame,
+    the frame is released and the camera closed when they go out of scope.
+
+    The implementation of camera.h is C, it still has to be compiled in a
+    C file:
+        #define CAMERA_IMPLEMENTATION
+        #include "camera.h"
+*/
+
+#ifndef CAMERA_HPP
+#define CAMERA_HPP
+
+#ifdef CAMERA_IMPLEMENTATION
+#error "camera.h has to be implemented in a C file, camera.hpp only uses the declarations"
+#endif
+
+#include "camera.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+namespace cam {
+
+// the YUV to RGB matrix
+enum class Matrix {
+    bt601,
+    bt709,
+};
+
+// limited range has Y in 16-235 and U, V in 16-240 (what cameras send),
+// full range uses 0-255 for all of them (JPEG)
+enum class Range {
+    limited,
+    full,
+};
+
+namespace detail {
+
+template <Cam_PixelFormat>
+inline constexpr bool unsupported = false;
+
+// 8 fractional bits like camera.h, rounded away from 0
+constexpr int fixed(double x)
+{
+    return x < 0 ? int(x * 256 - 0.5) : int(x * 256 + 0.5);
+}
+
+} // namespace detail
+
+// Fixed point coefficients with 8 fractional bits, with u and v centered on 0:
+//   r = (y * (Y - y_offset) + ru * u + rv * v) >> 8
+//   g = (y * (Y - y_offset) + gu * u + gv * v) >> 8
+//   b = (y * (Y - y_offset) + bu * u + bv * v) >> 8
+template <Matrix M, Range R>
+struct Coefficients {
+    static constexpr double kr = M == Matrix::bt601 ? 0.299 : 0.2126;
+    static constexpr double kb = M == Matrix::bt601 ? 0.114 : 0.0722;
+    static constexpr double kg = 1 - kr - kb;
+    // limited range is stretched to 0-255
+    static constexpr double luma = R == Range::limited ? 255.0 / 219 : 1.0;
+    static constexpr double chroma = R == Range::limited ? 255.0 / 224 : 1.0;
+
+    static constexpr int y_offset = R == Range::limited ? 16 : 0;
+    static constexpr int y = detail::fixed(luma);
+    static constexpr int ru = 0;
+    static constexpr int rv = detail::fixed(chroma * 2 * (1 - kr));
+    static constexpr int gu = detail::fixed(-chroma * 2 * (1 - kb) * kb / kg);
+    static constexpr int gv = detail::fixed(-chroma * 2 * (1 - kr) * kr / kg);
+    static constexpr int bu = detail::fixed(chroma * 2 * (1 - kb));
+    static constexpr int bv = 0;
+};
+
+// the ones camera.h converts with, so the defaults match camera_get_frame
+// bit for bit
+template <>
+struct Coefficients<Matrix::bt601, Range::limited> {
+    static constexpr int y_offset = 16;
+    static constexpr int y = 298;
+    static constexpr int ru = -1;
+    static constexpr int rv = 409;
+    static constexpr int gu = -100;
+    static constexpr int gv = -210;
+    static constexpr int bu = 519;
+    static constexpr int bv = 0;
+};
+
+namespace detail {
+
+// byte offsets of the channels in a destination pixel, a < 0 without alpha
+template <Cam_PixelFormat Dst>
+struct Output {
+    static_assert(unsupported<Dst>, "the destination has to be one of the CAM_PIX_FMT_XXX");
+};
+template <>
+struct Output<CAM_PIX_FMT_RGB24> {
+    static constexpr int bpp = 3, r = 0, g = 1, b = 2, a = -1;
+};
+template <>
+struct Output<CAM_PIX_FMT_BGR24> {
+    static constexpr int bpp = 3, r = 2, g = 1, b = 0, a = -1;
+};
+template <>
+struct Output<CAM_PIX_FMT_RGBA32> {
+    static constexpr int bpp = 4, r = 0, g = 1, b = 2, a = 3;
+};
+template <>
+struct Output<CAM_PIX_FMT_BGRA32> {
+    static constexpr int bpp = 4, r = 2, g = 1, b = 0, a = 3;
+};
+// the Y plane is passed through, like camera.h does
+template <>
+struct Output<CAM_PIX_FMT_GREY> {
+    static constexpr int bpp = 1, r = 0, g = 0, b = 0, a = -1;
+};
+
+// 4:2:2 formats have the byte offsets of a macropixel (2 pixels), 4:2:0
+// formats say whether U and V are interleaved in one plane and which
+// comes first
+template <Cam_PixelFormat Src>
+struct Source {
+    static_assert(unsupported<Src>, "the source has to be a 4:2:2 or 4:2:0 YUV format");
+};
+template <>
+struct Source<V4L2_PIX_FMT_YUYV> {
+    static constexpr bool planar = false;
+    static constexpr int y0 = 0, u = 1, y1 = 2, v = 3;
+};
+template <>
+struct Source<V4L2_PIX_FMT_UYVY> {
+    static constexpr bool planar = false;
+    static constexpr int y0 = 1, u = 0, y1 = 3, v = 2;
+};
+template <>
+struct Source<V4L2_PIX_FMT_YVYU> {
+    static constexpr bool planar = false;
+    static constexpr int y0 = 0, u = 3, y1 = 2, v = 1;
+};
+template <>
+struct Source<V4L2_PIX_FMT_VYUY> {
+    static constexpr bool planar = false;
+    static constexpr int y0 = 1, u = 2, y1 = 3, v = 0;
+};
+template <>
+struct Source<V4L2_PIX_FMT_NV12> {
+    static constexpr bool planar = true, interleaved = true, v_first = false;
+};
+template <>
+struct Source<V4L2_PIX_FMT_NV21> {
+    static constexpr bool planar = true, interleaved = true, v_first = true;
+};
+template <>
+struct Source<V4L2_PIX_FMT_YUV420> {
+    static constexpr bool planar = true, interleaved = false, v_first = false;
+};
+template <>
+struct Source<V4L2_PIX_FMT_YVU420> {
+    static constexpr bool planar = true, interleaved = false, v_first = true;
+};
+
+inline unsigned char clamp(int x)
+{
+    return static_cast<unsigned char>(x < 0 ? 0 : x > 255 ? 255 : x);
+}
+
+// the mean of N samples, rounded like camera.h's 2x and 4x box paths
+template <unsigned N>
+constexpr int mean(unsigned sum)
+{
+    return static_cast<int>((sum + N / 2) / N);
+}
+
+// two pixels sharing u and v
+template <class C, class O>
+inline void put_pair(unsigned char *dst, int y0, int y1, int u, int v)
+{
+    if constexpr (O::bpp == 1) {
+        dst[0] = static_cast<unsigned char>(y0);
+        dst[1] = static_cast<unsigned char>(y1);
+    } else {
+        u -= 128;
+        v -= 128;
+        const int r = C::ru * u + C::rv * v;
+        const int g = C::gu * u + C::gv * v;
+        const int b = C::bu * u + C::bv * v;
+
+        const int ys[2] = { C::y * (y0 - C::y_offset), C::y * (y1 - C::y_offset) };
+        for (int i = 0; i < 2; i++, dst += O::bpp) {
+            dst[O::r] = clamp((ys[i] + r) >> 8);
+            dst[O::g] = clamp((ys[i] + g) >> 8);
+            dst[O::b] = clamp((ys[i] + b) >> 8);
+            if constexpr (O::a >= 0) dst[O::a] = 255;
+        }
+    }
+}
+
+// bytes of a frame with rows of stride bytes (the Y plane's for 4:2:0),
+// chroma planes have the same layout camera.h expects
+template <class S>
+constexpr size_t frame_size(size_t stride, size_t height)
+{
+    if constexpr (S::planar) {
+        const size_t chroma_rows = (height + 1) / 2;
+        return stride * height +
+            (S::interleaved ? stride : 2 * (stride / 2)) * chroma_rows;
+    } else {
+        return stride * height;
+    }
+}
+
+} // namespace detail
+
+// Convert a width x height frame of Src (any 4:2:2 or 4:2:0 V4L2_PIX_FMT_XXX
+// camera.h knows) at src into dst as Dst, one of the CAM_PIX_FMT_XXX.
+// src_stride is the size of a source row in bytes (of the Y plane for 4:2:0
+// formats, the chroma planes follow it like they do in a V4L2 buffer),
+// dst_stride that of a destination row, 0 means tightly packed.
+//
+// With a Decimate of 2 or 4 every output pixel is the mean of a Decimate x
+// Decimate block, so dst is width / Decimate x height / Decimate. For YUYV
+// and UYVY that matches camera_set_output_size with CAM_SCALE_BOX at half
+// or a quarter of the size bit for bit. The output width is rounded down
+// to an even number of pixels.
+template <Cam_PixelFormat Src, Cam_PixelFormat Dst = CAM_PIX_FMT_RGB24,
+         Matrix M = Matrix::bt601, Range R = Range::limited,
+         unsigned Decimate = 1>
+void convert(const void *src, size_t src_stride, size_t width, size_t height,
+        void *dst, size_t dst_stride = 0)
+{
+    static_assert(Decimate == 1 || Decimate == 2 || Decimate == 4,
+            "frames can be decimated by 1, 2 or 4");
+    using C = Coefficients<M, R>;
+    using O = detail::Output<Dst>;
+    using S = detail::Source<Src>;
+    constexpr unsigned K = Decimate;
+
+    const unsigned char *__restrict in = static_cast<const unsigned char *>(src);
+    unsigned char *__restrict out = static_cast<unsigned char *>(dst);
+    const size_t pairs = width / K / 2;
+    const size_t out_height = height / K;
+    if (!dst_stride) dst_stride = pairs * 2 * O::bpp;
+
+    if constexpr (S::planar) {
+        const size_t chroma_stride = S::interleaved ? src_stride : src_stride / 2;
+        const size_t chroma_rows = (height + 1) / 2;
+        const size_t step = S::interleaved ? 2 : 1;
+        const unsigned char *plane = in + src_stride * height;
+        // the second plane (or byte) is the other channel
+        const size_t second = S::interleaved ? 1 : chroma_stride * chroma_rows;
+        const unsigned char *u = plane + (S::v_first ? second : 0);
+        const unsigned char *v = plane + (S::v_first ? 0 : second);
+
+        for (size_t row = 0; row < out_height; row++) {
+            const unsigned char *y = in + row * K * src_stride;
+            unsigned char *d = out + row * dst_stride;
+            if constexpr (K == 1) {
+                const size_t chroma = row / 2 * chroma_stride;
+                for (size_t i = 0; i < pairs; i++)
+                    detail::put_pair<C, O>(d + i * 2 * O::bpp, y[2 * i],
+                            y[2 * i + 1], u[chroma + i * step],
+                            v[chroma + i * step]);
+            } else {
+                // K source rows share K / 2 chroma rows
+                const size_t chroma = row * K / 2 * chroma_stride;
+                for (size_t i = 0; i < pairs; i++) {
+                    unsigned y0 = 0, y1 = 0, su = 0, sv = 0;
+                    for (unsigned r = 0; r < K; r++) {
+                        const unsigned char *p = y + r * src_stride + i * 2 * K;
+                        for (unsigned j = 0; j < K; j++) {
+                            y0 += p[j];
+                            y1 += p[K + j];
+                        }
+                    }
+                    for (unsigned r = 0; r < K / 2; r++) {
+                        const size_t c = chroma + r * chroma_stride + i * K * step;
+                        for (unsigned j = 0; j < K; j++) {
+                            su += u[c + j * step];
+                            sv += v[c + j * step];
+                        }
+                    }
+                    detail::put_pair<C, O>(d + i * 2 * O::bpp,
+                            detail::mean<K * K>(y0), detail::mean<K * K>(y1),
+                            detail::mean<K * K / 2>(su),
+                            detail::mean<K * K / 2>(sv));
+                }
+            }
+        }
+    } else {
+        for (size_t row = 0; row < out_height; row++) {
+            const unsigned char *p = in + row * K * src_stride;
+            unsigned char *d = out + row * dst_stride;
+            if constexpr (K == 1) {
+                for (size_t i = 0; i < pairs; i++, p += 4)
+                    detail::put_pair<C, O>(d + i * 2 * O::bpp, p[S::y0],
+                            p[S::y1], p[S::u], p[S::v]);
+            } else {
+                // output pixels 2i and 2i + 1 cover macropixels [iK, iK + K)
+                for (size_t i = 0; i < pairs; i++, p += K * 4) {
+                    unsigned y0 = 0, y1 = 0, su = 0, sv = 0;
+                    for (unsigned r = 0; r < K; r++) {
+                        const unsigned char *q = p + r * src_stride;
+                        for (unsigned j = 0; j < K; j++) {
+                            // pixel j is in macropixel j / 2, K + j in
+                            // macropixel (K + j) / 2
+                            y0 += q[j / 2 * 4 + (j % 2 ? S::y1 : S::y0)];
+                            y1 += q[(K + j) / 2 * 4 + (j % 2 ? S::y1 : S::y0)];
+                            su += q[j * 4 + S::u];
+                            sv += q[j * 4 + S::v];
+                        }
+                    }
+                    detail::put_pair<C, O>(d + i * 2 * O::bpp,
+                            detail::mean<K * K>(y0), detail::mean<K * K>(y1),
+                            detail::mean<K * K>(su), detail::mean<K * K>(sv));
+                }
+            }
+        }
+    }
+}
+
+// Same for a buffer captured in fmt, false if fmt is not in Src or the
+// buffer is too short for it
+template <Cam_PixelFormat Src, Cam_PixelFormat Dst = CAM_PIX_FMT_RGB24,
+         Matrix M = Matrix::bt601, Range R = Range::limited,
+         unsigned Decimate = 1>
+bool convert(const Cam_Buffer &buf, const Cam_Format &fmt, void *dst,
+        size_t dst_stride = 0)
+{
+    size_t payload = buf.info.bytesused ? buf.info.bytesused : buf.length;
+    if (fmt.pixelformat != Src || !buf.ptr ||
+            payload < detail::frame_size<detail::Source<Src>>(fmt.stride, fmt.height))
+        return false;
+
+    convert<Src, Dst, M, R, Decimate>(buf.ptr, fmt.stride, fmt.width, fmt.height, dst,
+            dst_stride);
+    return true;
+}
+
+// A frame from Camera::acquire, given back to the driver when it is
+// destroyed or reset. It has to go before the camera it came from.
+class Frame {
+public:
+    Frame() = default;
+    // takes over a frame from camera_acquire_frame
+    explicit Frame(const Cam_Frame &frame) : frame_(frame), held_(true) {}
+
+    Frame(Frame &&other) noexcept
+        : frame_(other.frame_), held_(std::exchange(other.held_, false)) {}
+    Frame &operator=(Frame &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            frame_ = other.frame_;
+            held_ = std::exchange(other.held_, false);
+        }
+        return *this;
+    }
+    Frame(const Frame &) = delete;
+    Frame &operator=(const Frame &) = delete;
+    ~Frame() { reset(); }
+
+    // gives the frame back early
+    void reset()
+    {
+        if (held_) camera_release_frame(&frame_);
+        held_ = false;
+    }
+
+    explicit operator bool() const { return held_; }
+    const Cam_Buffer &buffer() const { return frame_.buffer; }
+    const Cam_FrameInfo &info() const { return frame_.buffer.info; }
+    const unsigned char *data() const
+    {
+        return static_cast<const unsigned char *>(frame_.buffer.ptr);
+    }
+    // the payload, some drivers leave bytesused at 0
+    size_t size() const
+    {
+        return frame_.buffer.info.bytesused ? frame_.buffer.info.bytesused
+            : frame_.buffer.length;
+    }
+    Cam_Frame *get() { return &frame_; }
+
+private:
+    Cam_Frame frame_{};
+    bool held_ = false;
+};
+
+// A camera opened with camera_open_ex, stopped and closed when it is
+// destroyed. get() gives the handle for everything else in camera.h, it is
+// nullptr when the open failed. camera.h takes a NULL handle to mean the
+// default camera, so check operator bool before passing get() on, or a
+// camera_xxx_ex call acts on the default camera instead.
+class Camera {
+public:
+    Camera() = default;
+    // check the result with operator bool, fmt is set like camera_open does
+    Camera(const char *device, Cam_Format &fmt, Cam_IoMethod io = IO_METHOD_MMAP)
+        : cam_(camera_open_ex(device, &fmt, io)) {}
+
+    Camera(Camera &&other) noexcept
+        : cam_(std::exchange(other.cam_, nullptr)),
+          running_(std::exchange(other.running_, false)) {}
+    Camera &operator=(Camera &&other) noexcept
+    {
+        if (this != &other) {
+            close();
+            cam_ = std::exchange(other.cam_, nullptr);
+            running_ = std::exchange(other.running_, false);
+        }
+        return *this;
+    }
+    Camera(const Camera &) = delete;
+    Camera &operator=(const Camera &) = delete;
+    ~Camera() { close(); }
+
+    void close()
+    {
+        end();
+        if (cam_) camera_close_ex(cam_);
+        cam_ = nullptr;
+    }
+
+    explicit operator bool() const { return cam_ != nullptr; }
+    Cam_Camera *get() const { return cam_; }
+
+    bool begin()
+    {
+        if (cam_ && !running_) running_ = camera_begin_ex(cam_);
+        return running_;
+    }
+    bool end()
+    {
+        if (!running_) return false;
+        running_ = false;
+        return camera_end_ex(cam_);
+    }
+
+    // an empty frame on timeout or errors
+    Frame acquire(struct timeval *timeout = nullptr)
+    {
+        Cam_Frame frame;
+        if (!cam_ || !camera_acquire_frame_ex(cam_, &frame, timeout))
+            return Frame();
+        return Frame(frame);
+    }
+    bool get_frame(Cam_Surface &surf, struct timeval *timeout = nullptr)
+    {
+        return cam_ && camera_get_frame_ex(cam_, &surf, timeout);
+    }
+    bool get_frame_raw(Cam_Buffer &buf, struct timeval *timeout = nullptr)
+    {
+        return cam_ && camera_get_frame_raw_ex(cam_, &buf, timeout);
+    }
+
+private:
+    Cam_Camera *cam_ = nullptr;
+    bool running_ = false;
+};
+
+} // namespace cam
+
+#endif // CAMERA_HPP
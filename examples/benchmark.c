@@ -0,0 +1,470 @@
+// Measures capture and conversion, every result is printed as one JSON
+// object per line on stdout so runs can be diffed or fed to a script.
+// Progress and errors go to stderr.
+//
+//   benchmark convert [-f FMT] [-s WxH] [-n ITERATIONS] [-t THREADS] [-r FILE]
+//       converts synthetic frames (or the raw frame in FILE, one buffer of
+//       fmt.sizeimage bytes e.g. written with camera_get_frame_raw) with
+//       every kernel the cpu supports, single threaded and with THREADS
+//       threads
+//
+//   benchmark capture [-d DEVICE] [-f FMT] [-s WxH] [-n FRAMES] [-t THREADS]
+//       captures FRAMES frames from DEVICE (/dev/video0 by default, "vivid"
+//       picks the first vivid device, see modprobe vivid) and reports the
+//       dequeue latency, conversion time, achieved fps and dropped frames
+//
+// FMT is a fourcc (YUYV, UYVY, NV12, NV21, YU12, YV12, GREY, RGBP, MJPG),
+// the convert mode runs every native format and a few sizes by default.
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#define CAMERA_IMPLEMENTATION
+#include "../camera.h"
+
+static const Cam_PixelFormat native_formats[] = {
+    V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_UYVY, V4L2_PIX_FMT_NV12,
+    V4L2_PIX_FMT_NV21, V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_YVU420,
+    V4L2_PIX_FMT_GREY, V4L2_PIX_FMT_RGB565,
+};
+
+static const struct { size_t width, height; } default_sizes[] = {
+    { 640, 480 }, { 1280, 720 }, { 1920, 1080 },
+};
+
+static const struct { Cam_PixelFormat format; const char *name; } outputs[] = {
+    { CAM_PIX_FMT_RGB24, "RGB24" },
+    { CAM_PIX_FMT_RGBA32, "RGBA32" },
+    { CAM_PIX_FMT_GREY, "GREY" },
+};
+
+// the kernel tables in the order _cam_select_kernels prefers them, the
+// ones after the table it picked are not supported by this cpu
+static const _Cam_Kernels *kernel_tables[] = {
+    &_cam_kernels_scalar,
+#if defined(_CAM_SIMD_X86)
+    &_cam_kernels_ssse3,
+    &_cam_kernels_avx2,
+#elif defined(_CAM_SIMD_NEON)
+    &_cam_kernels_neon,
+#endif
+};
+
+typedef struct {
+    const char *mode;
+    const char *device;
+    const char *file;
+    Cam_PixelFormat format;
+    size_t width;
+    size_t height;
+    unsigned int count;
+    unsigned int threads;
+} Options;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// sorts samples
+static uint64_t percentile(uint64_t *samples, size_t n, unsigned int p)
+{
+    if (!n) return 0;
+    qsort(samples, n, sizeof(*samples), compare_u64);
+    return samples[(n - 1) * p / 100];
+}
+
+static const char *fourcc(Cam_PixelFormat format, char name[5])
+{
+    memcpy(name, &format, 4);
+    name[4] = '\0';
+    return name;
+}
+
+// stride and size of a tightly packed frame
+static void frame_layout(Cam_Format *fmt)
+{
+    switch (fmt->pixelformat) {
+        case V4L2_PIX_FMT_GREY:
+            fmt->stride = fmt->width;
+            fmt->sizeimage = fmt->stride * fmt->height;
+            break;
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_NV21:
+        case V4L2_PIX_FMT_YUV420:
+        case V4L2_PIX_FMT_YVU420:
+            fmt->stride = fmt->width;
+            fmt->sizeimage = fmt->stride * fmt->height +
+                fmt->stride * ((fmt->height + 1) / 2);
+            break;
+        default:
+            fmt->stride = fmt->width * 2;
+            fmt->sizeimage = fmt->stride * fmt->height;
+            break;
+    }
+}
+
+// returns the number of bytes read, a short file is a compressed frame or
+// a truncated one and both convert what is there
+static size_t load_frame(const char *path, unsigned char *data, size_t size)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    size_t n = fread(data, 1, size, f);
+    fclose(f);
+    if (n == 0) fprintf(stderr, "%s is empty\n", path);
+    return n;
+}
+
+// converts the same frame over and over, returns false if the format can
+// not be converted at all
+static bool bench_convert_one(Cam_Camera *cam, Cam_Buffer *buf,
+        unsigned char *dst, unsigned int iterations, const char *kernel,
+        const char *output, unsigned int threads)
+{
+    uint64_t *samples = malloc(iterations * sizeof(*samples));
+    if (!samples) return false;
+
+    Cam_Surface surf;
+    // warm up the caches and the pool
+    for (int i = 0; i < 3; i++) {
+        if (_cam_convert(cam, &surf, buf, dst, cam->out_stride) != 1) {
+            free(samples);
+            return false;
+        }
+    }
+
+    for (unsigned int i = 0; i < iterations; i++) {
+        uint64_t start = now_ns();
+        _cam_convert(cam, &surf, buf, dst, cam->out_stride);
+        samples[i] = now_ns() - start;
+    }
+
+    double pixels = (double)cam->fmt.width * cam->fmt.height;
+    uint64_t min = percentile(samples, iterations, 0);
+    uint64_t median = percentile(samples, iterations, 50);
+    char name[5];
+    printf("{\"mode\":\"convert\",\"format\":\"%s\",\"width\":%zu,"
+            "\"height\":%zu,\"output\":\"%s\",\"kernel\":\"%s\","
+            "\"threads\":%u,\"iterations\":%u,\"ns_per_pixel\":%.4f,"
+            "\"min_ns_per_pixel\":%.4f,\"mpixels_per_s\":%.1f}\n",
+            fourcc(cam->fmt.pixelformat, name), cam->fmt.width,
+            cam->fmt.height, output, kernel, threads, iterations,
+            median / pixels, min / pixels, pixels * 1e3 / median);
+    fflush(stdout);
+    free(samples);
+    return true;
+}
+
+static bool bench_convert_format(const Options *opt, Cam_PixelFormat format,
+        size_t width, size_t height)
+{
+    Cam_Camera cam = _CAM_CAMERA_INIT;
+    cam.fmt = (Cam_Format){
+        .width = width,
+        .height = height,
+        .pixelformat = format,
+    };
+    frame_layout(&cam.fmt);
+    _cam_select_kernels(&cam);
+    const _Cam_Kernels *best = cam.kernels;
+
+    unsigned char *src = malloc(cam.fmt.sizeimage);
+    unsigned char *dst = malloc(width * height * 4);
+    if (!src || !dst) {
+        free(src);
+        free(dst);
+        return false;
+    }
+    Cam_Buffer buf = { .ptr = src, .length = cam.fmt.sizeimage, .dmabuf_fd = -1 };
+    if (opt->file) {
+        buf.info.bytesused = load_frame(opt->file, src, cam.fmt.sizeimage);
+        if (!buf.info.bytesused) {
+            free(src);
+            free(dst);
+            return false;
+        }
+    } else {
+        srand(1);
+        for (size_t i = 0; i < cam.fmt.sizeimage; i++)
+            src[i] = rand();
+    }
+
+#ifdef CAM_USE_TURBOJPEG
+    if (_cam_is_jpeg(format)) cam.jpeg = tjInitDecompress();
+#endif
+
+    bool ret = true;
+    for (size_t o = 0; o < sizeof(outputs) / sizeof(*outputs); o++) {
+        cam.out_format = outputs[o].format;
+        cam.out_packed = true;
+        _cam_update_output(&cam);
+
+        bool supported = true;
+        for (size_t k = 0; supported &&
+                k < sizeof(kernel_tables) / sizeof(*kernel_tables); k++) {
+            cam.kernels = kernel_tables[k];
+            const char *kernel = _cam_is_jpeg(format) ? "turbojpeg"
+                : cam.kernels->name;
+
+            unsigned int runs[2] = { 1, opt->threads };
+            for (int r = 0; supported && r < (opt->threads > 1 ? 2 : 1); r++) {
+                if (!camera_set_conversion_threads(&cam, runs[r], NULL, 0))
+                    continue;
+                supported = bench_convert_one(&cam, &buf, dst, opt->count,
+                        kernel, outputs[o].name, runs[r]);
+            }
+            if (!supported) {
+                char name[5];
+                fprintf(stderr, "Can not convert %s to %s\n",
+                        fourcc(format, name), outputs[o].name);
+                ret = false;
+            }
+
+            // the rest is not supported, jpeg does not use the kernels
+            if (cam.kernels == best || _cam_is_jpeg(format)) break;
+        }
+    }
+
+    camera_set_conversion_threads(&cam, 1, NULL, 0);
+#ifdef CAM_USE_TURBOJPEG
+    if (cam.jpeg) tjDestroy(cam.jpeg);
+#endif
+    _cam_unmap_frames(cam.rgb_buffer, cam.rgb_buffer_size);
+    free(src);
+    free(dst);
+    return ret;
+}
+
+static int bench_convert(const Options *opt)
+{
+    for (size_t f = 0; f < sizeof(native_formats) / sizeof(*native_formats); f++) {
+        Cam_PixelFormat format = opt->format ? opt->format : native_formats[f];
+        for (size_t s = 0; s < sizeof(default_sizes) / sizeof(*default_sizes); s++) {
+            size_t width = opt->width ? opt->width : default_sizes[s].width;
+            size_t height = opt->height ? opt->height : default_sizes[s].height;
+            bench_convert_format(opt, format, width, height);
+            if (opt->width) break;
+        }
+        if (opt->format) break;
+    }
+    return 0;
+}
+
+// the first device driven by vivid, the virtual test driver
+static const char *find_vivid(void)
+{
+    static char path[sizeof(((struct dirent *)0)->d_name) + 8];
+    DIR *dir = opendir("/dev");
+    if (!dir) return NULL;
+
+    const char *found = NULL;
+    struct dirent *entry;
+    while (!found && (entry = readdir(dir))) {
+        if (strncmp(entry->d_name, "video", 5)) continue;
+        snprintf(path, sizeof(path), "/dev/%s", entry->d_name);
+
+        int fd = open(path, O_RDWR | O_NONBLOCK);
+        if (fd < 0) continue;
+        struct v4l2_capability cap;
+        if (ioctl(fd, VIDIOC_QUERYCAP, &cap) == 0 &&
+                !strcmp((const char *)cap.driver, "vivid") &&
+                (cap.device_caps & V4L2_CAP_VIDEO_CAPTURE))
+            found = path;
+        close(fd);
+    }
+    closedir(dir);
+    return found;
+}
+
+static int bench_capture(const Options *opt)
+{
+    const char *device = opt->device;
+    if (device && !strcmp(device, "vivid")) {
+        device = find_vivid();
+        if (!device) {
+            fprintf(stderr, "No vivid device, try modprobe vivid\n");
+            return 1;
+        }
+    }
+
+    Cam_Format fmt = {
+        .width = opt->width,
+        .height = opt->height,
+        .pixelformat = opt->format,
+    };
+    Cam_Camera *cam = camera_open_ex(device, &fmt, IO_METHOD_MMAP);
+    if (!cam) return 1;
+    if (opt->threads > 1)
+        camera_set_conversion_threads(cam, opt->threads, NULL, 0);
+    camera_set_latency_stats(cam, true);
+    if (!camera_begin_ex(cam)) {
+        camera_close_ex(cam);
+        return 1;
+    }
+
+    uint64_t *latency = calloc(opt->count, sizeof(*latency));
+    uint64_t *convert = calloc(opt->count, sizeof(*convert));
+    unsigned char *dst = malloc(cam->out_stride * cam->out_height + 1);
+    if (!latency || !convert || !dst) return 1;
+
+    size_t frames = 0, n_latency = 0, n_convert = 0, dropped = 0;
+    uint64_t first = 0, last = 0;
+    unsigned int sequence = 0;
+    const char *kernel = "none";
+    while (frames < opt->count) {
+        struct timeval timeout = { .tv_sec = 2 };
+        Cam_Frame frame;
+        if (!camera_acquire_frame_ex(cam, &frame, &timeout)) {
+            fprintf(stderr, "No frame within 2 seconds\n");
+            break;
+        }
+        uint64_t dequeued = now_ns();
+        const Cam_FrameInfo *info = &frame.buffer.info;
+
+        if (info->clock == CAM_CLOCK_MONOTONIC && info->timestamp_ns &&
+                info->timestamp_ns <= dequeued)
+            latency[n_latency++] = dequeued - info->timestamp_ns;
+        if (frames && info->sequence > sequence + 1)
+            dropped += info->sequence - sequence - 1;
+        sequence = info->sequence;
+        if (!frames) first = dequeued;
+        last = dequeued;
+
+        Cam_Surface surf;
+        uint64_t start = now_ns();
+        int converted = _cam_convert(cam, &surf, &frame.buffer, dst,
+                cam->out_stride);
+        if (converted == 1) {
+            convert[n_convert++] = now_ns() - start;
+            kernel = _cam_is_jpeg(cam->fmt.pixelformat) ? "turbojpeg"
+                : cam->kernels->name;
+        }
+
+        camera_release_frame(&frame);
+        frames++;
+    }
+
+    double pixels = (double)cam->fmt.width * cam->fmt.height;
+    double fps = frames > 1 && last > first
+        ? (frames - 1) * 1e9 / (last - first) : 0;
+    size_t n = n_latency;
+    uint64_t lat_max = percentile(latency, n, 100);
+    uint64_t lat_p99 = percentile(latency, n, 99);
+    uint64_t lat_p50 = percentile(latency, n, 50);
+    uint64_t conv_p50 = percentile(convert, n_convert, 50);
+    Cam_Stats stats;
+    camera_get_stats(cam, &stats);
+    const Cam_Histogram *dqbuf = &stats.latency[CAM_STAGE_DEQUEUE];
+    char name[5];
+    printf("{\"mode\":\"capture\",\"device\":\"%s\",\"driver\":\"%s\","
+            "\"format\":\"%s\",\"width\":%zu,\"height\":%zu,"
+            "\"requested_fps\":%.2f,\"kernel\":\"%s\",\"threads\":%u,"
+            "\"frames\":%zu,\"fps\":%.2f,\"dropped\":%zu,"
+            "\"dequeue_latency_us_p50\":%.1f,\"dequeue_latency_us_p99\":%.1f,"
+            "\"dequeue_latency_us_max\":%.1f,\"convert_ns_per_pixel\":%.4f,"
+            "\"dqbuf_us_p50\":%.1f,\"eagain\":%llu,\"timeouts\":%llu,"
+            "\"min_queued\":%u}\n",
+            cam->dev_name, (const char *)cam->capability.driver,
+            fourcc(cam->fmt.pixelformat, name), cam->fmt.width,
+            cam->fmt.height, cam->fmt.fps.den
+                ? (double)cam->fmt.fps.num / cam->fmt.fps.den : 0.0,
+            kernel, opt->threads ? opt->threads : 1, frames, fps, dropped,
+            lat_p50 / 1e3, lat_p99 / 1e3, lat_max / 1e3,
+            n_convert ? conv_p50 / pixels : 0.0,
+            camera_histogram_percentile(dqbuf, 0.5) / 1e3,
+            (unsigned long long)stats.eagain,
+            (unsigned long long)stats.timeouts, stats.min_queued);
+
+    free(latency);
+    free(convert);
+    free(dst);
+    camera_end_ex(cam);
+    camera_close_ex(cam);
+    return frames ? 0 : 1;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s convert [-f FMT] [-s WxH] [-n ITERATIONS] "
+            "[-t THREADS] [-r FILE]\n"
+            "       %s capture [-d DEVICE|vivid] [-f FMT] [-s WxH] "
+            "[-n FRAMES] [-t THREADS]\n", name, name);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    Options opt = { .mode = argv[1] };
+    bool capture = !strcmp(opt.mode, "capture");
+    if (!capture && strcmp(opt.mode, "convert")) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (int i = 2; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (arg[0] != '-' || !arg[1] || arg[2] || !value) {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+
+        switch (arg[1]) {
+            case 'd': opt.device = value; break;
+            case 'r': opt.file = value; break;
+            case 'n': opt.count = strtoul(value, NULL, 0); break;
+            case 't': opt.threads = strtoul(value, NULL, 0); break;
+            case 'f':
+                if (strlen(value) != 4) {
+                    fprintf(stderr, "%s is not a fourcc\n", value);
+                    return 1;
+                }
+                opt.format = v4l2_fourcc(value[0], value[1], value[2], value[3]);
+                break;
+            case 's':
+                if (sscanf(value, "%zux%zu", &opt.width, &opt.height) != 2) {
+                    fprintf(stderr, "%s is not a WxH size\n", value);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (opt.file && (!opt.format || !opt.width)) {
+        fprintf(stderr, "-r needs the -f and -s of the recorded frame\n");
+        return 1;
+    }
+    if (!capture && !opt.file && (opt.format == V4L2_PIX_FMT_MJPEG ||
+                opt.format == V4L2_PIX_FMT_JPEG)) {
+        fprintf(stderr, "Synthetic frames are not valid jpegs, use -r\n");
+        return 1;
+    }
+    if (!opt.count) opt.count = capture ? 300 : 100;
+    if (!opt.threads) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        opt.threads = capture ? 1 : (cpus > 1 ? cpus : 1);
+    }
+
+    camera_set_log_level(CAM_WARN);
+    return capture ? bench_capture(&opt) : bench_convert(&opt);
+}